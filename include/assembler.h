@@ -0,0 +1,89 @@
+#ifndef MOMIJI_ASSEMBLER_H
+#define MOMIJI_ASSEMBLER_H
+
+#include "Common.h"
+#include "Value.h"
+
+// A tiny x86-64 emitter shared by the baseline JIT and the trace compiler.
+
+typedef enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R14 = 14,
+    R15 = 15
+} Register;
+
+typedef enum {
+    CONDITION_EQUAL = 0x4,
+    CONDITION_NOT_EQUAL = 0x5,
+    CONDITION_ABOVE = 0x7,
+    CONDITION_LESS = 0xc,
+    CONDITION_GREATER_EQUAL = 0xd,
+    CONDITION_ALWAYS = 0xff
+} Condition;
+
+#define MOVSD_LOAD      0x10
+#define MOVSD_STORE     0x11
+#define MOVDQU_LOAD     0x6f
+#define MOVDQU_STORE    0x7f
+#define ADDSD           0x58
+#define MULSD           0x59
+#define SUBSD           0x5c
+#define DIVSD           0x5e
+#define UCOMISD         0x2e
+#define CVTTSD2SI       0x2c
+#define CVTSI2SD        0x2a
+#define SSE_DOUBLE      0xf2
+#define SSE_UNALIGNED   0xf3
+#define SSE_COMPARE     0x66
+
+typedef struct {
+    int at;         // Position of the rel32 to patch.
+    int target;     // Label the jump goes to (its meaning is up to the user of the assembler).
+} AsmFixup;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+
+    AsmFixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+} Assembler;
+
+void Emit(Assembler* as, uint8_t byte);
+void Emit32(Assembler* as, uint32_t value);
+void Emit64(Assembler* as, uint64_t value);
+
+void EmitLoad(Assembler* as, int reg, int base, int32_t displacement);
+void EmitStore(Assembler* as, int base, int32_t displacement, int reg);
+void EmitLoadAddress(Assembler* as, int reg, int base, int32_t displacement);
+void EmitLoadImmediate(Assembler* as, int reg, uint64_t value);
+void EmitStoreImmediate(Assembler* as, int base, int32_t displacement, int32_t value);
+void EmitAddImmediate(Assembler* as, int base, int32_t displacement, int8_t value);
+void EmitCompareType(Assembler* as, int base, int32_t displacement, ValueType type);
+void EmitCompareZeroByte(Assembler* as, int base, int32_t displacement);
+void EmitCompareRegister32(Assembler* as, int reg, int base, int32_t displacement);
+void EmitIncrement32(Assembler* as, int base, int32_t displacement);
+void EmitSse(Assembler* as, uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t displacement);
+void EmitSseRegister(Assembler* as, uint8_t prefix, uint8_t opcode, int destination, int source);
+void EmitMoveToXmm(Assembler* as, int xmm, int reg);
+void EmitSetAbove(Assembler* as);
+void EmitCall(Assembler* as, void* function);
+
+int EmitJump(Assembler* as, Condition condition);
+void PatchJump(Assembler* as, int at, int target);
+void EmitJumpTo(Assembler* as, Condition condition, int label);
+
+uint8_t* AsmFinish(Assembler* as, size_t* size);
+void AsmFree(Assembler* as);
+void AsmRelease(uint8_t* code, size_t size);
+
+#endif
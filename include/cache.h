@@ -0,0 +1,22 @@
+#ifndef MOMIJI_CACHE_H
+#define MOMIJI_CACHE_H
+
+#include "Common.h"
+#include "Object.h"
+
+// Compiled scripts are cached next to their source ("script.mj" -> "script.mjc"), so running the same unchanged
+// script again skips scanning and compiling.
+
+// Bump whenever the bytecode (opcodes, their operands, the natives' order) or the file layout changes.
+#define MJC_VERSION 7
+
+// Identifies the build, so a cache is only used by the compiler that wrote it, even if nobody bumped the version.
+// The Makefile sets it to a checksum of the sources; other builds fall back on when cache.c was compiled.
+#ifndef MJC_BUILD
+    #define MJC_BUILD __DATE__ " " __TIME__
+#endif
+
+ObjFunction* CacheLoad(const char* path, MJ_Source* source);
+void CacheWrite(const char* path, MJ_Source* source, ObjFunction* function);
+
+#endif
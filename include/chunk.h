@@ -3,6 +3,7 @@
 
 #include "Common.h" //Common stuff.
 #include "Value.h"  //Value and ValueArray.
+#include "Source.h" //Source code chunks are compiled from.
 
 typedef enum {
     OP_CONSTANT,        //Represents a constant value.
@@ -35,6 +36,7 @@ typedef enum {
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+    OP_CONSTRUCTOR,     //Like OP_METHOD, for the method named after the class.
     
     OP_EQUAL,
     OP_NOT_EQUAL,
@@ -54,6 +56,24 @@ typedef enum {
     OP_MOD,
     OP_BITWISE_OR,
     OP_BITWISE_AND,
+    OP_ADD_RK,          //Register ops: both operands are RK bytes read straight from the frame.
+    OP_SUBTRACT_RK,
+    OP_MULTIPLY_RK,
+    OP_DIVIDE_RK,
+    OP_GREATER_RK,
+    OP_SMALLER_RK,
+    OP_ADD_NUM,         //Quickened forms: rewritten in place once the operands are seen to be numbers.
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_SMALLER_NUM,
+    OP_ADD_RK_NUM,
+    OP_SUBTRACT_RK_NUM,
+    OP_MULTIPLY_RK_NUM,
+    OP_DIVIDE_RK_NUM,
+    OP_GREATER_RK_NUM,
+    OP_SMALLER_RK_NUM,
     OP_NOT,
     OP_NEGATE,          //Negates a value.
     OP_PRINT,
@@ -61,35 +81,47 @@ typedef enum {
     OP_JUMP,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,       //A call in return position: the callee takes over the caller's frame.
+    OP_CALL_NATIVE,     //Calls vm->natives[operand 1] with operand 2 arguments, with no callee on the stack.
+    OP_LEN,             //len(x) done inline. The operand is the native to call instead once its global is reassigned.
+    OP_CLOCK,           //clock() done inline, with the same operand.
     OP_INVOKE,
     OP_SUPER_INVOKE,
+    OP_SUPER_CONSTRUCT, //super(...) in a constructor: calls the superclass's constructor on this.
     OP_CLOSURE,
+    OP_CLOSURE_STACK,   //Like OP_CLOSURE, for a closure that never outlives the frame: its upvalues point straight at the stack.
+    OP_YIELD,           //Hands the value on top to whoever resumed the fiber, and leaves what it's resumed with next.
     OP_RETURN,          //Return from current function.
 } MJ_OpCode;
 
-typedef struct {
-    int offset;
-    int line;
-    char* content;
-} MJ_LineStart;
+// An RK operand is either a frame slot (0 - 127) or, with the high bit set, a constant index (0 - 127).
+#define RK_CONSTANT 0x80
+#define RK_MAX      0x7f
 
 typedef struct {
     int count;              // Number of elements in array.
     int capacity;           // Number of available slots.
     uint8_t* code;          // Instruction elements.
     ValueArray constants;   // Array of constant values.
-    MJ_LineStart* lines;    // Contains number of instruction elements per line.
-    int lineCount;          // Current line in program.
-    int lineCapacity;       // Total capacity of the Lines array.
+    uint8_t* lines;         // Line runs: the varint offset delta and zigzag varint line delta of each run's start.
+    int lineBytes;          // Bytes used in the lines array.
+    int lineCapacity;       // Total capacity of the lines array.
+    int lastOffset;         // Offset and line of the last run, which the next delta is taken from.
+    int lastLine;
+    MJ_Source* source;      // Source the chunk was compiled from, or NULL.
 } MJ_Chunk;
 
 void MJ_ChunkInit(MJ_Chunk* chunk);                                             // Initializes a chunk.
-void MJ_ChunkWrite(MJ_Chunk* chunk, uint8_t byte, int line, char* source);      // Writes an instruction byte to a chunk array.
-void MJ_ChunkWriteLong(MJ_Chunk* chunk, long number, int line, char* source);
+void MJ_ChunkWrite(MJ_Chunk* chunk, uint8_t byte, int line);                    // Writes an instruction byte to a chunk array.
+void MJ_ChunkWriteLong(MJ_Chunk* chunk, long number, int line);
 int MJ_ChunkAddConstant(MJ_Chunk* chunk, Value value);                          // Writes a constant to the constant array inside a chunk.
 int MJ_ChunkWriteConstant(MJ_Chunk* chunk, Value value);
+void MJ_ChunkTruncate(MJ_Chunk* chunk, int count);                             // Drops every byte (and line run) from count onwards.
+void MJ_ChunkRemove(MJ_Chunk* chunk, int offset, int length);                  // Drops length bytes at offset, moving the rest down.
+int MJ_ChunkInstructionLength(MJ_Chunk* chunk, int offset);                   // Size of the instruction (opcode and operands) at offset.
 int MJ_ChunkGetLine(MJ_Chunk* chunk, int instruction);
-char* MJ_ChunkGetSource(MJ_Chunk* chunk, int instruction);
+bool MJ_ChunkLinesValid(MJ_Chunk* chunk);                                      // Whether the line table decodes to its last run.
+const char* MJ_ChunkGetSource(MJ_Chunk* chunk, int instruction, int* length);
 void MJ_ChunkFree(MJ_Chunk* chunk);
 
 #endif
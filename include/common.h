@@ -5,10 +5,44 @@
 #include <stdbool.h>    //Includes boolean types and values.
 #include <stddef.h>     //Includes standard type definitions (and NULL).
 
+// NO_DEBUG_OUTPUT leaves the printing below out, so only what scripts print is printed (make check-jit uses it).
+#ifndef NO_DEBUG_OUTPUT
 #define DEBUG_TRACE_EXECUTION
 #define DEBUG_PRINT_CODE
 //#define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
+#endif
+
+#define ENABLE_JIT      // Translates hot functions to native code (only on x86-64 Linux).
+#define ENABLE_PARALLEL_COMPILE // Compiles the top-level functions of large scripts on several threads (POSIX only).
+#define ENABLE_THREADS  // spawn, join and channels: functions running on VMs of their own (POSIX only).
+#define ENABLE_PARALLEL_GC  // Marks large heaps on several threads (POSIX only).
+
+// Storage private to each thread, for the compiler's and scanner's state.
+#if defined(__GNUC__) || defined(__clang__)
+    #define THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL
+#endif
+
+// Reference counts of things shared between threads (sources, channels...). Both give the new count.
+// ATOMIC_LOAD and ATOMIC_STORE are for flags that threads poll without taking a lock, and ATOMIC_EXCHANGE (which
+// gives the old value) for flags that only one of several threads may set.
+#if defined(__GNUC__) || defined(__clang__)
+    #define ATOMIC_INCREMENT(counter) __atomic_add_fetch(&(counter), 1, __ATOMIC_ACQ_REL)
+    #define ATOMIC_DECREMENT(counter) __atomic_sub_fetch(&(counter), 1, __ATOMIC_ACQ_REL)
+    #define ATOMIC_LOAD(flag) __atomic_load_n(&(flag), __ATOMIC_ACQUIRE)
+    #define ATOMIC_STORE(flag, value) __atomic_store_n(&(flag), (value), __ATOMIC_RELEASE)
+    #define ATOMIC_EXCHANGE(flag, value) __atomic_exchange_n(&(flag), (value), __ATOMIC_ACQ_REL)
+#else
+    #define ATOMIC_INCREMENT(counter) (++(counter))
+    #define ATOMIC_DECREMENT(counter) (--(counter))
+    #define ATOMIC_LOAD(flag) (flag)
+    #define ATOMIC_STORE(flag, value) ((flag) = (value))
+    // No ATOMIC_EXCHANGE, so the collector marks on one thread.
+#endif
 
 #define COLOR_RED     "\x1b[91m"
 #define COLOR_CYAN    "\x1b[96m"
@@ -5,7 +5,12 @@
 #include "VM.h"
 #include "Object.h"
 
+// Stack slots every function gets on top of what CompilerHold counts: its locals (UINT8_COUNT at most), and the
+// values a single instruction or native pushes for a moment.
+#define BASE_STACK_SIZE (UINT8_COUNT * 2)
+
 ObjFunction* Compile(const char* source);
+ObjFunction* CompileSource(MJ_Source* source);
 void CompilerMarkRoots();
 
 #endif
\ No newline at end of file
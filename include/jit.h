@@ -0,0 +1,38 @@
+#ifndef MOMIJI_JIT_H
+#define MOMIJI_JIT_H
+
+#include "Common.h"
+#include "Object.h"
+#include "VM.h"
+
+// The baseline JIT only knows how to emit x86-64 and uses mmap for its executable memory.
+#if defined(ENABLE_JIT) && defined(__x86_64__) && defined(__linux__)
+    #define JIT_AVAILABLE
+#endif
+
+// Default number of calls after which a function is translated to native code (see VMSetJit).
+#ifndef JIT_THRESHOLD
+    #define JIT_THRESHOLD 64
+#endif
+
+typedef enum {
+    JIT_CONTINUE,   // (Slow paths and loop hooks) Carry on where we were.
+    JIT_EXIT,       // Native code stopped (a call, a return, a failed guard...), so the interpreter takes over from frame->ip.
+    JIT_ERROR       // A runtime error was already reported.
+} JitStatus;
+
+// Signature of translated code: entry is where to start running.
+typedef JitStatus (*JitFunction)(CallFrame* frame, uint8_t* entry);
+
+struct JitCode {
+    uint8_t* code;          // Executable memory holding the translated function.
+    size_t size;            // Size of the mapping.
+    uint32_t* entries;      // Native offset of every bytecode offset that starts an instruction.
+    int entryCount;
+};
+
+void JitCompile(ObjFunction* function);
+JitStatus JitEnter(CallFrame* frame);
+void JitFree(JitCode* jit);
+
+#endif
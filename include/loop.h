@@ -0,0 +1,64 @@
+#ifndef MOMIJI_LOOP_H
+#define MOMIJI_LOOP_H
+
+#include <sys/types.h>
+
+#include "Common.h"
+#include "Object.h"
+
+#if defined(__linux__)
+    #define EVENT_LOOP_AVAILABLE
+#endif
+
+// Each VM has an event loop (made the first time something waits on it) that watches file descriptors with epoll.
+// The natives that would block (sleep, readFile, writeFile, exec) start an operation on it instead, and the fiber
+// that called them waits: its caller carries on, and the VM resumes the fiber once the operation is over. Files
+// that can't be watched (regular files are always "ready") are read or written straight away.
+
+// How many ready descriptors one wait on the loop handles at most.
+#define LOOP_EVENTS_MAX 64
+
+typedef struct Loop Loop;
+
+typedef enum {
+    LOOP_TIMER,
+    LOOP_READ,
+    LOOP_WRITE,
+    LOOP_PROCESS                // exec once the command's output has ended: waiting for the command to exit.
+} LoopKind;
+
+typedef struct LoopOperation {
+    ObjFiber* fiber;            // Fiber waiting on the operation.
+    const char* name;           // Native that started it, for error messages.
+    LoopKind kind;
+    int descriptor;
+    bool watched;               // Whether epoll watches the descriptor (regular files can't be).
+    pid_t process;              // Command whose output is read (0 if there is none, or once it's reaped).
+    int status;                 // The command's exit status, once it's reaped.
+    char* buffer;               // Bytes read so far, or the bytes to write.
+    size_t length;
+    size_t capacity;
+    size_t written;
+    int error;                  // errno of the call that failed, or 0.
+    struct LoopOperation* previous;
+    struct LoopOperation* next;
+} LoopOperation;
+
+#ifdef EVENT_LOOP_AVAILABLE
+
+Loop* LoopNew();
+void LoopFree(Loop* loop);
+bool LoopPending(Loop* loop);
+void LoopMark(Loop* loop);
+
+bool LoopSleep(Loop* loop, ObjFiber* fiber, double seconds);
+bool LoopReadFile(Loop* loop, ObjFiber* fiber, const char* path);
+bool LoopWriteFile(Loop* loop, ObjFiber* fiber, const char* path, const char* text, size_t length);
+bool LoopCommand(Loop* loop, ObjFiber* fiber, const char* command);
+
+LoopOperation* LoopWait(Loop* loop);
+void LoopOperationFree(LoopOperation* operation);
+
+#endif
+
+#endif
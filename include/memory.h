@@ -15,7 +15,32 @@
 
 #define FREE_ARRAY(type, pointer, oldCount) reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Bump allocator for scratch data that lives exactly as long as something else (a compilation, say). It doesn't
+// go through reallocate, so it neither counts towards the heap nor starts collections, and it's freed all at once.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks;     // Newest block first, which is the one allocations come from.
+} Arena;
+
+#define ARENA_ALLOCATE(arena, type, count) (type*)ArenaAllocate(arena, sizeof(type) * (count))
+
+#define ARENA_GROW_ARRAY(arena, type, pointer, oldCount, newCount) \
+    (type*)ArenaGrow(arena, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void HeapShare(bool shared);
+void HeapLock();
+void HeapUnlock();
+void ArenaInit(Arena* arena);
+void* ArenaAllocate(Arena* arena, size_t size);
+void* ArenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+void ArenaFree(Arena* arena);
 void MarkObject(Object* object);
 void MarkValue(Value value);
 void CollectGarbage();
@@ -17,18 +17,24 @@
 #define IS_CLASS(value)         IsObjectType(value, OBJ_CLASS)
 #define IS_INSTANCE(value)      IsObjectType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value)  IsObjectType(value, OBJ_BOUND_METHOD)
+#define IS_THREAD(value)        IsObjectType(value, OBJ_THREAD)
+#define IS_CHANNEL(value)       IsObjectType(value, OBJ_CHANNEL)
+#define IS_FIBER(value)         IsObjectType(value, OBJ_FIBER)
 
 
 #define AS_STRING(value)        ((ObjString*)AS_OBJECT(value))
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJECT(value))->chars)
 #define AS_ARRAY(value)         ((ObjArray*)AS_OBJECT(value))
 #define AS_MAP(value)           ((ObjMap*)AS_OBJECT(value))
-#define AS_NATIVE(value)        (((ObjNative*)AS_OBJECT(value))->function)
+#define AS_NATIVE(value)        ((ObjNative*)AS_OBJECT(value))
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJECT(value))
 #define AS_CLOSURE(value)       ((ObjClosure*)AS_OBJECT(value))
 #define AS_CLASS(value)         ((ObjClass*)AS_OBJECT(value))
 #define AS_INSTANCE(value)      ((ObjInstance*)AS_OBJECT(value))
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJECT(value))
+#define AS_THREAD(value)        ((ObjThread*)AS_OBJECT(value))
+#define AS_CHANNEL(value)       ((ObjChannel*)AS_OBJECT(value))
+#define AS_FIBER(value)         ((ObjFiber*)AS_OBJECT(value))
 
 typedef enum {
     OBJ_STRING,
@@ -43,7 +49,11 @@ typedef enum {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
-    OBJ_STATIC_METHOD
+    OBJ_STATIC_METHOD,
+
+    OBJ_THREAD,
+    OBJ_CHANNEL,
+    OBJ_FIBER
 } ObjectType;
 
 struct Object {
@@ -52,19 +62,40 @@ struct Object {
     struct Object* next;
 };
 
+typedef struct JitCode JitCode;
+typedef struct Trace Trace;
+
 typedef struct {
     Object object;
     int arity;
     int upvalueCount;
+    int stackSize;      // Stack slots a call may use (locals and temporaries), reserved when it gets a frame.
     MJ_Chunk chunk;
     ObjString* name;
+    int callCount;      // Number of calls so far (the JIT compiles the function once it gets hot).
+    JitCode* jit;       // Native code for the function, or NULL if it hasn't been compiled.
+    Trace* traces;      // Hot loop bookkeeping (and their compiled traces), one per loop header seen.
+    int traceCount;
+    bool hidden;        // Left out of tracebacks (InterpretCall's caller, which isn't part of the script).
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argumentCount, Value* arguments);
 
+#define NATIVE_VARIADIC -1  // Arity of natives that take a varying number of arguments (and check it themselves).
+
+typedef enum {
+    NATIVE_ALLOCATES    = 1 << 0,   // May allocate objects, and so start a collection.
+    NATIVE_SUSPENDS     = 1 << 1    // May make the calling fiber wait on the event loop, so other fibers run.
+} NativeFlags;
+
 typedef struct {
     Object object;
     NativeFn function;
+    ObjString* name;    // Global the native was defined as.
+    int arity;          // Number of arguments, checked by the VM before the call (or NATIVE_VARIADIC).
+    uint8_t flags;      // NativeFlags.
+    bool shadowed;      // Whether its global has been assigned since, so OP_CALL_NATIVE has to look it up again.
+    uint8_t intrinsic;  // Opcode that does the native's work inline (OP_CALL_NATIVE if there is none).
 } ObjNative;
 
 struct ObjString {
@@ -72,6 +103,7 @@ struct ObjString {
     int length;
     char* chars;
     uint32_t hash;
+    int methodSlot;     // Where methods with this name sit in classes' vtables (-1 until one is defined).
 };
 
 typedef struct {
@@ -89,21 +121,59 @@ typedef struct ObjUpvalue {
     Object object;
     Value* location;
     Value closed;
-    struct ObjUpvalue* next;
+    struct ObjUpvalue* next;        // Neighbours in vm->openUpvalues while the upvalue is open.
+    struct ObjUpvalue* previous;
 } ObjUpvalue;
 
+typedef enum {
+    FIBER_NEW,          // Not resumed yet: its stack only holds its function.
+    FIBER_SUSPENDED,    // Stopped at a yield.
+    FIBER_RUNNING,      // Running, or waiting on a fiber it resumed.
+    FIBER_WAITING,      // Waiting on the event loop, which resumes it (and nothing else may).
+    FIBER_DONE          // Returned (or failed), so it can't be resumed again.
+} FiberState;
+
+struct CallFrame;
+
+// A stack of calls of its own, which runs until it yields and carries on from there when it's resumed. The VM
+// runs one fiber at a time, straight on that fiber's stack and frames: switching copies these fields in and out
+// of the VM, so they only mean something while the fiber isn't the one running.
+typedef struct ObjFiber {
+    Object object;
+    struct CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+    ObjUpvalue** openSlots;
+    struct ObjFiber* caller;    // Fiber that resumed it, while it's running (NULL for the VM's main fiber).
+    struct ObjFiber* nextFiber; // Next in vm->fibers.
+    FiberState state;
+} ObjFiber;
+
 typedef struct {
     Object object;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalueCount;
+    bool onStack;                   // Made by OP_CLOSURE_STACK: the upvalues are cells after the array, not objects.
+    ObjUpvalue* upvalues[];         // Allocated along with the closure.
 } ObjClosure;
 
+// Size of a closure with room for count upvalues (and, for one made on the stack, the cells they point at).
+#define CLOSURE_SIZE(count) (sizeof(ObjClosure) + sizeof(ObjUpvalue*) * (count))
+#define STACK_CLOSURE_SIZE(count) (CLOSURE_SIZE(count) + sizeof(ObjUpvalue) * (count))
+
+// The cells of a closure made on the stack.
+#define STACK_CLOSURE_CELLS(closure) ((ObjUpvalue*)&(closure)->upvalues[(closure)->upvalueCount])
+
 typedef struct {
     Object object;
     ObjString* className;
-    ValueArray methodNames;
+    ValueArray methodNames; // Name of the method in each vtable slot (slots are shared by names, see DefineMethod).
     Table methods;
+    ValueArray vtable;  // The methods again, indexed by their name's methodSlot (NULL_VALUE where there is none).
     Table defaultFields;
     Value constructor;
 } ObjClass;
@@ -113,6 +183,7 @@ typedef struct {
     ObjClass* class;
     ValueArray fieldNames;
     Table fields;
+    Table boundMethods;     // Methods taken off the instance as values, so taking one again doesn't allocate.
 } ObjInstance;
 
 typedef struct {
@@ -121,9 +192,24 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+typedef struct Worker Worker;
+typedef struct Channel Channel;
+
+// Handles on things shared with other VMs (see Thread.h). Each VM holding one has an object of its own for it.
+typedef struct {
+    Object object;
+    Worker* worker;
+} ObjThread;
+
+typedef struct {
+    Object object;
+    Channel* channel;
+} ObjChannel;
+
 ObjClosure* ClosureNew(ObjFunction* function);
+ObjClosure* StackClosureNew(ObjFunction* function);
 ObjFunction* FunctionNew();
-ObjNative* NativeNew(NativeFn function);
+ObjNative* NativeNew(NativeFn function, ObjString* name, int arity, uint8_t flags);
 
 ObjArray* ArrayNew();
 ObjMap* MapNew();
@@ -137,6 +223,11 @@ ObjClass* ClassNew(ObjString* name);
 ObjInstance* InstanceNew(ObjClass* classObject);
 ObjBoundMethod* BoundMethodNew(Value receiver, ObjClosure* method);
 
+ObjThread* ThreadNew(Worker* worker);
+ObjChannel* ChannelNew(Channel* channel);
+ObjFiber* FiberNew(ObjClosure* function);
+void FiberFreeStack(ObjFiber* fiber);
+
 void ObjectPrint(Value value);
 
 static inline bool IsObjectType(Value value, ObjectType type) {
@@ -70,6 +70,7 @@ typedef enum {
     TOKEN_IS,
     TOKEN_AS,
     TOKEN_AFTER,
+    TOKEN_YIELD,
 
     TOKEN_ERROR,
     TOKEN_EOF
@@ -82,9 +83,17 @@ typedef struct {
     int line;
 } Token;
 
-void ScannerInit(const char* source);
+typedef struct {
+    const char* start;
+    const char* current;
+    const char* end;    // End of the source, which needn't be null-terminated (a mapped file isn't).
+    int line;
+} Scanner;
+
+void ScannerInit(const char* source, int length);
+Scanner ScannerSave();                  // Where the scanner is, to carry on from there later (or elsewhere).
+void ScannerRestore(Scanner state);
 
-char* ScannerGetSource();
 Token ScannerScanToken();
 
 #endif
\ No newline at end of file
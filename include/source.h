@@ -0,0 +1,21 @@
+#ifndef MOMIJI_SOURCE_H
+#define MOMIJI_SOURCE_H
+
+#include "Common.h"
+
+// Source code shared by every chunk compiled from it (error messages quote lines from it).
+typedef struct {
+    const char* text;       // Source code: length characters, null-terminated unless they are a mapped file.
+    int length;
+    int references;         // Chunks (and compilers) holding on to it, on any thread (counted atomically).
+    size_t mapped;          // Size of the file mapping text points into, or 0 if text is a heap copy.
+} MJ_Source;
+
+MJ_Source* MJ_SourceNew(const char* text);                                      // Copies source code into a shared buffer.
+MJ_Source* MJ_SourceOpen(const char* path);                                     // Maps (or reads) a script file.
+void MJ_SourceUnmap(MJ_Source* source);                                         // Swaps a mapped file for a copy.
+MJ_Source* MJ_SourceRetain(MJ_Source* source);
+void MJ_SourceRelease(MJ_Source* source);
+const char* MJ_SourceLine(MJ_Source* source, int line, int* length);            // Text of a line (without indentation).
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef MOMIJI_THREAD_H
+#define MOMIJI_THREAD_H
+
+#include "Common.h"
+#include "Object.h"
+#include "VM.h"
+
+#if defined(ENABLE_THREADS) && (defined(__unix__) || defined(__APPLE__))
+    #define THREADS_AVAILABLE
+#endif
+
+// A spawned function runs on a VM of its own, on its own OS thread. Heaps are never shared, so values only cross
+// between VMs as messages: one VM writes them into a buffer that belongs to no heap, and the other reads copies
+// back out of it. Numbers, booleans, null, strings, arrays, maps, natives, channels and functions that capture no
+// variables can be sent (a function brings its constants along, nested functions included).
+
+// How deeply arrays and maps may nest in a message (which also stops arrays that contain themselves).
+#define MESSAGE_DEPTH_MAX 256
+
+// parallelMap runs on a thread per core, up to POOL_THREADS_MAX, and splits the array into about
+// POOL_CHUNKS_PER_THREAD chunks per thread, so there is something left to steal when some chunks are slower.
+#define POOL_THREADS_MAX        64
+#define POOL_CHUNKS_PER_THREAD  8
+
+typedef struct Message Message;
+
+#ifdef THREADS_AVAILABLE
+
+Message* MessageNew();
+void MessageFree(Message* message);
+bool MessageWrite(VM* instance, Message* message, Value value, const char** error);
+ObjArray* MessageRead(VM* instance, Message* message);
+
+Worker* WorkerSpawn(int argumentCount, Value* arguments, const char** error);
+Message* WorkerJoin(Worker* worker, const char** error);
+void WorkerRelease(Worker* worker);
+
+Channel* ChannelOpen();
+Channel* ChannelRetain(Channel* channel);
+void ChannelRelease(Channel* channel);
+void ChannelSend(Channel* channel, Message* message);
+Message* ChannelReceive(Channel* channel);
+
+bool ParallelMap(ObjArray* array, Value function, ObjArray* results, const char** error);
+
+#endif
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef MOMIJI_TRACE_H
+#define MOMIJI_TRACE_H
+
+#include "Common.h"
+#include "Object.h"
+#include "JIT.h"
+
+// Default number of back-edges to a loop header before one iteration of the loop gets recorded (see VMSetJit).
+#ifndef TRACE_THRESHOLD
+    #define TRACE_THRESHOLD 32
+#endif
+
+#define TRACE_MAX_LENGTH 256    // Longest iteration (in instructions) that gets recorded.
+#define TRACE_MAX_ABORTS 3      // Failed recordings before a loop is left to the interpreter for good.
+
+struct Trace {
+    int anchor;         // Offset of the loop header the trace starts and ends at.
+    int hits;           // Back-edges seen since the last recording attempt.
+    int aborts;         // Recordings that didn't make it back to the anchor.
+    uint8_t* code;      // Native code for one iteration of the loop (which loops back on itself), or NULL.
+    size_t size;
+};
+
+JitStatus TraceLoop(CallFrame* frame);
+void TraceFreeAll(ObjFunction* function);
+
+#endif
@@ -5,22 +5,44 @@
 #include "Chunk.h"
 #include "Value.h"
 #include "Table.h"
+#include "Loop.h"
 
-#define FRAMES_MAX 1000
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#if defined(ENABLE_PARALLEL_COMPILE) && (defined(__unix__) || defined(__APPLE__))
+    #define PARALLEL_COMPILE_AVAILABLE
+    #include <pthread.h>
+#endif
 
-typedef struct {
+// Default limit on the call depth (see VMSetMaxFrames). The stack and frames only take what is actually used.
+#ifndef DEFAULT_MAX_FRAMES
+    #define DEFAULT_MAX_FRAMES 100000
+#endif
+
+#define STACK_INITIAL   UINT8_COUNT     // Values the stack starts with.
+#define FRAMES_INITIAL  16              // Frames the frame array starts with.
+#define NATIVES_MAX     64              // Natives the VM can define (OP_CALL_NATIVE indexes them with a byte).
+
+typedef struct CallFrame {
     ObjClosure* closure;
     uint8_t* ip;
     Value* slots;
 } CallFrame;
 
+// Bytes taken by a value stack (with its openSlots) or a frame array of some capacity. A fiber's count towards
+// the heap, so making many of them starts collections.
+#define STACK_BYTES(capacity)   ((size_t)(capacity) * (sizeof(Value) + sizeof(ObjUpvalue*)))
+#define FRAMES_BYTES(capacity)  ((size_t)(capacity) * sizeof(CallFrame))
+
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
+    int maxFrames;
+    int jitThreshold;           // Calls before a function is translated to native code (0 never translates).
+    int traceThreshold;         // Back-edges before a loop gets traced (0 never traces).
 
-    Value Stack[STACK_MAX];
+    Value* Stack;
     Value* stackTop;
+    int stackCapacity;
     Table strings;
     Table globals;
     Object* objects;
@@ -28,11 +50,23 @@ typedef struct {
     int grayCapacity;
     Object** grayStack;
     Object** safeguardStack;
-    ObjUpvalue* openUpvalues;
+    ObjUpvalue* openUpvalues;   // Newest first, so the top frame's upvalues come before those of the frames below.
+    ObjUpvalue** openSlots;     // Open upvalue of each stack slot (NULL if there is none), sized like Stack.
+    ObjFiber* fiber;            // Fiber the stack and frames above belong to (the main one unless one was resumed).
+    ObjFiber* fibers;           // Every fiber, so those about to be freed can close their upvalues first.
+    Loop* loop;                 // Event loop, made the first time a fiber waits on I/O or a timer (NULL until then).
     ObjString* initString;
+    ObjNative* natives[NATIVES_MAX];    // Natives in the order they were defined, for OP_CALL_NATIVE.
+    int nativeCount;
 
     size_t allocatedBytes;
     size_t nextCollection;
+
+    bool heapShared;            // Compile threads allocate from this VM too (see HeapShare).
+#ifdef PARALLEL_COMPILE_AVAILABLE
+    pthread_mutex_t heapMutex;
+    bool heapMutexReady;
+#endif
 } VM;
 
 typedef enum {
@@ -50,16 +84,23 @@ typedef struct {
 #define COMPILE_ERROR(value) ((InterpretResult){INTERPRET_COMPILE_ERROR, (Value)value})
 #define RUNTIME_OK(value) ((InterpretResult){INTERPRET_OK, (Value)value})
 
-extern VM vm;
+// The VM the current thread is working on. Every function taking a VM makes it the current one until it returns,
+// and everything below those (the compiler, the heap, natives, JIT code...) works on the current one.
+extern THREAD_LOCAL VM* vm;
 
-void VMInit();
-void VMFree();
+VM* VMNew();
+void VMFree(VM* instance);
+void VMSetMaxFrames(VM* instance, int maxFrames);
+void VMSetJit(VM* instance, int jitThreshold, int traceThreshold);
+void VMSetGlobal(VM* instance, ObjString* name, Value value);
 
-InterpretResult Interpret(const char* sourceFile);
-InterpretResult InterpretChunk(MJ_Chunk* chunk);
+InterpretResult Interpret(VM* instance, const char* source);
+InterpretResult InterpretFile(VM* instance, const char* path, MJ_Source* source);
+InterpretResult InterpretCall(VM* instance, int argumentCount);
+InterpretResult VMStep(VM* instance);
 
-void Push(Value value);
-Value Pop();
-Value PopN(int n);
+void Push(VM* instance, Value value);
+Value Pop(VM* instance);
+Value PopN(VM* instance, int n);
 
 #endif
\ No newline at end of file
@@ -5,9 +5,9 @@
 #include "Utilities.h"
 
 inline void MJ_ArrayAdd(ObjArray* array, Value value) {
-    Push(value);
+    Push(vm, value);
     ValueArrayWrite(&array->items, value);
-    Pop();
+    Pop(vm);
 }
 
 bool MJ_ArraySet(ObjArray* array, Value index, Value value) {
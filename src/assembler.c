@@ -0,0 +1,240 @@
+#define _DEFAULT_SOURCE // For MAP_ANONYMOUS.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "JIT.h"
+
+#ifdef JIT_AVAILABLE
+
+#include <sys/mman.h>
+
+#include "Assembler.h"
+
+void Emit(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        as->capacity = (as->capacity < 256) ? 256 : as->capacity * 2;
+        as->code = realloc(as->code, as->capacity);
+        if (as->code == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the JIT.\n");
+            exit(1);
+        }
+    }
+
+    as->code[as->count++] = byte;
+}
+
+void Emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        Emit(as, (uint8_t)(value >> (i * 8)));
+}
+
+void Emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        Emit(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void EmitRex(Assembler* as, bool wide, int reg, int base) {
+    uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (rex != 0x40)
+        Emit(as, rex);
+}
+
+/// @brief [INTERNAL] Emits the ModRM byte and displacement for [base + displacement].
+/// rsp and r12 are never used as bases, so no SIB byte is needed.
+static void EmitMemory(Assembler* as, int reg, int base, int32_t displacement) {
+    uint8_t registers = ((reg & 7) << 3) | (base & 7);
+
+    if (displacement == 0 && (base & 7) != RBP) {
+        Emit(as, registers);
+    } else if (displacement >= -128 && displacement <= 127) {
+        Emit(as, 0x40 | registers);
+        Emit(as, (uint8_t)displacement);
+    } else {
+        Emit(as, 0x80 | registers);
+        Emit32(as, (uint32_t)displacement);
+    }
+}
+
+// mov reg, qword [base + displacement]
+void EmitLoad(Assembler* as, int reg, int base, int32_t displacement) {
+    EmitRex(as, true, reg, base);
+    Emit(as, 0x8b);
+    EmitMemory(as, reg, base, displacement);
+}
+
+// mov qword [base + displacement], reg
+void EmitStore(Assembler* as, int base, int32_t displacement, int reg) {
+    EmitRex(as, true, reg, base);
+    Emit(as, 0x89);
+    EmitMemory(as, reg, base, displacement);
+}
+
+// lea reg, [base + displacement]
+void EmitLoadAddress(Assembler* as, int reg, int base, int32_t displacement) {
+    EmitRex(as, true, reg, base);
+    Emit(as, 0x8d);
+    EmitMemory(as, reg, base, displacement);
+}
+
+// mov reg, imm64
+void EmitLoadImmediate(Assembler* as, int reg, uint64_t value) {
+    EmitRex(as, true, 0, reg);
+    Emit(as, 0xb8 + (reg & 7));
+    Emit64(as, value);
+}
+
+// mov qword [base + displacement], imm32 (sign extended)
+void EmitStoreImmediate(Assembler* as, int base, int32_t displacement, int32_t value) {
+    EmitRex(as, true, 0, base);
+    Emit(as, 0xc7);
+    EmitMemory(as, 0, base, displacement);
+    Emit32(as, (uint32_t)value);
+}
+
+// add qword [base + displacement], imm8
+void EmitAddImmediate(Assembler* as, int base, int32_t displacement, int8_t value) {
+    EmitRex(as, true, 0, base);
+    Emit(as, 0x83);
+    EmitMemory(as, 0, base, displacement);
+    Emit(as, (uint8_t)value);
+}
+
+// cmp dword [base + displacement], imm8
+void EmitCompareType(Assembler* as, int base, int32_t displacement, ValueType type) {
+    EmitRex(as, false, 0, base);
+    Emit(as, 0x83);
+    EmitMemory(as, 7, base, displacement);
+    Emit(as, (uint8_t)type);
+}
+
+// cmp byte [base + displacement], 0
+void EmitCompareZeroByte(Assembler* as, int base, int32_t displacement) {
+    EmitRex(as, false, 0, base);
+    Emit(as, 0x80);
+    EmitMemory(as, 7, base, displacement);
+    Emit(as, 0);
+}
+
+// cmp reg32, dword [base + displacement]
+void EmitCompareRegister32(Assembler* as, int reg, int base, int32_t displacement) {
+    EmitRex(as, false, reg, base);
+    Emit(as, 0x3b);
+    EmitMemory(as, reg, base, displacement);
+}
+
+// inc dword [base + displacement]
+void EmitIncrement32(Assembler* as, int base, int32_t displacement) {
+    EmitRex(as, false, 0, base);
+    Emit(as, 0xff);
+    EmitMemory(as, 0, base, displacement);
+}
+
+// SSE instruction with a memory operand (movsd, movdqu, addsd...).
+void EmitSse(Assembler* as, uint8_t prefix, uint8_t opcode, int xmm, int base, int32_t displacement) {
+    Emit(as, prefix);
+    EmitRex(as, false, xmm, base);
+    Emit(as, 0x0f);
+    Emit(as, opcode);
+    EmitMemory(as, xmm, base, displacement);
+}
+
+// SSE instruction between two of xmm0 - xmm7.
+void EmitSseRegister(Assembler* as, uint8_t prefix, uint8_t opcode, int destination, int source) {
+    Emit(as, prefix);
+    Emit(as, 0x0f);
+    Emit(as, opcode);
+    Emit(as, 0xc0 | (destination << 3) | source);
+}
+
+// movq xmm, reg
+void EmitMoveToXmm(Assembler* as, int xmm, int reg) {
+    Emit(as, 0x66);
+    EmitRex(as, true, xmm, reg);
+    Emit(as, 0x0f);
+    Emit(as, 0x6e);
+    Emit(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+// rax = (flags say "above") ? 1 : 0, for turning a ucomisd into a bool.
+void EmitSetAbove(Assembler* as) {
+    Emit(as, 0x0f); // seta al
+    Emit(as, 0x97);
+    Emit(as, 0xc0);
+    Emit(as, 0x0f); // movzx eax, al
+    Emit(as, 0xb6);
+    Emit(as, 0xc0);
+}
+
+// Calls a C function through rax (arguments are set up by the caller).
+void EmitCall(Assembler* as, void* function) {
+    EmitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)function);
+    Emit(as, 0xff); // call rax
+    Emit(as, 0xd0);
+}
+
+/// @brief Emits a jump (conditional or not).
+/// @return Position of the jump's rel32, to be given to PatchJump.
+int EmitJump(Assembler* as, Condition condition) {
+    if (condition == CONDITION_ALWAYS) {
+        Emit(as, 0xe9);
+    } else {
+        Emit(as, 0x0f);
+        Emit(as, 0x80 | condition);
+    }
+
+    Emit32(as, 0);
+    return as->count - 4;
+}
+
+void PatchJump(Assembler* as, int at, int target) {
+    uint32_t relative = (uint32_t)(target - (at + 4));
+    memcpy(&as->code[at], &relative, sizeof(relative));
+}
+
+/// @brief Emits a jump to a label whose position isn't known yet. The user resolves as->fixups at the end.
+void EmitJumpTo(Assembler* as, Condition condition, int label) {
+    int at = EmitJump(as, condition);
+
+    if (as->fixupCapacity < as->fixupCount + 1) {
+        as->fixupCapacity = (as->fixupCapacity < 16) ? 16 : as->fixupCapacity * 2;
+        as->fixups = realloc(as->fixups, sizeof(AsmFixup) * as->fixupCapacity);
+        if (as->fixups == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the JIT.\n");
+            exit(1);
+        }
+    }
+
+    as->fixups[as->fixupCount++] = (AsmFixup){at, label};
+}
+
+/// @brief Copies the assembled code to executable memory and frees the assembler.
+/// @param size Set to the size of the mapping.
+/// @return The executable code, or NULL if it couldn't be mapped.
+uint8_t* AsmFinish(Assembler* as, size_t* size) {
+    *size = (size_t)as->count;
+    uint8_t* code = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (code != MAP_FAILED) {
+        memcpy(code, as->code, *size);
+        mprotect(code, *size, PROT_READ | PROT_EXEC);
+    } else {
+        code = NULL;
+    }
+
+    AsmFree(as);
+    return code;
+}
+
+void AsmFree(Assembler* as) {
+    free(as->code);
+    free(as->fixups);
+    *as = (Assembler){0};
+}
+
+void AsmRelease(uint8_t* code, size_t size) {
+    munmap(code, size);
+}
+
+#endif
@@ -0,0 +1,510 @@
+#define _DEFAULT_SOURCE // For mmap.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Cache.h"
+#include "Compiler.h"
+#include "Memory.h"
+#include "VM.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define CACHE_AVAILABLE
+#endif
+
+#ifdef CACHE_AVAILABLE
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout (integers in the machine's byte order, since the cache never leaves the machine that wrote it):
+//  header:     "MJC\0", version, build hash, last opcode, source length, source hash.
+//  function:   name, arity, upvalueCount, stackSize, code, line table, constants (nested functions inline).
+// Line tables are stored as they are encoded in the chunk; the source they quote comes from the script itself.
+// Strings are a length followed by their bytes, with a length of -1 for NULL.
+// A function is checked after it's read (see CheckFunction), since the file is only trusted as far as its header.
+
+#define CACHE_MAGIC "MJC"
+
+typedef enum {
+    CONSTANT_NULL,
+    CONSTANT_BOOL,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+} ConstantTag;
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    bool failed;        // Something couldn't be serialized (or memory ran out), so nothing gets written.
+} CacheWriter;
+
+typedef struct {
+    const uint8_t* at;
+    const uint8_t* end;
+    bool failed;        // The file was cut short or holds something we don't know, so it gets ignored.
+} CacheReader;
+
+/// @brief [INTERNAL] 64 bit FNV-1a of the source (or of MJC_BUILD), which a cache has to match to be used.
+static uint64_t HashSource(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/// @brief [INTERNAL] Path of the cache for a script: its extension becomes ".mjc" (or ".mjc" is appended).
+/// @return The path, to be freed by the caller, or NULL.
+static char* CachePath(const char* path) {
+    size_t length = strlen(path);
+    if (length >= 3 && strcmp(path + length - 3, ".mj") == 0)
+        length -= 3;
+
+    char* cachePath = malloc(length + 5);
+    if (cachePath == NULL)
+        return NULL;
+
+    memcpy(cachePath, path, length);
+    memcpy(cachePath + length, ".mjc", 5);
+    return cachePath;
+}
+
+static void WriteBytes(CacheWriter* writer, const void* bytes, size_t count) {
+    if (writer->failed)
+        return;
+
+    if (writer->capacity < writer->count + count) {
+        size_t capacity = (writer->capacity < 1024) ? 1024 : writer->capacity;
+        while (capacity < writer->count + count)
+            capacity *= 2;
+
+        uint8_t* grown = realloc(writer->bytes, capacity);
+        if (grown == NULL) {
+            writer->failed = true;
+            return;
+        }
+
+        writer->bytes = grown;
+        writer->capacity = capacity;
+    }
+
+    memcpy(writer->bytes + writer->count, bytes, count);
+    writer->count += count;
+}
+
+static void WriteInt(CacheWriter* writer, int32_t value) {
+    WriteBytes(writer, &value, sizeof(value));
+}
+
+static void WriteText(CacheWriter* writer, const char* chars, int length) {
+    WriteInt(writer, (chars == NULL) ? -1 : length);
+    if (chars != NULL)
+        WriteBytes(writer, chars, (size_t)length);
+}
+
+static void WriteFunction(CacheWriter* writer, ObjFunction* function) {
+    WriteText(writer, function->name ? function->name->chars : NULL, function->name ? function->name->length : 0);
+    WriteInt(writer, function->arity);
+    WriteInt(writer, function->upvalueCount);
+    WriteInt(writer, function->stackSize);
+
+    MJ_Chunk* chunk = &function->chunk;
+    WriteInt(writer, chunk->count);
+    WriteBytes(writer, chunk->code, (size_t)chunk->count);
+
+    WriteInt(writer, chunk->lineBytes);
+    WriteBytes(writer, chunk->lines, (size_t)chunk->lineBytes);
+    WriteInt(writer, chunk->lastOffset);
+    WriteInt(writer, chunk->lastLine);
+
+    WriteInt(writer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+
+        if (IS_NULL(constant)) {
+            WriteInt(writer, CONSTANT_NULL);
+        } else if (IS_BOOL(constant)) {
+            WriteInt(writer, CONSTANT_BOOL);
+            WriteInt(writer, AS_BOOL(constant));
+        } else if (IS_NUMBER(constant)) {
+            double number = AS_NUMBER(constant);
+            WriteInt(writer, CONSTANT_NUMBER);
+            WriteBytes(writer, &number, sizeof(number));
+        } else if (IS_STRING(constant)) {
+            WriteInt(writer, CONSTANT_STRING);
+            WriteText(writer, AS_CSTRING(constant), AS_STRING(constant)->length);
+        } else if (IS_FUNCTION(constant)) {
+            WriteInt(writer, CONSTANT_FUNCTION);
+            WriteFunction(writer, AS_FUNCTION(constant));
+        } else {
+            // Only the compiler's constants are known here.
+            writer->failed = true;
+        }
+    }
+}
+
+static void ReadBytes(CacheReader* reader, void* bytes, size_t count) {
+    if (reader->failed || (size_t)(reader->end - reader->at) < count) {
+        reader->failed = true;
+        memset(bytes, 0, count);
+        return;
+    }
+
+    memcpy(bytes, reader->at, count);
+    reader->at += count;
+}
+
+static int32_t ReadInt(CacheReader* reader) {
+    int32_t value;
+    ReadBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+/// @brief [INTERNAL] Reads a length that has to be between 0 and what is left of the file.
+static int ReadCount(CacheReader* reader) {
+    int32_t count = ReadInt(reader);
+    if (count < 0 || count > reader->end - reader->at) {
+        reader->failed = true;
+        return 0;
+    }
+    return count;
+}
+
+/// @brief [INTERNAL] Reads a string written by WriteText, pointing straight into the file.
+/// @param length Set to the string's length.
+/// @return The characters, or NULL for a NULL string (or a broken file).
+static const char* ReadText(CacheReader* reader, int* length) {
+    *length = ReadInt(reader);
+    if (*length == -1 || reader->failed)
+        return NULL;
+
+    if (*length < 0 || *length > reader->end - reader->at) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const char* chars = (const char*)reader->at;
+    reader->at += *length;
+    return chars;
+}
+
+/// @brief [INTERNAL] Whether an operand indexes one of a function's constants (a string, if it names something).
+static bool CheckConstant(ObjFunction* function, int index, bool isName) {
+    ValueArray* constants = &function->chunk.constants;
+    return index < constants->count && (!isName || IS_STRING(constants->values[index]));
+}
+
+/// @brief [INTERNAL] Whether an RK operand is a local or constant the function has.
+static bool CheckRK(ObjFunction* function, uint8_t operand) {
+    if (operand & RK_CONSTANT)
+        return CheckConstant(function, operand & RK_MAX, false);
+    return operand < function->stackSize;
+}
+
+/// @brief [INTERNAL] Makes sure a function read from a cache only reaches what it has: every instruction is
+/// whole, every operand indexes a constant, local, upvalue or native that exists, and every jump lands in the code.
+/// (Its nested functions have already been checked, as they were read before it.)
+/// @return false if the cache has to be ignored.
+static bool CheckFunction(ObjFunction* function) {
+    MJ_Chunk* chunk = &function->chunk;
+
+    // The compiler never holds more values than it emitted instructions for.
+    if (function->arity < 0 || function->arity > UINT8_MAX ||
+        function->upvalueCount < 0 || function->upvalueCount > UINT8_MAX ||
+        function->stackSize < BASE_STACK_SIZE || function->stackSize > BASE_STACK_SIZE + chunk->count ||
+        !MJ_ChunkLinesValid(chunk))
+        return false;
+
+    uint8_t instruction = OP_NULL;
+    for (int offset = 0; offset < chunk->count;) {
+        instruction = chunk->code[offset];
+        if (instruction > OP_RETURN)
+            return false;
+
+        // Closures are as long as the function they make has upvalues, so that has to be known first.
+        bool isClosure = instruction == OP_CLOSURE || instruction == OP_CLOSURE_STACK;
+        if (isClosure && (offset + 1 >= chunk->count || !CheckConstant(function, chunk->code[offset + 1], false) ||
+                          !IS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]])))
+            return false;
+
+        int length = MJ_ChunkInstructionLength(chunk, offset);
+        if (length > chunk->count - offset)
+            return false;
+
+        uint8_t* operands = &chunk->code[offset + 1];
+        int jump = (length == 3) ? (operands[0] << 8) | operands[1] : 0;
+
+        switch (instruction) {
+            case OP_CONSTANT:
+                if (!CheckConstant(function, operands[0], false))
+                    return false;
+                break;
+            case OP_CONSTANT_LONG: {
+                uint32_t index = ((uint32_t)operands[0] << 24) | (operands[1] << 16) | (operands[2] << 8) | operands[3];
+                if (index >= (uint32_t)chunk->constants.count)
+                    return false;
+                break;
+            }
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_SET_PROPERTY:
+            case OP_GET_PROPERTY:
+            case OP_INIT_PROPERTY:
+            case OP_GET_SUPER:
+            case OP_CLASS:
+            case OP_METHOD:
+            case OP_CONSTRUCTOR:
+            case OP_INVOKE:
+            case OP_SUPER_INVOKE:
+                if (!CheckConstant(function, operands[0], true))
+                    return false;
+                break;
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                if (operands[0] >= function->stackSize)
+                    return false;
+                break;
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+                if (operands[0] >= function->upvalueCount)
+                    return false;
+                break;
+            case OP_CALL_NATIVE:
+            case OP_LEN:
+            case OP_CLOCK:
+                if (operands[0] >= vm->nativeCount)
+                    return false;
+                break;
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                if (jump > chunk->count - offset - length)
+                    return false;
+                break;
+            case OP_LOOP:
+                if (jump > offset + length)
+                    return false;
+                break;
+            case OP_ADD_RK:
+            case OP_SUBTRACT_RK:
+            case OP_MULTIPLY_RK:
+            case OP_DIVIDE_RK:
+            case OP_GREATER_RK:
+            case OP_SMALLER_RK:
+            case OP_ADD_RK_NUM:
+            case OP_SUBTRACT_RK_NUM:
+            case OP_MULTIPLY_RK_NUM:
+            case OP_DIVIDE_RK_NUM:
+            case OP_GREATER_RK_NUM:
+            case OP_SMALLER_RK_NUM:
+                if (!CheckRK(function, operands[0]) || !CheckRK(function, operands[1]))
+                    return false;
+                break;
+            case OP_CLOSURE:
+            case OP_CLOSURE_STACK:
+                // Captured locals are bytes, which the stack always has room for; captured upvalues are ours.
+                for (int i = 1; i < length - 1; i += 2) {
+                    if (!operands[i] && operands[i + 1] >= function->upvalueCount)
+                        return false;
+                }
+                break;
+            default:
+                break;
+        }
+
+        offset += length;
+    }
+
+    // Every function ends in a return, so the interpreter never runs off the end of the code.
+    return instruction == OP_RETURN;
+}
+
+/// @brief [INTERNAL] Rebuilds a function. It sits on the VM stack while it's filled in, so a collection
+/// started by its own allocations doesn't take it.
+/// @param source The script's source, which the function's line table refers to.
+/// @return The function, or NULL if the file is broken.
+static ObjFunction* ReadFunction(CacheReader* reader, MJ_Source* source) {
+    ObjFunction* function = FunctionNew();
+    function->chunk.source = MJ_SourceRetain(source);
+    Push(vm, OBJECT_VALUE(function));
+
+    int length;
+    const char* name = ReadText(reader, &length);
+    if (name != NULL)
+        function->name = StringCopy(name, length);
+
+    function->arity = ReadInt(reader);
+    function->upvalueCount = ReadInt(reader);
+    function->stackSize = ReadInt(reader);
+
+    MJ_Chunk* chunk = &function->chunk;
+    int count = ReadCount(reader);
+    chunk->code = ALLOCATE(uint8_t, count);
+    chunk->capacity = count;
+    chunk->count = count;
+    ReadBytes(reader, chunk->code, (size_t)count);
+
+    int lineBytes = ReadCount(reader);
+    chunk->lines = ALLOCATE(uint8_t, lineBytes);
+    chunk->lineCapacity = lineBytes;
+    chunk->lineBytes = lineBytes;
+    ReadBytes(reader, chunk->lines, (size_t)lineBytes);
+    chunk->lastOffset = ReadInt(reader);
+    chunk->lastLine = ReadInt(reader);
+
+    int constantCount = ReadCount(reader);
+    for (int i = 0; i < constantCount && !reader->failed; i++) {
+        switch (ReadInt(reader)) {
+            case CONSTANT_NULL:
+                MJ_ChunkAddConstant(chunk, NULL_VALUE);
+                break;
+            case CONSTANT_BOOL:
+                MJ_ChunkAddConstant(chunk, BOOL_VALUE(ReadInt(reader) != 0));
+                break;
+            case CONSTANT_NUMBER: {
+                double number;
+                ReadBytes(reader, &number, sizeof(number));
+                MJ_ChunkAddConstant(chunk, NUMBER_VALUE(number));
+                break;
+            }
+            case CONSTANT_STRING: {
+                const char* chars = ReadText(reader, &length);
+                if (chars == NULL) {
+                    reader->failed = true;
+                    break;
+                }
+                MJ_ChunkAddConstant(chunk, OBJECT_VALUE(StringCopy(chars, length)));
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* nested = ReadFunction(reader, source);
+                if (nested != NULL)
+                    MJ_ChunkAddConstant(chunk, OBJECT_VALUE(nested));
+                else
+                    reader->failed = true;
+                break;
+            }
+            default:
+                reader->failed = true;
+                break;
+        }
+    }
+
+    Pop(vm);
+    return (reader->failed || !CheckFunction(function)) ? NULL : function;
+}
+
+/// @brief Loads a script's cached bytecode, if it has any that is still good for the source.
+/// @param path Path of the script.
+/// @param source Its current contents.
+/// @return The script's top-level function, or NULL if it has to be compiled.
+ObjFunction* CacheLoad(const char* path, MJ_Source* source) {
+    char* cachePath = CachePath(path);
+    if (cachePath == NULL)
+        return NULL;
+
+    int file = open(cachePath, O_RDONLY);
+    free(cachePath);
+    if (file == -1)
+        return NULL;
+
+    struct stat status;
+    if (fstat(file, &status) == -1 || status.st_size == 0) {
+        close(file);
+        return NULL;
+    }
+
+    size_t size = (size_t)status.st_size;
+    uint8_t* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    CacheReader reader = {mapping, mapping + size, false};
+    size_t sourceLength = (size_t)source->length;
+
+    char magic[4];
+    ReadBytes(&reader, magic, sizeof(magic));
+    int32_t version = ReadInt(&reader);
+    uint64_t build;
+    ReadBytes(&reader, &build, sizeof(build));
+    int32_t lastOpcode = ReadInt(&reader);
+    uint64_t length, hash;
+    ReadBytes(&reader, &length, sizeof(length));
+    ReadBytes(&reader, &hash, sizeof(hash));
+
+    ObjFunction* function = NULL;
+    if (!reader.failed && memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0 && version == MJC_VERSION &&
+        build == HashSource(MJC_BUILD, strlen(MJC_BUILD)) && lastOpcode == OP_RETURN && length == sourceLength &&
+        hash == HashSource(source->text, sourceLength)) {
+        function = ReadFunction(&reader, source);
+    }
+
+    munmap(mapping, size);
+    return function;
+}
+
+/// @brief Writes a freshly compiled script's bytecode next to it. Failing to do so (a read-only directory, say)
+/// only means the next run compiles again.
+/// @param path Path of the script.
+/// @param source Source the function was compiled from.
+/// @param function The script's top-level function, before it has run (and had any instruction quickened).
+void CacheWrite(const char* path, MJ_Source* source, ObjFunction* function) {
+    CacheWriter writer = {0};
+    uint64_t length = (uint64_t)source->length;
+    uint64_t hash = HashSource(source->text, (size_t)length);
+    uint64_t build = HashSource(MJC_BUILD, strlen(MJC_BUILD));
+
+    WriteBytes(&writer, CACHE_MAGIC, 4);
+    WriteInt(&writer, MJC_VERSION);
+    WriteBytes(&writer, &build, sizeof(build));
+    WriteInt(&writer, OP_RETURN);
+    WriteBytes(&writer, &length, sizeof(length));
+    WriteBytes(&writer, &hash, sizeof(hash));
+    WriteFunction(&writer, function);
+
+    char* cachePath = CachePath(path);
+    if (writer.failed || cachePath == NULL) {
+        free(writer.bytes);
+        free(cachePath);
+        return;
+    }
+
+    // Written under a temporary name and renamed, so a concurrent run never maps half a file.
+    size_t pathLength = strlen(cachePath);
+    char* temporaryPath = malloc(pathLength + 32);
+    if (temporaryPath != NULL) {
+        snprintf(temporaryPath, pathLength + 32, "%s.%ld", cachePath, (long)getpid());
+
+        FILE* file = fopen(temporaryPath, "wb");
+        if (file != NULL) {
+            bool written = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+            written = (fclose(file) == 0) && written;
+
+            if (!written || rename(temporaryPath, cachePath) != 0)
+                remove(temporaryPath);
+        }
+    }
+
+    free(temporaryPath);
+    free(cachePath);
+    free(writer.bytes);
+}
+
+#else
+
+ObjFunction* CacheLoad(const char* path, MJ_Source* source) {
+    return NULL;
+}
+
+void CacheWrite(const char* path, MJ_Source* source, ObjFunction* function) {
+}
+
+#endif
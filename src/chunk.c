@@ -12,20 +12,93 @@ void MJ_ChunkInit(MJ_Chunk* chunk) {
     chunk->code = NULL;
 
     // Initialize line stuff.
-    chunk->lineCount = 0;
-    chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->lineBytes = 0;
+    chunk->lineCapacity = 0;
+    chunk->lastOffset = 0;
+    chunk->lastLine = 0;
+    chunk->source = NULL;
 
     //Initialize internal constant array.
     ValueArrayInit(&chunk->constants);
 }
 
+/// @brief [INTERNAL] Appends an unsigned LEB128 varint to the line table.
+static void LinesWriteVarint(MJ_Chunk* chunk, uint32_t value) {
+    do {
+        if (chunk->lineCapacity < chunk->lineBytes + 1) {
+            int oldCapacity = chunk->lineCapacity;
+            chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+            chunk->lines = GROW_ARRAY(uint8_t, chunk->lines, oldCapacity, chunk->lineCapacity);
+        }
+
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        chunk->lines[chunk->lineBytes++] = byte | (value != 0 ? 0x80 : 0);
+    } while (value != 0);
+}
+
+/// @brief [INTERNAL] Reads the varint at *at, moving *at past it.
+static uint32_t LinesReadVarint(const uint8_t* lines, int* at) {
+    uint32_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = lines[(*at)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    return value;
+}
+
+/// @brief [INTERNAL] Start of the varint that ends right before end (only its last byte lacks the high bit).
+static int LinesVarintBefore(const uint8_t* lines, int end) {
+    int start = end - 1;
+    while (start > 0 && (lines[start - 1] & 0x80))
+        start--;
+    return start;
+}
+
+// Line deltas can be negative (a loop's increment is emitted after its body), so they are zigzag encoded.
+static inline uint32_t ZigZag(int32_t delta) {
+    return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+}
+
+static inline int32_t UnZigZag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/// @brief [INTERNAL] Starts a new line run at offset.
+static void LinesPush(MJ_Chunk* chunk, int offset, int line) {
+    LinesWriteVarint(chunk, (uint32_t)(offset - chunk->lastOffset));
+    LinesWriteVarint(chunk, ZigZag(line - chunk->lastLine));
+    chunk->lastOffset = offset;
+    chunk->lastLine = line;
+}
+
+/// @brief [INTERNAL] Drops the last line run, decoding it backwards from the end of the table.
+static void LinesPop(MJ_Chunk* chunk, int* offset, int* line) {
+    int lineStart = LinesVarintBefore(chunk->lines, chunk->lineBytes);
+    int offsetStart = LinesVarintBefore(chunk->lines, lineStart);
+
+    int at = offsetStart;
+    uint32_t offsetDelta = LinesReadVarint(chunk->lines, &at);
+    int32_t lineDelta = UnZigZag(LinesReadVarint(chunk->lines, &at));
+
+    *offset = chunk->lastOffset;
+    *line = chunk->lastLine;
+    chunk->lastOffset -= (int)offsetDelta;
+    chunk->lastLine -= lineDelta;
+    chunk->lineBytes = offsetStart;
+}
+
 /// @brief Writes a byte to a Chunk array.
 /// @param chunk Chunk to write the byte to.
 /// @param byte Byte to store on Chunk.
 /// @param line The current line number (for exception purposes).
-/// @param source The current source code line (for exception purposes).
-void MJ_ChunkWrite(MJ_Chunk* chunk, uint8_t byte, int line, char* source) {
+void MJ_ChunkWrite(MJ_Chunk* chunk, uint8_t byte, int line) {
     //If there is not enough capacity for the new byte, then increase the size of the array.
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
@@ -37,40 +110,16 @@ void MJ_ChunkWrite(MJ_Chunk* chunk, uint8_t byte, int line, char* source) {
     chunk->code[chunk->count] = byte;
     chunk->count++;
 
-    // If we are still in the current line, we don't add more to the array.
-    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
-        return;
-    
-    // If there is not enough capacity for the new line data, we grow the array.
-    if (chunk->lineCapacity < chunk->lineCount + 1) {
-        int oldCapacity = chunk->lineCapacity;
-        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
-        chunk->lines = GROW_ARRAY(MJ_LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
-    }
-
-    // We set the data for the current line.
-    MJ_LineStart* lineStart = &chunk->lines[chunk->lineCount++];
-    lineStart->offset = chunk->count - 1;
-    lineStart->line = line;
-    
-    // We copy the string from the source code to the line data array.
-    if (source == NULL) {
-        lineStart->content = '\0';
-        return;
-    }
-
-    int contentLength = strlen(source);
-    lineStart->content = ALLOCATE(char, contentLength + 1);
-    memcpy(lineStart->content, source, contentLength);
-    lineStart->content[contentLength] = '\0';
+    // Only a change of line starts a new run.
+    if (chunk->lineBytes == 0 || chunk->lastLine != line)
+        LinesPush(chunk, chunk->count - 1, line);
 }
 
 /// @brief Writes a long to the chunk.
 /// @param chunk Chunk to write the number to.
 /// @param number The number to write.
 /// @param line The current line number (for exception purposes).
-/// @param source The current source code line (for exception purposes).
-void MJ_ChunkWriteLong(MJ_Chunk* chunk, long number, int line, char* source) {
+void MJ_ChunkWriteLong(MJ_Chunk* chunk, long number, int line) {
     // Some bit shifting to get each individual byte.
     uint8_t firstByte = (number & 0xff000000UL) >> 24;
     uint8_t secondByte = (number & 0x00ff0000UL) >> 16;
@@ -78,10 +127,10 @@ void MJ_ChunkWriteLong(MJ_Chunk* chunk, long number, int line, char* source) {
     uint8_t fourthByte = (number & 0x000000ffUL);
 
     // We write the bytes in sequence.
-    MJ_ChunkWrite(chunk, firstByte, line, source);
-    MJ_ChunkWrite(chunk, secondByte, line, source);
-    MJ_ChunkWrite(chunk, thirdByte, line, source);
-    MJ_ChunkWrite(chunk, fourthByte, line, source);
+    MJ_ChunkWrite(chunk, firstByte, line);
+    MJ_ChunkWrite(chunk, secondByte, line);
+    MJ_ChunkWrite(chunk, thirdByte, line);
+    MJ_ChunkWrite(chunk, fourthByte, line);
 }
 
 /// @brief Writes a value to the chunk's value array.
@@ -89,50 +138,187 @@ void MJ_ChunkWriteLong(MJ_Chunk* chunk, long number, int line, char* source) {
 /// @param value The value to write to the chunk.
 /// @return Next index.
 int MJ_ChunkAddConstant(MJ_Chunk* chunk, Value value) {
-    Push(value);
+    // Locked since the stack is shared with the other compile threads (if any).
+    HeapLock();
+    Push(vm, value);
     ValueArrayWrite(&chunk->constants, value);
-    Pop();
+    Pop(vm);
+    HeapUnlock();
     return chunk->constants.count - 1;
 }
 
+/// @brief Cuts the chunk back to the given number of bytes (used when the compiler rewrites its last instructions).
+/// @param chunk Chunk to truncate.
+/// @param count New number of bytes in the chunk.
+void MJ_ChunkTruncate(MJ_Chunk* chunk, int count) {
+    if (count >= chunk->count)
+        return;
+
+    chunk->count = count;
+
+    // Line runs that now start past the end would otherwise swallow the next write's line.
+    int offset, line;
+    while (chunk->lineBytes > 0 && chunk->lastOffset >= count)
+        LinesPop(chunk, &offset, &line);
+}
+
+/// @brief Drops bytes from the middle of a chunk. Relative jumps stay valid as long as none crosses the gap.
+/// @param chunk Chunk to remove the bytes from.
+/// @param offset First byte to remove.
+/// @param length Number of bytes to remove.
+void MJ_ChunkRemove(MJ_Chunk* chunk, int offset, int length) {
+    memmove(&chunk->code[offset], &chunk->code[offset + length], chunk->count - offset - length);
+    chunk->count -= length;
+
+    // The line runs after the gap are taken off the end of the table and put back moved down. (Runs starting in
+    // the gap now start where it was.) The gap is always close to the end, so there are only a few of them.
+    int count = 0;
+    int capacity = 0;
+    int* runs = NULL;
+
+    while (chunk->lineBytes > 0 && chunk->lastOffset > offset) {
+        if (capacity < count + 2) {
+            int oldCapacity = capacity;
+            capacity = GROW_CAPACITY(oldCapacity);
+            runs = GROW_ARRAY(int, runs, oldCapacity, capacity);
+        }
+
+        LinesPop(chunk, &runs[count], &runs[count + 1]);
+        count += 2;
+    }
+
+    for (int i = count - 2; i >= 0; i -= 2) {
+        int moved = runs[i] - length;
+        LinesPush(chunk, moved > offset ? moved : offset, runs[i + 1]);
+    }
+
+    FREE_ARRAY(int, runs, capacity);
+}
+
+/// @brief Gets the size in bytes of the instruction at the given offset (opcode plus operands).
+/// @param chunk Chunk the instruction belongs to.
+/// @param offset Offset of the instruction's opcode.
+/// @return Length of the instruction.
+int MJ_ChunkInstructionLength(MJ_Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT_LONG:
+            return 5;
+
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_SET_PROPERTY:
+        case OP_GET_PROPERTY:
+        case OP_INIT_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_CONSTRUCTOR:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_SUPER_CONSTRUCT:
+        case OP_LEN:
+        case OP_CLOCK:
+            return 2;
+
+        case OP_ARRAY:
+        case OP_MAP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_CALL_NATIVE:
+        case OP_ADD_RK:
+        case OP_SUBTRACT_RK:
+        case OP_MULTIPLY_RK:
+        case OP_DIVIDE_RK:
+        case OP_GREATER_RK:
+        case OP_SMALLER_RK:
+        case OP_ADD_RK_NUM:
+        case OP_SUBTRACT_RK_NUM:
+        case OP_MULTIPLY_RK_NUM:
+        case OP_DIVIDE_RK_NUM:
+        case OP_GREATER_RK_NUM:
+        case OP_SMALLER_RK_NUM:
+            return 3;
+
+        case OP_CLOSURE:
+        case OP_CLOSURE_STACK: {
+            // Each captured variable adds an (isLocal, index) pair.
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+
+        default:
+            return 1;
+    }
+}
+
 /// @brief For getting the current line number based on the instruction number (from the VM).
+/// The line table can only be read front to back, but this is only needed for errors and disassembly.
 /// @param chunk Chunk to get the line number from.
 /// @param instruction The current instruction offset (from the VM).
 /// @return Line number.
 int MJ_ChunkGetLine(MJ_Chunk* chunk, int instruction) {
-    int start = 0;
-    int End = chunk->lineCount - 1;
-
-    for (;;) {
-        int Mid = (start + End) / 2;    
-        MJ_LineStart* line = &chunk->lines[Mid];
-        if (instruction < line->offset)
-            End = Mid - 1;
-        else if (Mid == chunk->lineCount - 1 || instruction < chunk->lines[Mid + 1].offset)
-            return line->line;
-        else
-            start = Mid + 1;
+    int offset = 0;
+    int line = 0;
+
+    for (int at = 0; at < chunk->lineBytes;) {
+        int nextOffset = offset + (int)LinesReadVarint(chunk->lines, &at);
+        int nextLine = line + UnZigZag(LinesReadVarint(chunk->lines, &at));
+        if (nextOffset > instruction)
+            break;
+
+        offset = nextOffset;
+        line = nextLine;
     }
+
+    return line;
+}
+
+/// @brief Checks a line table that didn't come from MJ_ChunkWrite (a cached chunk's): every varint ends inside the
+/// table, and the runs add up to the last one, so MJ_ChunkGetLine never reads past it.
+/// @param chunk Chunk to check.
+/// @return Whether the table is well formed.
+bool MJ_ChunkLinesValid(MJ_Chunk* chunk) {
+    int offset = 0;
+    int line = 0;
+    int at = 0;
+
+    while (at < chunk->lineBytes) {
+        // Both varints of a run have to end (have a byte without the high bit) before the table does.
+        int end = at;
+        for (int varints = 0; varints < 2; end++) {
+            if (end >= chunk->lineBytes || end - at > 10)
+                return false;
+            if (!(chunk->lines[end] & 0x80))
+                varints++;
+        }
+
+        uint32_t delta = LinesReadVarint(chunk->lines, &at);
+        if (delta > (uint32_t)(chunk->count - offset))
+            return false;
+
+        offset += (int)delta;
+        line = (int)((uint32_t)line + (uint32_t)UnZigZag(LinesReadVarint(chunk->lines, &at)));
+    }
+
+    return offset == chunk->lastOffset && line == chunk->lastLine;
 }
 
 /// @brief For getting the current source code line based on the instruction number (from the VM).
 /// @param chunk The chunk to get the source code info from.
 /// @param instruction The instruction offset (from the VM).
-/// @return Source code line.
-char* MJ_ChunkGetSource(MJ_Chunk* chunk, int instruction) {
-    int start = 0;
-    int End = chunk->lineCount - 1;
-
-    for (;;) {
-        int Mid = (start + End) / 2;    
-        MJ_LineStart* line = &chunk->lines[Mid];
-        if (instruction < line->offset)
-            End = Mid - 1;
-        else if (Mid == chunk->lineCount - 1 || instruction < chunk->lines[Mid + 1].offset)
-            return line->content;
-        else
-            start = Mid + 1;
-    }
+/// @param length Set to the length of the line.
+/// @return Source code line (not null-terminated).
+const char* MJ_ChunkGetSource(MJ_Chunk* chunk, int instruction, int* length) {
+    return MJ_SourceLine(chunk->source, MJ_ChunkGetLine(chunk, instruction), length);
 }
 
 /// @brief Frees up the memory occupied by an array.
@@ -145,7 +331,8 @@ void MJ_ChunkFree(MJ_Chunk* chunk) {
     ValueArrayFree(&chunk->constants);
 
     //Free memory from line array.
-    FREE_ARRAY(MJ_LineStart, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(uint8_t, chunk->lines, chunk->lineCapacity);
+    MJ_SourceRelease(chunk->source);
 
     //Reinitialize chunk.
     MJ_ChunkInit(chunk);
@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE // For sysconf(_SC_NPROCESSORS_ONLN).
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,13 +12,32 @@
 #include "Debug.h"
 #endif
 
+#ifdef PARALLEL_COMPILE_AVAILABLE
+    #include <unistd.h>
+#endif
+
 #define MAX_CASES 256
 
+// Scripts declaring fewer top-level functions than this are compiled on one thread, as more wouldn't pay off.
+#ifndef PARALLEL_COMPILE_MIN
+    #define PARALLEL_COMPILE_MIN 64
+#endif
+
+// Sources shorter than this (in bytes) are compiled on one thread without looking for their functions first, since
+// that look would take about as long as the threads could save.
+#ifndef PARALLEL_COMPILE_MIN_BYTES
+    #define PARALLEL_COMPILE_MIN_BYTES (64 * 1024)
+#endif
+
+#define COMPILE_THREADS_MAX 16
+
 typedef struct {
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
+    MJ_Source* source;  // Shared by every chunk compiled from it.
+    bool quiet;         // Errors are only noted, not reported (a compile thread leaves that to the serial pass).
 } Parser;   // For parsing the tokenized source code into OP codes.
 
 typedef enum {
@@ -45,6 +66,7 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    int closure;        // Offset of the OP_CLOSURE of a lambda this local holds while it is only ever called (-1 otherwise).
 } Local;
 
 typedef struct {
@@ -65,10 +87,19 @@ typedef struct Compiler {
     ObjFunction* function;
     FunctionType type;
 
-    Local locals[UINT16_COUNT];
-    Upvalue upvalues[UINT16_COUNT];
+    Local* locals;      // Both live in the compile arena and grow as needed (up to UINT16_COUNT).
+    Upvalue* upvalues;
     int localCount;
+    int localCapacity;
+    int upvalueCapacity;
     int scopeDepth;
+    int lastOperand;    // Offset of the last lone local read or constant load (-1 if there is none to fuse).
+    int lastCall;       // Offset of the last OP_CALL emitted (-1 if there is none).
+    int lastGlobal;     // Offset of the last OP_GET_GLOBAL read, in case it turns out to be a native's callee.
+    int pending;        // Values unfinished expressions (and switches, class bodies) keep on the stack meanwhile.
+    int maxPending;
+    int lastClosure;    // Offset of the last lambda's OP_CLOSURE, if it could be an OP_CLOSURE_STACK (-1 if none).
+    bool sharesUpvalues;    // Whether a nested function captures one of this function's upvalues.
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -76,9 +107,24 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
+// Every thread compiling has its own parser and compilers (see CompilerPrecompile).
+THREAD_LOCAL Parser parser;
+THREAD_LOCAL Compiler* current = NULL;
+THREAD_LOCAL ClassCompiler* currentClass = NULL;
+THREAD_LOCAL Arena arena;   // Scratch data of the compilation under way, freed when it's done.
+
+// A top-level function compiled on a compile thread before the serial pass over the script reaches it.
+typedef struct {
+    Token name;             // Its name, which is where the serial pass picks it up.
+    ObjFunction* function;  // NULL if it had errors (the serial pass then compiles it again and reports them).
+    Token previous;         // Parser and scanner state right after its body, where the serial pass carries on.
+    Token current;
+    Scanner scanner;
+} Precompiled;
+
+THREAD_LOCAL Precompiled* precompiled = NULL;
+THREAD_LOCAL int precompiledCount = 0;
+THREAD_LOCAL int nextPrecompiled = 0;    // First one the serial pass hasn't gone past yet.
 
 
 static MJ_Chunk* CurrentChunk() {
@@ -90,6 +136,10 @@ static void ErrorAt(Token* token, const char* msg) {
         return;
 
     parser.panicMode = true;
+    if (parser.quiet) {
+        parser.hadError = true;
+        return;
+    }
 
     fprintf(stderr, COLOR_RED "SyntaxError" COLOR_RESET ": %s", msg);
 
@@ -99,10 +149,11 @@ static void ErrorAt(Token* token, const char* msg) {
         fprintf(stderr, " at line %d | '%.*s'", token->line, token->length, token->start);
     }
     
-    char* currentLine = ScannerGetSource();
+    int length;
+    const char* currentLine = MJ_SourceLine(parser.source, token->line, &length);
 
-    if (currentLine != NULL)
-        fprintf(stderr, "\n   %d | %s", token->line, currentLine);
+    if (length > 0)
+        fprintf(stderr, "\n   %d | %.*s", token->line, length, currentLine);
 
     fprintf(stderr, "\n");
     parser.hadError = true;
@@ -120,7 +171,7 @@ static void CompilerAdvance() {
     parser.previous = parser.current;
 
     for (;;) {
-        parser.current = ScannerScanToken(&current->function->chunk);
+        parser.current = ScannerScanToken();
 
         if (parser.current.type != TOKEN_ERROR)
             break;
@@ -151,7 +202,7 @@ static bool Match(TokenType type) {
 }
 
 static void CompilerEmitByte(uint8_t byte) {
-    MJ_ChunkWrite(CurrentChunk(), byte, parser.previous.line, ScannerGetSource());
+    MJ_ChunkWrite(CurrentChunk(), byte, parser.previous.line);
 }
 
 static void CompilerEmitBytes(uint8_t firstByte, uint8_t secondByte) {
@@ -160,7 +211,7 @@ static void CompilerEmitBytes(uint8_t firstByte, uint8_t secondByte) {
 }
 
 static void CompilerEmitLong(long longNumber) {
-    MJ_ChunkWriteLong(CurrentChunk(), longNumber, parser.previous.line, ScannerGetSource());
+    MJ_ChunkWriteLong(CurrentChunk(), longNumber, parser.previous.line);
 }
 
 static void CompilerEmitByteLong(uint8_t byte, long longNumber) {
@@ -224,24 +275,60 @@ static void CompilerPatchJump(int offset) {
 
     CurrentChunk()->code[offset] = (Jump >> 8) & 0xff;
     CurrentChunk()->code[offset + 1] = Jump & 0xff;
+
+    // Something now lands right after the last operand, so it can no longer be folded into a register op.
+    current->lastOperand = -1;
+}
+
+/// @brief [INTERNAL] Notes that count more values (or fewer, if negative) wait on the stack while what comes next
+/// gets compiled (the left operand of an operator, the callee and arguments so far, the items of a literal...),
+/// so the function's stack size covers them however deep expressions nest.
+static void CompilerHold(int count) {
+    current->pending += count;
+    if (current->pending > current->maxPending)
+        current->maxPending = current->pending;
+}
+
+/// @brief [INTERNAL] Makes room for one more local in the compiler's locals (the caller checks the limit).
+static Local* CompilerPushLocal(Compiler* compiler) {
+    if (compiler->localCapacity < compiler->localCount + 1) {
+        int oldCapacity = compiler->localCapacity;
+        compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->locals = ARENA_GROW_ARRAY(&arena, Local, compiler->locals, oldCapacity, compiler->localCapacity);
+    }
+
+    return &compiler->locals[compiler->localCount++];
 }
 
 static void CompilerInit(Compiler* compiler, FunctionType type) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
+    compiler->upvalues = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
+    compiler->upvalueCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->lastOperand = -1;
+    compiler->lastCall = -1;
+    compiler->lastGlobal = -1;
+    compiler->pending = 0;
+    compiler->maxPending = 0;
+    compiler->lastClosure = -1;
+    compiler->sharesUpvalues = false;
     compiler->function = FunctionNew();
+    compiler->function->chunk.source = MJ_SourceRetain(parser.source);
     current = compiler;
 
     if (type != TYPE_SCRIPT && type != TYPE_LAMBDA) {
         current->function->name = StringCopy(parser.previous.start, parser.previous.length);
     }
     
-    Local* local = &current->locals[current->localCount++];
+    Local* local = CompilerPushLocal(current);
     local->depth = 0;
     local->isCaptured = false;
+    local->closure = -1;
     if (type == TYPE_METHOD || type == TYPE_CONSTRUCTOR) {
         local->name.start = "this";
         local->name.length = 4;
@@ -251,9 +338,20 @@ static void CompilerInit(Compiler* compiler, FunctionType type) {
     }
 }
 
+/// @brief [INTERNAL] Called when a local goes away: a local function that was only ever called can't outlive
+/// the frame, so its closure gets made with OP_CLOSURE_STACK (pointing straight at our slots).
+static void CompilerSettleClosure(Local* local) {
+    if (local->closure != -1)
+        CurrentChunk()->code[local->closure] = OP_CLOSURE_STACK;
+}
+
 static ObjFunction* CompilerEnd() {
     CompilerEmitReturn();
+    for (int i = 0; i < current->localCount; i++)
+        CompilerSettleClosure(&current->locals[i]);
+
     ObjFunction* function = current->function;
+    function->stackSize = BASE_STACK_SIZE + current->maxPending;
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError || true)
         DisassembleChunk(CurrentChunk(), function->name != NULL ? function->name->chars : "<script>");
@@ -270,10 +368,11 @@ static void CompilerBeginScope() {
 static void CompilerEndScope() {
     current->scopeDepth--;
 
-    if (current->localCount > 0 && 
+    while (current->localCount > 0 && 
         current->locals[current->localCount - 1].depth > 
         current->scopeDepth) {
         
+        CompilerSettleClosure(&current->locals[current->localCount - 1]);
         if (current->locals[current->localCount - 1].isCaptured)
             CompilerEmitByte(OP_CLOSE_UPVALUE);
         else
@@ -295,11 +394,11 @@ static void NamedVariable(Token name, bool canAssign);
 static Token SyntheticToken(const char* text);
 static void CompilerVariable(bool canAssign);
 
-static char* Substring(char* string, int length) {
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, string, length);
-    heapChars[length] = '\0';
-    return heapChars;
+static char* Substring(const char* string, int length) {
+    char* chars = ARENA_ALLOCATE(&arena, char, length + 1);
+    memcpy(chars, string, length);
+    chars[length] = '\0';
+    return chars;
 }
 
 static uint8_t IdentifierConstant(Token* name) {
@@ -340,6 +439,12 @@ static int AddUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
         return 0;
     }
 
+    if (compiler->upvalueCapacity < upvalueCount + 1) {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = ARENA_GROW_ARRAY(&arena, Upvalue, compiler->upvalues, oldCapacity, compiler->upvalueCapacity);
+    }
+
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
     return compiler->function->upvalueCount++;
@@ -352,12 +457,15 @@ static int ResolveUpvalue(Compiler* compiler, Token* name) {
     int Local = ResolveLocal(compiler->enclosing, name);
     if (Local != -1) {
         compiler->enclosing->locals[Local].isCaptured = true;
+        compiler->enclosing->locals[Local].closure = -1;
         return AddUpvalue(compiler, (uint8_t)Local, true);
     }
 
     int Upvalue = ResolveUpvalue(compiler->enclosing, name);
-    if (Upvalue != -1)
+    if (Upvalue != -1) {
+        compiler->enclosing->sharesUpvalues = true;
         return AddUpvalue(compiler, (uint8_t)Upvalue, false);
+    }
 
     return -1;
 }
@@ -368,10 +476,11 @@ static void AddLocal(Token name) {
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = CompilerPushLocal(current);
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->closure = -1;
 }
 
 static void DeclareVariable() {
@@ -433,9 +542,12 @@ static uint8_t ArgumentList() {
             if (argumentCount == 255)
                 Error("Cannot have more than 255 arguments in a function call");
             argumentCount++;
+            CompilerHold(1);
         } while (Match(TOKEN_COMMA));
     }
 
+    CompilerHold(-argumentCount);
+
     CompilerConsume(TOKEN_PARENTHESIS_CLOSE, "Expected ')' after function call parameters");
     return argumentCount;
 }
@@ -460,11 +572,70 @@ static void CompilerOr(bool canAssign) {
     CompilerPatchJump(endJump);
 }
 
+/// @brief Reads the instruction at offset as an RK operand, if it is a lone local read or constant load ending at end.
+static bool OperandAsRK(int offset, int end, uint8_t* rk) {
+    if (offset < 0)
+        return false;
+
+    uint8_t* code = &CurrentChunk()->code[offset];
+
+    if (code[0] == OP_GET_LOCAL && offset + 2 == end && code[1] <= RK_MAX) {
+        *rk = code[1];
+        return true;
+    }
+
+    if (code[0] == OP_CONSTANT_LONG && offset + 5 == end) {
+        long index = ((long)code[1] << 24) | (code[2] << 16) | (code[3] << 8) | code[4];
+        if (index <= RK_MAX) {
+            *rk = RK_CONSTANT | (uint8_t)index;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/// @brief Folds "operand operand op" into a single register instruction when both operands are slots or constants.
+/// @return Whether the register instruction replaced the stack sequence.
+static bool CompilerEmitRegisterOp(TokenType operatorType, int leftStart, int rightStart) {
+    uint8_t instruction;
+    switch (operatorType) {
+        case TOKEN_PLUS:        instruction = OP_ADD_RK;        break;
+        case TOKEN_MINUS:       instruction = OP_SUBTRACT_RK;   break;
+        case TOKEN_STAR:        instruction = OP_MULTIPLY_RK;   break;
+        case TOKEN_SLASH:       instruction = OP_DIVIDE_RK;     break;
+        case TOKEN_GREATER:     instruction = OP_GREATER_RK;    break;
+        case TOKEN_SMALLER:     instruction = OP_SMALLER_RK;    break;
+        default: return false;
+    }
+
+    MJ_Chunk* chunk = CurrentChunk();
+    uint8_t left, right;
+
+    if (current->lastOperand != rightStart ||
+        !OperandAsRK(leftStart, rightStart, &left) ||
+        !OperandAsRK(rightStart, chunk->count, &right))
+        return false;
+
+    chunk->code[leftStart] = instruction;
+    chunk->code[leftStart + 1] = left;
+    chunk->code[leftStart + 2] = right;
+    MJ_ChunkTruncate(chunk, leftStart + 3);
+
+    current->lastOperand = -1;
+    return true;
+}
+
 static void CompilerBinary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule* Rule = CompilerGetRule(operatorType);
+    int leftStart = current->lastOperand;
+    int rightStart = CurrentChunk()->count;
     CompilerParsePrecedence((Precedence)(Rule->precedence + 1));
 
+    if (CompilerEmitRegisterOp(operatorType, leftStart, rightStart))
+        return;
+
     switch(operatorType) {
         case TOKEN_PLUS:        CompilerEmitByte(OP_ADD);           break;
         case TOKEN_MINUS:       CompilerEmitByte(OP_SUBTRACT);      break;
@@ -486,8 +657,43 @@ static void CompilerBinary(bool canAssign) {
     }
 }
 
+/// @brief [INTERNAL] Finds the native a global read at offset refers to, if it can be called directly.
+/// @return Index into vm->natives, or -1 if the global isn't a native taking argumentCount arguments.
+static int ResolveNative(int offset, int argumentCount) {
+    MJ_Chunk* chunk = CurrentChunk();
+    if (offset == -1 || chunk->code[offset] != OP_GET_GLOBAL)
+        return -1;
+
+    ObjString* name = AS_STRING(chunk->constants.values[chunk->code[offset + 1]]);
+    for (int i = 0; i < vm->nativeCount; i++) {
+        ObjNative* native = vm->natives[i];
+        if (native->name == name && !native->shadowed)
+            return (native->arity == NATIVE_VARIADIC || native->arity == argumentCount) ? i : -1;
+    }
+
+    return -1;
+}
+
 static void CompilerCall(bool canAssign) {
+    // Natives called through their global skip the lookup (and the callee slot) with OP_CALL_NATIVE, and the
+    // simplest ones get an opcode of their own.
+    int callee = (current->lastGlobal == CurrentChunk()->count - 2) ? current->lastGlobal : -1;
     uint8_t argumentCount = ArgumentList();
+    int native = ResolveNative(callee, argumentCount);
+
+    if (native != -1) {
+        MJ_ChunkRemove(CurrentChunk(), callee, 2);
+        current->lastOperand = -1;
+        current->lastCall = -1;
+
+        uint8_t instruction = vm->natives[native]->intrinsic;
+        CompilerEmitBytes(instruction, (uint8_t)native);
+        if (instruction == OP_CALL_NATIVE)
+            CompilerEmitByte(argumentCount);
+        return;
+    }
+
+    current->lastCall = CurrentChunk()->count;
     CompilerEmitBytes(OP_CALL, argumentCount);
 }
 
@@ -530,9 +736,10 @@ static void CompilerBlock() {
     CompilerConsume(TOKEN_BRACKET_CLOSE, "Expected '}' after block");
 }
 
-static void CompilerFunction(FunctionType type) {
-    Compiler compiler;
-    CompilerInit(&compiler, type);
+/// @brief [INTERNAL] Compiles a function's parameters and body, leaving the compiler it used in compiler (for its
+/// upvalues).
+static ObjFunction* CompilerFunctionBody(Compiler* compiler, FunctionType type) {
+    CompilerInit(compiler, type);
     CompilerBeginScope();
 
     CompilerConsume(TOKEN_PARENTHESIS_OPEN, "Expected '(' after function name");
@@ -563,13 +770,23 @@ static void CompilerFunction(FunctionType type) {
         CompilerBlock();
     }
 
-    ObjFunction* function = CompilerEnd();
+    return CompilerEnd();
+}
+
+/// @brief [INTERNAL] Compiles a function and emits the OP_CLOSURE that makes it.
+/// @return Whether the closure could be made with OP_CLOSURE_STACK (it has upvalues, and nothing nested in it
+/// captures them).
+static bool CompilerFunction(FunctionType type) {
+    Compiler compiler;
+    ObjFunction* function = CompilerFunctionBody(&compiler, type);
     CompilerEmitBytes(OP_CLOSURE, CompilerMakeConstant(OBJECT_VALUE(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
         CompilerEmitByte((compiler.upvalues[i].isLocal) ? 1 : 0);
         CompilerEmitByte(compiler.upvalues[i].index);
     }
+
+    return function->upvalueCount > 0 && !compiler.sharesUpvalues;
 }
 
 static void CompilerMethod(const char* className) {
@@ -585,11 +802,13 @@ static void CompilerMethod(const char* className) {
     }
 
     CompilerFunction(type);
-    CompilerEmitBytes(OP_METHOD, constant);
+    CompilerEmitBytes((type == TYPE_CONSTRUCTOR) ? OP_CONSTRUCTOR : OP_METHOD, constant);
 }
 
 static void CompilerLambda(bool canAssign) {
-    CompilerFunction(TYPE_LAMBDA);   
+    int start = CurrentChunk()->count;
+    if (CompilerFunction(TYPE_LAMBDA))
+        current->lastClosure = start;
 }
 
 static void CompilerInitProperty() {
@@ -644,6 +863,8 @@ static void ClassDeclaration() {
     
     char* classNameString = Substring(className.start, className.length);
 
+    // The class stays on the stack while its fields and methods are compiled.
+    CompilerHold(1);
     while (!Check(TOKEN_BRACKET_CLOSE) && !Check(TOKEN_EOF)) {
         if (Match(TOKEN_LOCAL)) {
             CompilerInitProperty();
@@ -652,8 +873,7 @@ static void ClassDeclaration() {
 
         CompilerMethod(classNameString);
     }
-
-    FREE(char, classNameString);
+    CompilerHold(-1);
 
     CompilerConsume(TOKEN_BRACKET_CLOSE, "Expected '}' after class body");
     CompilerEmitByte(OP_POP);
@@ -663,6 +883,23 @@ static void ClassDeclaration() {
     currentClass = currentClass->enclosing;
 }
 
+/// @brief [INTERNAL] Finds the function a compile thread made for the declaration whose name is coming up.
+/// @return The function, or NULL if the declaration has to be compiled here.
+static Precompiled* FindPrecompiled(Token* name) {
+    // Only functions declared at the top of the script were compiled ahead, and they come up in order.
+    if (current->enclosing != NULL || current->scopeDepth > 0 || name->type != TOKEN_IDENTIFIER)
+        return NULL;
+
+    while (nextPrecompiled < precompiledCount && precompiled[nextPrecompiled].name.start < name->start)
+        nextPrecompiled++;
+
+    if (nextPrecompiled == precompiledCount || precompiled[nextPrecompiled].name.start != name->start)
+        return NULL;
+
+    Precompiled* function = &precompiled[nextPrecompiled++];
+    return (function->function != NULL) ? function : NULL;
+}
+
 static void FunctionDeclaration() {
     // Checking because CompilerFunction consumes the opening parenthesis.
     if (Check(TOKEN_PARENTHESIS_OPEN)) {
@@ -671,9 +908,20 @@ static void FunctionDeclaration() {
     }
 
     // Regular function;
+    Precompiled* function = FindPrecompiled(&parser.current);
     uint8_t global = ParseVariable("Expected function name");
     MarkInitialized();
-    CompilerFunction(TYPE_FUNCTION);
+
+    if (function != NULL) {
+        // Already compiled on a compile thread: take its function, and carry on past its body.
+        ScannerRestore(function->scanner);
+        parser.previous = function->previous;
+        parser.current = function->current;
+        CompilerEmitBytes(OP_CLOSURE, CompilerMakeConstant(OBJECT_VALUE(function->function)));
+    } else {
+        CompilerFunction(TYPE_FUNCTION);
+    }
+
     DefineVariable(global);
 }
 
@@ -694,6 +942,8 @@ static void StatementSwitch() {
     int caseCount = 0;
     int previousCaseSkip = -1;
 
+    // The value switched on stays on the stack throughout, and a copy of it while a case value is compiled.
+    CompilerHold(1);
     while (!Match(TOKEN_BRACKET_CLOSE) && !Check(TOKEN_EOF)) {
         if (Match(TOKEN_CASE) || Match(TOKEN_DEFAULT)) {
             TokenType caseType = parser.previous.type;
@@ -713,7 +963,9 @@ static void StatementSwitch() {
                 State = 1;
         
                 CompilerEmitByte(OP_DUPLICATE);
+                CompilerHold(1);
                 CompilerExpression();
+                CompilerHold(-1);
 
                 CompilerConsume(TOKEN_COLON, "Expected ':' after case value");
                 
@@ -737,6 +989,7 @@ static void StatementSwitch() {
             CompilerEndScope();
         }
     }
+    CompilerHold(-1);
     
     if (State == 1) {
         CompilerPatchJump(previousCaseSkip);
@@ -844,11 +1097,19 @@ static void VariableDeclaration() {
 
 static void LocalVariableDeclaration() {
     uint8_t Local = ParseLocalVariable("Expected variable name");
+    int start = CurrentChunk()->count;
     if (Match(TOKEN_ASSIGN))
         CompilerExpression();
     else
         CompilerEmitByte(OP_NULL);
 
+    // A local holding nothing but a lambda stays a candidate for OP_CLOSURE_STACK until it is used as anything
+    // but a callee.
+    MJ_Chunk* chunk = CurrentChunk();
+    if (current->scopeDepth > 0 && current->lastClosure == start &&
+        start + MJ_ChunkInstructionLength(chunk, start) == chunk->count)
+        current->locals[current->localCount - 1].closure = start;
+
     CompilerConsume(TOKEN_SEMICOLON, "Expected ';' after variable declaration");
     DefineLocalVariable(Local);
 }
@@ -873,6 +1134,13 @@ static void StatementReturn() {
 
         CompilerExpression();
         CompilerConsume(TOKEN_SEMICOLON, "Expected ';' after return value");
+
+        // If the value is the result of a call, the callee can take over our frame.
+        // The OP_RETURN stays for callees that don't (natives and classes).
+        MJ_Chunk* chunk = CurrentChunk();
+        if (current->lastCall == chunk->count - 2 && chunk->code[current->lastCall] == OP_CALL)
+            chunk->code[current->lastCall] = OP_TAIL_CALL;
+
         CompilerEmitByte(OP_RETURN);
     }
 }
@@ -969,11 +1237,22 @@ static void CompilerGrouping(bool canAssign) {
 }
 
 static void CompilerNumber(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
+    // strtod needs a terminator, which the source only has after its last token if it's a copy, not a mapped file.
+    char digits[64];
+    int length = parser.previous.length;
+    char* number = (length < (int)sizeof(digits)) ? digits : ALLOCATE(char, length + 1);
+    memcpy(number, parser.previous.start, (size_t)length);
+    number[length] = '\0';
+    double value = strtod(number, NULL);
+    if (number != digits)
+        FREE_ARRAY(char, number, length + 1);
+
+    current->lastOperand = CurrentChunk()->count;
     CompilerEmitConstant(NUMBER_VALUE(value));
 }
 
 static void CompilerString(bool canAssign) {
+    current->lastOperand = CurrentChunk()->count;
     CompilerEmitConstant(OBJECT_VALUE(StringCopy(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
@@ -990,10 +1269,12 @@ static void CompilerArray(bool canAssign) {
 
                 CompilerExpression();
                 numOfItems++;
+                CompilerHold(1);
             }
         } while (Match(TOKEN_COMMA));
     }
 
+    CompilerHold(-numOfItems);
     CompilerConsume(TOKEN_SQUARE_CLOSE, "Expected ']' at the end of the array");
     CompilerEmitByte(OP_ARRAY);
     CompilerEmitShort(numOfItems);
@@ -1008,13 +1289,17 @@ static void CompilerMap(bool canAssign) {
         do {
             if (!Check(TOKEN_BRACKET_CLOSE)) {
                 CompilerExpression();
+                CompilerHold(1);
                 CompilerConsume(TOKEN_COLON, "Expected ':' for value for pair");
                 CompilerExpression();
+                CompilerHold(1);
                 numOfItems += 2;
             }
         } while (Match(TOKEN_COMMA));
     }
 
+    CompilerHold(-numOfItems);
+
     CompilerConsume(TOKEN_BRACKET_CLOSE, "Expected '}' at the end of the map");
     CompilerEmitByte(OP_MAP);
     CompilerEmitShort(numOfItems);
@@ -1063,7 +1348,9 @@ static void ResolveExtraAssignments(int getOp, int setOp, int arg) {
         CompilerEmitByte(OP_POP);
     }
     else if (Match(TOKEN_ADD_EQUAL) || Match(TOKEN_SUB_EQUAL) || Match(TOKEN_MULT_EQUAL) || Match(TOKEN_DIV_EQUAL)) {
+        CompilerHold(1);
         CompilerExpression();
+        CompilerHold(-1);
         
         if (currentToken.type == TOKEN_ADD_EQUAL)
             CompilerEmitByte(OP_ADD);
@@ -1102,7 +1389,18 @@ static void NamedVariable(Token name, bool canAssign) {
         CompilerEmitBytes(setOp, (uint8_t)argument);
     }
     else {
+        if (getOp == OP_GET_LOCAL && !Check(TOKEN_PARENTHESIS_OPEN))
+            current->locals[argument].closure = -1;
+
+        int start = CurrentChunk()->count;
         ResolveExtraAssignments(getOp, setOp, argument);
+
+        if (getOp == OP_GET_GLOBAL)
+            current->lastGlobal = start;
+
+        // A plain local read can be folded into a register op by CompilerBinary.
+        if (getOp == OP_GET_LOCAL)
+            current->lastOperand = start;
     }
 }
 
@@ -1130,13 +1428,12 @@ static void CompilerSuper(bool canAssign) {
             return;
         }
 
-        Token superToken = SyntheticToken("super");
-        uint8_t superName = IdentifierConstant(&superToken);
         NamedVariable(SyntheticToken("this"), false);
+        CompilerHold(1);
         uint8_t argumentCount = ArgumentList();
-        NamedVariable(superToken, false);
-        CompilerEmitBytes(OP_SUPER_INVOKE, superName);
-        CompilerEmitByte(argumentCount);
+        CompilerHold(-1);
+        NamedVariable(SyntheticToken("super"), false);
+        CompilerEmitBytes(OP_SUPER_CONSTRUCT, argumentCount);
         return;
     }
 
@@ -1146,7 +1443,9 @@ static void CompilerSuper(bool canAssign) {
 
     NamedVariable(SyntheticToken("this"), false);
     if (Match(TOKEN_PARENTHESIS_OPEN)) {
+        CompilerHold(1);
         uint8_t argumentCount = ArgumentList();
+        CompilerHold(-1);
         NamedVariable(SyntheticToken("super"), false);
         CompilerEmitBytes(OP_SUPER_INVOKE, name);
         CompilerEmitByte(argumentCount);
@@ -1186,6 +1485,9 @@ static void CompilerIndex(bool canAssign) {
         CompilerExpression();
     }
 
+    // What the index starts with stays on the stack while the rest of it (or the value assigned) is compiled.
+    CompilerHold(1);
+
     // If we haven't yet found a bracket after the index, we might be looking at the end of a range.
     if (!Match(TOKEN_SQUARE_CLOSE)) {
         getOp = OP_GET_INDEX_RANGED;
@@ -1210,7 +1512,9 @@ static void CompilerIndex(bool canAssign) {
             
             if (!Match(TOKEN_SQUARE_CLOSE)) {
                 CompilerConsume(TOKEN_COLON, "Expected ':' or ']'");
+                CompilerHold(1);
                 CompilerExpression();
+                CompilerHold(-1);
                 CompilerConsume(TOKEN_SQUARE_CLOSE, "Expected ']' after index range");
             }
             else
@@ -1240,6 +1544,8 @@ static void CompilerIndex(bool canAssign) {
         else
             CompilerEmitByte(OP_GET_INDEX);
     }
+
+    CompilerHold(-1);
 }
 
 static void CompilerUnary(bool canAssign) {
@@ -1257,6 +1563,21 @@ static void CompilerUnary(bool canAssign) {
     }
 }
 
+/// @brief Compiles `yield value`, or a bare `yield` (which yields null): the value goes to whoever resumed the
+/// fiber, and the expression is whatever the fiber gets resumed with next.
+static void CompilerYield(bool canAssign) {
+    if (current->type == TYPE_SCRIPT)
+        Error("Cannot yield from outside a function");
+
+    if (Check(TOKEN_SEMICOLON) || Check(TOKEN_PARENTHESIS_CLOSE) || Check(TOKEN_SQUARE_CLOSE) ||
+        Check(TOKEN_BRACKET_CLOSE) || Check(TOKEN_COMMA))
+        CompilerEmitByte(OP_NULL);
+    else
+        CompilerParsePrecedence(PREC_ASSIGNMENT);
+
+    CompilerEmitByte(OP_YIELD);
+}
+
 ParseRule rules[] = {
   //    [TOKEN]                     [Functions]
   [TOKEN_PARENTHESIS_OPEN]    = {CompilerGrouping, CompilerCall,   PREC_CALL},
@@ -1309,6 +1630,7 @@ ParseRule rules[] = {
   [TOKEN_MAYBE]               = {CompilerLiteral,  NULL,           PREC_NONE},
   [TOKEN_LOCAL]               = {NULL,             NULL,           PREC_NONE},
   [TOKEN_WHILE]               = {NULL,             NULL,           PREC_NONE},
+  [TOKEN_YIELD]               = {CompilerYield,    NULL,           PREC_NONE},
   [TOKEN_ERROR]               = {NULL,             NULL,           PREC_NONE},
   [TOKEN_EOF]                 = {NULL,             NULL,           PREC_NONE},
 };
@@ -1328,8 +1650,12 @@ static void CompilerParsePrecedence(Precedence precedence) {
 
     while (precedence <= CompilerGetRule(parser.current.type)->precedence) {
         CompilerAdvance();
-        ParseFn infixRule = CompilerGetRule(parser.previous.type)->infix;   
+        ParseFn infixRule = CompilerGetRule(parser.previous.type)->infix;
+
+        // The left operand stays on the stack while the rest is compiled.
+        CompilerHold(1);
         infixRule(canAssign);
+        CompilerHold(-1);
     }
 
     if (canAssign && Match(TOKEN_ASSIGN)) {
@@ -1342,7 +1668,146 @@ static ParseRule* CompilerGetRule(TokenType type) {
 }
 
 ObjFunction* Compile(const char* source) {
-    ScannerInit(source);
+    MJ_Source* copy = MJ_SourceNew(source);
+    ObjFunction* function = CompileSource(copy);
+    MJ_SourceRelease(copy);
+    return function;
+}
+
+#ifdef PARALLEL_COMPILE_AVAILABLE
+
+/// @brief [INTERNAL] Compiles a top-level function by itself, starting from its name, the way FunctionDeclaration
+/// would have.
+static void PrecompileFunction(Precompiled* function) {
+    parser.hadError = false;
+    parser.panicMode = false;
+    current = NULL;
+    currentClass = NULL;
+
+    const char* end = parser.source->text + parser.source->length;
+    ScannerRestore((Scanner){function->name.start, function->name.start, end, function->name.line});
+    CompilerAdvance();
+    CompilerAdvance();  // CompilerInit takes the name from parser.previous.
+
+    Compiler compiler;
+    ObjFunction* compiled = CompilerFunctionBody(&compiler, TYPE_FUNCTION);
+
+    // There are no locals at the top of a script to capture, so the closure needs no upvalues.
+    function->function = (parser.hadError || compiled->upvalueCount > 0) ? NULL : compiled;
+    function->previous = parser.previous;
+    function->current = parser.current;
+    function->scanner = ScannerSave();
+    ArenaFree(&arena);
+}
+
+typedef struct {
+    VM* vm;         // The compiling thread's VM, which the others allocate from as well.
+    MJ_Source* source;
+    Precompiled* functions;
+    int count;
+    int first;      // The thread compiles every step-th function from first on.
+    int step;
+} PrecompileWork;
+
+static void* PrecompileThread(void* argument) {
+    PrecompileWork* work = (PrecompileWork*)argument;
+    vm = work->vm;
+    parser.source = work->source;
+    parser.quiet = true;
+
+    for (int i = work->first; i < work->count; i += work->step)
+        PrecompileFunction(&work->functions[i]);
+
+    parser.quiet = false;
+    return NULL;
+}
+
+/// @brief [INTERNAL] Finds the functions declared at the top of a large script and, if there are enough, compiles
+/// them on a few threads, which leaves the serial pass with the rest of the script. The heap is shared (so nothing
+/// gets collected) while they run.
+static void CompilerPrecompile(MJ_Source* source) {
+    if (source->length < PARALLEL_COMPILE_MIN_BYTES)
+        return;
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadCount = (processors > COMPILE_THREADS_MAX) ? COMPILE_THREADS_MAX : (int)processors;
+    if (threadCount < 2)
+        return;
+
+    // Only the braces are followed, which is enough to know what is at the top. (Anything wrongly picked up is
+    // never asked for by FindPrecompiled.)
+    int capacity = 0;
+    int depth = 0;
+    TokenType previous = TOKEN_EOF;
+    ScannerInit(source->text, source->length);
+
+    for (Token token = ScannerScanToken(); token.type != TOKEN_EOF; token = ScannerScanToken()) {
+        if (token.type == TOKEN_BRACKET_OPEN) {
+            depth++;
+        } else if (token.type == TOKEN_BRACKET_CLOSE) {
+            depth--;
+        } else if (token.type == TOKEN_IDENTIFIER && previous == TOKEN_FUNCTION && depth == 0) {
+            if (capacity < precompiledCount + 1) {
+                capacity = GROW_CAPACITY(capacity);
+                Precompiled* grown = realloc(precompiled, sizeof(Precompiled) * capacity);
+                if (grown == NULL)
+                    break;
+                precompiled = grown;
+            }
+
+            precompiled[precompiledCount].name = token;
+            precompiled[precompiledCount].function = NULL;
+            precompiledCount++;
+        }
+
+        previous = token.type;
+    }
+
+    if (precompiledCount < PARALLEL_COMPILE_MIN) {
+        precompiledCount = 0;
+        return;
+    }
+
+    PrecompileWork work[COMPILE_THREADS_MAX];
+    pthread_t threads[COMPILE_THREADS_MAX];
+    bool started[COMPILE_THREADS_MAX];
+
+    HeapShare(true);
+
+    // This thread takes the first share, and any a thread couldn't be started for.
+    for (int i = 0; i < threadCount; i++) {
+        work[i] = (PrecompileWork){vm, source, precompiled, precompiledCount, i, threadCount};
+        started[i] = (i > 0) && pthread_create(&threads[i], NULL, PrecompileThread, &work[i]) == 0;
+    }
+
+    for (int i = 0; i < threadCount; i++) {
+        if (!started[i])
+            PrecompileThread(&work[i]);
+    }
+
+    for (int i = 1; i < threadCount; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+
+    HeapShare(false);
+}
+
+#else
+
+static void CompilerPrecompile(MJ_Source* source) {
+}
+
+#endif
+
+/// @brief Compiles a script without copying its source (the chunks keep a reference to it instead).
+/// @param source Source to compile.
+/// @return The script's top-level function, or NULL if it had errors.
+ObjFunction* CompileSource(MJ_Source* source) {
+    CompilerPrecompile(source);
+
+    ScannerInit(source->text, source->length);
+    parser.source = MJ_SourceRetain(source);
     Compiler compiler;
     CompilerInit(&compiler, TYPE_SCRIPT);
 
@@ -1356,6 +1821,14 @@ ObjFunction* Compile(const char* source) {
     }
 
     ObjFunction* function = CompilerEnd();
+    MJ_SourceRelease(parser.source);
+    parser.source = NULL;
+    ArenaFree(&arena);
+
+    free(precompiled);
+    precompiled = NULL;
+    precompiledCount = 0;
+    nextPrecompiled = 0;
     return (parser.hadError ? NULL : function);
 }
 
@@ -1365,4 +1838,10 @@ void CompilerMarkRoots() {
         MarkObject((Object*)compiler->function);
         compiler = compiler->enclosing;   
     }
+
+    // Functions compiled ahead that the serial pass hasn't taken yet.
+    for (int i = 0; i < precompiledCount; i++) {
+        if (precompiled[i].function != NULL)
+            MarkObject((Object*)precompiled[i].function);
+    }
 }
\ No newline at end of file
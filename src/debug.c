@@ -70,6 +70,34 @@ static int InvokeInstruction(const char* name, MJ_Chunk* chunk, int offset) {
 
     return offset + 3;
 }
+
+static int NativeInstruction(const char* name, MJ_Chunk* chunk, int offset) {
+    uint8_t native = chunk->code[offset + 1];
+    uint8_t argumentCount = chunk->code[offset + 2];
+
+    printf("%-16s (%d args) native %d\n", name, argumentCount, native);
+    return offset + 3;
+}
+
+static void RKOperandPrint(MJ_Chunk* chunk, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        printf("k%d '", operand & RK_MAX);
+        ValuePrint(chunk->constants.values[operand & RK_MAX]);
+        printf("'");
+    }
+    else
+        printf("r%d", operand);
+}
+
+static int RegisterInstruction(const char* name, MJ_Chunk* chunk, int offset) {
+    printf("%-16s ", name);
+    RKOperandPrint(chunk, chunk->code[offset + 1]);
+    printf(" ");
+    RKOperandPrint(chunk, chunk->code[offset + 2]);
+    printf("\n");
+    return offset + 3;
+}
+
 /// @brief [DEBUG] Prints out an instruction from a Chunk array at the given offset.
 /// @param chunk Chunk array with instructions.
 /// @param offset Instruction offset.
@@ -161,10 +189,48 @@ int DisassembleInstruction(MJ_Chunk* chunk, int offset) {
             return SimpleInstruction("OP_BITWISE_AND", offset);
         case OP_BITWISE_OR:
             return SimpleInstruction("OP_BITWISE_OR", offset);
+        case OP_ADD_RK:
+            return RegisterInstruction("OP_ADD_RK", chunk, offset);
+        case OP_SUBTRACT_RK:
+            return RegisterInstruction("OP_SUBTRACT_RK", chunk, offset);
+        case OP_MULTIPLY_RK:
+            return RegisterInstruction("OP_MULTIPLY_RK", chunk, offset);
+        case OP_DIVIDE_RK:
+            return RegisterInstruction("OP_DIVIDE_RK", chunk, offset);
+        case OP_GREATER_RK:
+            return RegisterInstruction("OP_GREATER_RK", chunk, offset);
+        case OP_SMALLER_RK:
+            return RegisterInstruction("OP_SMALLER_RK", chunk, offset);
+        case OP_ADD_NUM:
+            return SimpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return SimpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return SimpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return SimpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_GREATER_NUM:
+            return SimpleInstruction("OP_GREATER_NUM", offset);
+        case OP_SMALLER_NUM:
+            return SimpleInstruction("OP_SMALLER_NUM", offset);
+        case OP_ADD_RK_NUM:
+            return RegisterInstruction("OP_ADD_RK_NUM", chunk, offset);
+        case OP_SUBTRACT_RK_NUM:
+            return RegisterInstruction("OP_SUBTRACT_RK_NUM", chunk, offset);
+        case OP_MULTIPLY_RK_NUM:
+            return RegisterInstruction("OP_MULTIPLY_RK_NUM", chunk, offset);
+        case OP_DIVIDE_RK_NUM:
+            return RegisterInstruction("OP_DIVIDE_RK_NUM", chunk, offset);
+        case OP_GREATER_RK_NUM:
+            return RegisterInstruction("OP_GREATER_RK_NUM", chunk, offset);
+        case OP_SMALLER_RK_NUM:
+            return RegisterInstruction("OP_SMALLER_RK_NUM", chunk, offset);
         case OP_NEGATE:
             return SimpleInstruction("OP_NEGATE", offset);
         case OP_RETURN:
             return SimpleInstruction("OP_RETURN", offset);
+        case OP_YIELD:
+            return SimpleInstruction("OP_YIELD", offset);
         case OP_NOT:
             return SimpleInstruction("OP_NOT", offset);
         case OP_PRINT:
@@ -177,6 +243,14 @@ int DisassembleInstruction(MJ_Chunk* chunk, int offset) {
             return JumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return ByteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return ByteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_CALL_NATIVE:
+            return NativeInstruction("OP_CALL_NATIVE", chunk, offset);
+        case OP_LEN:
+            return ByteInstruction("OP_LEN", chunk, offset);
+        case OP_CLOCK:
+            return ByteInstruction("OP_CLOCK", chunk, offset);
         case OP_ARRAY:
             return ByteInstruction("OP_ARRAY", chunk, offset);
         case OP_MAP:
@@ -189,12 +263,17 @@ int DisassembleInstruction(MJ_Chunk* chunk, int offset) {
             return SimpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return ConstantInstruction("OP_METHOD", chunk, offset);
+        case OP_CONSTRUCTOR:
+            return ConstantInstruction("OP_CONSTRUCTOR", chunk, offset);
         case OP_SUPER_INVOKE:
             return InvokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-        case OP_CLOSURE: {
+        case OP_SUPER_CONSTRUCT:
+            return ByteInstruction("OP_SUPER_CONSTRUCT", chunk, offset);
+        case OP_CLOSURE:
+        case OP_CLOSURE_STACK: {
             offset++;
             uint8_t Constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", Constant);
+            printf("%-16s %4d ", (instruction == OP_CLOSURE) ? "OP_CLOSURE" : "OP_CLOSURE_STACK", Constant);
             ValuePrint(chunk->constants.values[Constant]);
             printf("\n");
 
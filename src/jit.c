@@ -0,0 +1,527 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "JIT.h"
+
+#ifdef JIT_AVAILABLE
+
+#include "Assembler.h"
+#include "Chunk.h"
+#include "Trace.h"
+#include "VM.h"
+
+// The translated code works directly on the interpreter's state: the frame's slots and vm->stackTop live in memory
+// and are re-read by every template, so any instruction can hand over to the interpreter (and back) at any point.
+//
+// Register use inside native code:
+//  rbx - Current CallFrame*.
+//  r15 - the VM the code was compiled for.
+//  rax, rcx, rdx, xmm0, xmm1 - Scratch.
+
+#define FRAME_REGISTER  RBX
+#define VM_REGISTER     R15
+
+#define STACK_TOP       ((int32_t)offsetof(VM, stackTop))
+#define FRAME_SLOTS     ((int32_t)offsetof(CallFrame, slots))
+#define FRAME_CLOSURE   ((int32_t)offsetof(CallFrame, closure))
+#define VALUE_TYPE      ((int32_t)offsetof(Value, type))
+#define VALUE_PAYLOAD   ((int32_t)offsetof(Value, as))
+#define VALUE_SIZE      ((int32_t)sizeof(Value))
+#define ARRAY_COUNT     ((int32_t)(offsetof(ObjArray, items) + offsetof(ValueArray, count)))
+#define STRING_LENGTH   ((int32_t)offsetof(ObjString, length))
+
+// Jump labels are bytecode offsets, plus this one for the exit stub.
+#define EXIT_LABEL -1
+
+/// @brief [INTERNAL] Runs the instruction at ip through the interpreter.
+/// @param ip Instruction to run.
+/// @return JIT_CONTINUE, or JIT_ERROR if the instruction failed.
+static JitStatus JitStep(uint8_t* ip) {
+    ObjFiber* fiber = vm->fiber;
+    int frameCount = vm->frameCount;
+    CallFrame* frame = &vm->frames[frameCount - 1];
+    uint8_t instruction = *ip;
+    frame->ip = ip;
+
+    InterpretResult result = VMStep(vm);
+
+    // A quickened instruction whose guard failed only rewrote itself, so the generic form still has to run.
+    // (A call or a fiber switch may have moved the frames, so frame is only looked at while we are still in it.)
+    if (result.status == INTERPRET_OK && vm->fiber == fiber && vm->frameCount == frameCount && frame->ip == ip &&
+        *ip != instruction)
+        result = VMStep(vm);
+
+    return (result.status == INTERPRET_OK) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+/// @brief [INTERNAL] Runs an instruction that changes frames (calls, returns...) and leaves native code.
+/// @param ip Instruction to run.
+/// @return JIT_EXIT, or JIT_ERROR if the instruction failed.
+static JitStatus JitStepAndExit(uint8_t* ip) {
+    return (JitStep(ip) == JIT_CONTINUE) ? JIT_EXIT : JIT_ERROR;
+}
+
+/// @brief [INTERNAL] Runs an instruction that calls a native (OP_CALL_NATIVE or an intrinsic), which only changes
+/// frames when the native's global was reassigned.
+/// @return JIT_CONTINUE if we are still in the same frame, JIT_EXIT if not, or JIT_ERROR.
+static JitStatus JitCallNative(uint8_t* ip) {
+    ObjFiber* fiber = vm->fiber;
+    int frameCount = vm->frameCount;
+    JitStatus status = JitStep(ip);
+    return (status == JIT_CONTINUE && (vm->fiber != fiber || vm->frameCount != frameCount)) ? JIT_EXIT : status;
+}
+
+/// @brief [INTERNAL] Back-edge of a loop in native code.
+/// @param header Instruction the loop jumps back to.
+/// @return JIT_CONTINUE to keep looping natively, or whatever the trace compiler left us with.
+static JitStatus JitLoop(uint8_t* header) {
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    frame->ip = header;
+    return TraceLoop(frame);
+}
+
+// mov rcx, [vm->stackTop]
+static void EmitLoadStackTop(Assembler* as) {
+    EmitLoad(as, RCX, VM_REGISTER, STACK_TOP);
+}
+
+// Pushes xmm0 (a whole Value) onto the stack.
+static void EmitPushValue(Assembler* as) {
+    EmitLoadStackTop(as);
+    EmitSse(as, SSE_UNALIGNED, MOVDQU_STORE, 0, RCX, 0);
+    EmitAddImmediate(as, VM_REGISTER, STACK_TOP, VALUE_SIZE);
+}
+
+static void EmitPushConstant(Assembler* as, Value value) {
+    uint64_t payload;
+    memcpy(&payload, &value.as, sizeof(payload));
+
+    EmitLoadStackTop(as);
+    EmitStoreImmediate(as, RCX, VALUE_TYPE, value.type);
+    EmitLoadImmediate(as, RAX, payload);
+    EmitStore(as, RCX, VALUE_PAYLOAD, RAX);
+    EmitAddImmediate(as, VM_REGISTER, STACK_TOP, VALUE_SIZE);
+}
+
+// Leaves the native code returning eax.
+static void EmitExit(Assembler* as) {
+    EmitJumpTo(as, CONDITION_ALWAYS, EXIT_LABEL);
+}
+
+/// @brief [INTERNAL] Emits a call into the interpreter for the instruction at ip.
+/// @param leave If true, native code is left afterwards (the instruction changes frames).
+static void EmitStep(Assembler* as, uint8_t* ip, bool leave) {
+    EmitLoadImmediate(as, RDI, (uint64_t)(uintptr_t)ip);
+    EmitCall(as, (void*)(leave ? JitStepAndExit : JitStep));
+
+    if (leave) {
+        EmitExit(as);
+        return;
+    }
+
+    Emit(as, 0x85); // test eax, eax
+    Emit(as, 0xc0);
+    EmitJumpTo(as, CONDITION_NOT_EQUAL, EXIT_LABEL);
+}
+
+// Like EmitStep, but only leaves native code if the native call did change frames.
+static void EmitNativeStep(Assembler* as, uint8_t* ip) {
+    EmitLoadImmediate(as, RDI, (uint64_t)(uintptr_t)ip);
+    EmitCall(as, (void*)JitCallNative);
+    Emit(as, 0x85); // test eax, eax
+    Emit(as, 0xc0);
+    EmitJumpTo(as, CONDITION_NOT_EQUAL, EXIT_LABEL);
+}
+
+/// @brief [INTERNAL] OP_LEN: arrays and strings inline, anything else (or a reassigned len) through the interpreter.
+static void EmitLength(Assembler* as, uint8_t* ip) {
+    int slowPaths[3];
+
+    EmitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)&vm->natives[ip[1]]->shadowed);
+    EmitCompareZeroByte(as, RAX, 0);
+    slowPaths[0] = EmitJump(as, CONDITION_NOT_EQUAL);
+
+    EmitLoadStackTop(as);
+    EmitCompareType(as, RCX, -VALUE_SIZE + VALUE_TYPE, VALUE_OBJECT);
+    slowPaths[1] = EmitJump(as, CONDITION_NOT_EQUAL);
+    EmitLoad(as, RAX, RCX, -VALUE_SIZE + VALUE_PAYLOAD);
+
+    EmitCompareType(as, RAX, (int32_t)offsetof(Object, type), (ValueType)OBJ_ARRAY);
+    slowPaths[2] = EmitJump(as, CONDITION_NOT_EQUAL);
+    EmitSse(as, SSE_DOUBLE, CVTSI2SD, 0, RAX, ARRAY_COUNT);
+    int arrayDone = EmitJump(as, CONDITION_ALWAYS);
+
+    PatchJump(as, slowPaths[2], as->count);
+    EmitCompareType(as, RAX, (int32_t)offsetof(Object, type), (ValueType)OBJ_STRING);
+    slowPaths[2] = EmitJump(as, CONDITION_NOT_EQUAL);
+    EmitSse(as, SSE_DOUBLE, CVTSI2SD, 0, RAX, STRING_LENGTH);
+
+    PatchJump(as, arrayDone, as->count);
+    EmitSse(as, SSE_DOUBLE, MOVSD_STORE, 0, RCX, -VALUE_SIZE + VALUE_PAYLOAD);
+    EmitStoreImmediate(as, RCX, -VALUE_SIZE + VALUE_TYPE, VALUE_NUMBER);
+    int done = EmitJump(as, CONDITION_ALWAYS);
+
+    for (int i = 0; i < 3; i++)
+        PatchJump(as, slowPaths[i], as->count);
+    EmitNativeStep(as, ip);
+    PatchJump(as, done, as->count);
+}
+
+// Stores the flags result of a ucomisd (a > b) as a bool Value at [rcx + displacement].
+static void EmitStoreAbove(Assembler* as, int32_t displacement) {
+    EmitSetAbove(as);
+    EmitStoreImmediate(as, RCX, displacement + VALUE_TYPE, VALUE_BOOL);
+    EmitStore(as, RCX, displacement + VALUE_PAYLOAD, RAX);
+}
+
+/// @brief [INTERNAL] Stack arithmetic: number fast path, with the interpreter as the slow path.
+static void EmitStackArithmetic(Assembler* as, uint8_t* ip, uint8_t operation) {
+    EmitLoadStackTop(as);
+    EmitCompareType(as, RCX, -VALUE_SIZE + VALUE_TYPE, VALUE_NUMBER);
+    int firstGuard = EmitJump(as, CONDITION_NOT_EQUAL);
+    EmitCompareType(as, RCX, -2 * VALUE_SIZE + VALUE_TYPE, VALUE_NUMBER);
+    int secondGuard = EmitJump(as, CONDITION_NOT_EQUAL);
+
+    EmitSse(as, SSE_DOUBLE, MOVSD_LOAD, 0, RCX, -2 * VALUE_SIZE + VALUE_PAYLOAD);
+    EmitSse(as, SSE_DOUBLE, operation, 0, RCX, -VALUE_SIZE + VALUE_PAYLOAD);
+    EmitSse(as, SSE_DOUBLE, MOVSD_STORE, 0, RCX, -2 * VALUE_SIZE + VALUE_PAYLOAD);
+    EmitAddImmediate(as, VM_REGISTER, STACK_TOP, -VALUE_SIZE);
+    int done = EmitJump(as, CONDITION_ALWAYS);
+
+    PatchJump(as, firstGuard, as->count);
+    PatchJump(as, secondGuard, as->count);
+    EmitStep(as, ip, false);
+    PatchJump(as, done, as->count);
+}
+
+/// @brief [INTERNAL] Stack comparison (a > b, or a < b when swapped): number fast path, interpreter slow path.
+static void EmitStackComparison(Assembler* as, uint8_t* ip, bool swapped) {
+    EmitLoadStackTop(as);
+    EmitCompareType(as, RCX, -VALUE_SIZE + VALUE_TYPE, VALUE_NUMBER);
+    int firstGuard = EmitJump(as, CONDITION_NOT_EQUAL);
+    EmitCompareType(as, RCX, -2 * VALUE_SIZE + VALUE_TYPE, VALUE_NUMBER);
+    int secondGuard = EmitJump(as, CONDITION_NOT_EQUAL);
+
+    int32_t left = (swapped ? -1 : -2) * VALUE_SIZE + VALUE_PAYLOAD;
+    int32_t right = (swapped ? -2 : -1) * VALUE_SIZE + VALUE_PAYLOAD;
+    EmitSse(as, SSE_DOUBLE, MOVSD_LOAD, 0, RCX, left);
+    EmitSse(as, SSE_COMPARE, UCOMISD, 0, RCX, right);
+    EmitStoreAbove(as, -2 * VALUE_SIZE);
+    EmitAddImmediate(as, VM_REGISTER, STACK_TOP, -VALUE_SIZE);
+    int done = EmitJump(as, CONDITION_ALWAYS);
+
+    PatchJump(as, firstGuard, as->count);
+    PatchJump(as, secondGuard, as->count);
+    EmitStep(as, ip, false);
+    PatchJump(as, done, as->count);
+}
+
+/// @brief [INTERNAL] Loads an RK operand into an xmm register, guarding slots on being numbers.
+/// @return Position of the guard's jump, or -1 if the operand is a constant (already checked at compile time).
+static int EmitLoadRK(Assembler* as, MJ_Chunk* chunk, uint8_t operand, int xmm) {
+    if (operand & RK_CONSTANT) {
+        uint64_t bits;
+        memcpy(&bits, &chunk->constants.values[operand & RK_MAX].as.number, sizeof(bits));
+        EmitLoadImmediate(as, RDX, bits);
+        EmitMoveToXmm(as, xmm, RDX);
+        return -1;
+    }
+
+    EmitLoad(as, RAX, FRAME_REGISTER, FRAME_SLOTS);
+    EmitCompareType(as, RAX, operand * VALUE_SIZE + VALUE_TYPE, VALUE_NUMBER);
+    int guard = EmitJump(as, CONDITION_NOT_EQUAL);
+    EmitSse(as, SSE_DOUBLE, MOVSD_LOAD, xmm, RAX, operand * VALUE_SIZE + VALUE_PAYLOAD);
+    return guard;
+}
+
+/// @brief [INTERNAL] Register arithmetic or comparison. Constant operands are known now, so only slots are guarded.
+static void EmitRegisterOp(Assembler* as, MJ_Chunk* chunk, uint8_t* ip, uint8_t operation, bool compare) {
+    uint8_t left = ip[1];
+    uint8_t right = ip[2];
+
+    // A constant that isn't a number can never take the fast path.
+    if (((left & RK_CONSTANT) && !IS_NUMBER(chunk->constants.values[left & RK_MAX])) ||
+        ((right & RK_CONSTANT) && !IS_NUMBER(chunk->constants.values[right & RK_MAX]))) {
+        EmitStep(as, ip, false);
+        return;
+    }
+
+    int firstGuard = EmitLoadRK(as, chunk, left, 0);
+    int secondGuard = EmitLoadRK(as, chunk, right, 1);
+
+    EmitLoadStackTop(as);
+    if (compare) {
+        // operation is 0 for a > b and 1 for a < b (that is, b > a).
+        EmitSseRegister(as, SSE_COMPARE, UCOMISD, operation, 1 - operation);
+        EmitStoreAbove(as, 0);
+    } else {
+        EmitSseRegister(as, SSE_DOUBLE, operation, 0, 1);
+        EmitStoreImmediate(as, RCX, VALUE_TYPE, VALUE_NUMBER);
+        EmitSse(as, SSE_DOUBLE, MOVSD_STORE, 0, RCX, VALUE_PAYLOAD);
+    }
+    EmitAddImmediate(as, VM_REGISTER, STACK_TOP, VALUE_SIZE);
+
+    if (firstGuard == -1 && secondGuard == -1)
+        return;
+
+    int done = EmitJump(as, CONDITION_ALWAYS);
+    if (firstGuard != -1)
+        PatchJump(as, firstGuard, as->count);
+    if (secondGuard != -1)
+        PatchJump(as, secondGuard, as->count);
+    EmitStep(as, ip, false);
+    PatchJump(as, done, as->count);
+}
+
+// Loads the address of upvalue `index`'s variable into rax.
+static void EmitUpvalueAddress(Assembler* as, int index) {
+    EmitLoad(as, RAX, FRAME_REGISTER, FRAME_CLOSURE);
+    EmitLoad(as, RAX, RAX, (int32_t)offsetof(ObjClosure, upvalues) + index * (int32_t)sizeof(ObjUpvalue*));
+    EmitLoad(as, RAX, RAX, (int32_t)offsetof(ObjUpvalue, location));
+}
+
+/// @brief [INTERNAL] Whether an instruction the JIT has no template for keeps running in the same frame.
+/// Anything not listed here is assumed to change frames, so native code is left after running it.
+static bool IsStraightLine(uint8_t instruction) {
+    switch (instruction) {
+        case OP_MAYBE:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_INDEX:
+        case OP_GET_INDEX:
+        case OP_GET_INDEX_RANGED:
+        case OP_CLOSE_UPVALUE:
+        case OP_SET_PROPERTY:
+        case OP_GET_PROPERTY:
+        case OP_INIT_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_ARRAY:
+        case OP_MAP:
+        case OP_CLASS:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_CONSTRUCTOR:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQ:
+        case OP_SMALLER_EQ:
+        case OP_IS:
+        case OP_PREINCREASE:
+        case OP_POSTINCREASE:
+        case OP_PREDECREASE:
+        case OP_POSTDECREASE:
+        case OP_MOD:
+        case OP_BITWISE_OR:
+        case OP_BITWISE_AND:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_CLOSURE:
+        case OP_CLOSURE_STACK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// @brief [INTERNAL] Emits the template for one instruction.
+static void CompileInstruction(Assembler* as, MJ_Chunk* chunk, int offset, int length) {
+    uint8_t* ip = &chunk->code[offset];
+
+    switch (*ip) {
+        case OP_CONSTANT:
+            EmitPushConstant(as, chunk->constants.values[ip[1]]);
+            break;
+        case OP_CONSTANT_LONG:
+            EmitPushConstant(as, chunk->constants.values[(ip[1] << 24) | (ip[2] << 16) | (ip[3] << 8) | ip[4]]);
+            break;
+        case OP_NULL:   EmitPushConstant(as, NULL_VALUE);       break;
+        case OP_TRUE:   EmitPushConstant(as, BOOL_VALUE(true));  break;
+        case OP_FALSE:  EmitPushConstant(as, BOOL_VALUE(false)); break;
+        case OP_POP:
+            EmitAddImmediate(as, VM_REGISTER, STACK_TOP, -VALUE_SIZE);
+            break;
+        case OP_DUPLICATE:
+            EmitLoadStackTop(as);
+            EmitSse(as, SSE_UNALIGNED, MOVDQU_LOAD, 0, RCX, -VALUE_SIZE);
+            EmitSse(as, SSE_UNALIGNED, MOVDQU_STORE, 0, RCX, 0);
+            EmitAddImmediate(as, VM_REGISTER, STACK_TOP, VALUE_SIZE);
+            break;
+        case OP_GET_LOCAL:
+            EmitLoad(as, RAX, FRAME_REGISTER, FRAME_SLOTS);
+            EmitSse(as, SSE_UNALIGNED, MOVDQU_LOAD, 0, RAX, ip[1] * VALUE_SIZE);
+            EmitPushValue(as);
+            break;
+        case OP_SET_LOCAL:
+            EmitLoadStackTop(as);
+            EmitSse(as, SSE_UNALIGNED, MOVDQU_LOAD, 0, RCX, -VALUE_SIZE);
+            EmitLoad(as, RAX, FRAME_REGISTER, FRAME_SLOTS);
+            EmitSse(as, SSE_UNALIGNED, MOVDQU_STORE, 0, RAX, ip[1] * VALUE_SIZE);
+            break;
+        case OP_GET_UPVALUE:
+            EmitUpvalueAddress(as, ip[1]);
+            EmitSse(as, SSE_UNALIGNED, MOVDQU_LOAD, 0, RAX, 0);
+            EmitPushValue(as);
+            break;
+        case OP_SET_UPVALUE:
+            EmitUpvalueAddress(as, ip[1]);
+            EmitLoadStackTop(as);
+            EmitSse(as, SSE_UNALIGNED, MOVDQU_LOAD, 0, RCX, -VALUE_SIZE);
+            EmitSse(as, SSE_UNALIGNED, MOVDQU_STORE, 0, RAX, 0);
+            break;
+        case OP_JUMP:
+            EmitJumpTo(as, CONDITION_ALWAYS, offset + length + ((ip[1] << 8) | ip[2]));
+            break;
+        case OP_LOOP: {
+            // Back-edges give the trace compiler a chance to take over the loop.
+            int target = offset + length - ((ip[1] << 8) | ip[2]);
+            EmitLoadImmediate(as, RDI, (uint64_t)(uintptr_t)&chunk->code[target]);
+            EmitCall(as, (void*)JitLoop);
+            Emit(as, 0x85); // test eax, eax
+            Emit(as, 0xc0);
+            EmitJumpTo(as, CONDITION_NOT_EQUAL, EXIT_LABEL);
+            EmitJumpTo(as, CONDITION_ALWAYS, target);
+            break;
+        }
+        case OP_JUMP_IF_FALSE: {
+            // null and false are the only falsey values.
+            int target = offset + length + ((ip[1] << 8) | ip[2]);
+            EmitLoadStackTop(as);
+            EmitCompareType(as, RCX, -VALUE_SIZE + VALUE_TYPE, VALUE_NULL);
+            EmitJumpTo(as, CONDITION_EQUAL, target);
+            EmitCompareType(as, RCX, -VALUE_SIZE + VALUE_TYPE, VALUE_BOOL);
+            int truthy = EmitJump(as, CONDITION_NOT_EQUAL);
+            EmitCompareZeroByte(as, RCX, -VALUE_SIZE + VALUE_PAYLOAD);
+            EmitJumpTo(as, CONDITION_EQUAL, target);
+            PatchJump(as, truthy, as->count);
+            break;
+        }
+
+        case OP_ADD:
+        case OP_ADD_NUM:            EmitStackArithmetic(as, ip, ADDSD); break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:       EmitStackArithmetic(as, ip, SUBSD); break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:       EmitStackArithmetic(as, ip, MULSD); break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:         EmitStackArithmetic(as, ip, DIVSD); break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:        EmitStackComparison(as, ip, false); break;
+        case OP_SMALLER:
+        case OP_SMALLER_NUM:        EmitStackComparison(as, ip, true); break;
+
+        case OP_ADD_RK:
+        case OP_ADD_RK_NUM:         EmitRegisterOp(as, chunk, ip, ADDSD, false); break;
+        case OP_SUBTRACT_RK:
+        case OP_SUBTRACT_RK_NUM:    EmitRegisterOp(as, chunk, ip, SUBSD, false); break;
+        case OP_MULTIPLY_RK:
+        case OP_MULTIPLY_RK_NUM:    EmitRegisterOp(as, chunk, ip, MULSD, false); break;
+        case OP_DIVIDE_RK:
+        case OP_DIVIDE_RK_NUM:      EmitRegisterOp(as, chunk, ip, DIVSD, false); break;
+        case OP_GREATER_RK:
+        case OP_GREATER_RK_NUM:     EmitRegisterOp(as, chunk, ip, 0, true); break;
+        case OP_SMALLER_RK:
+        case OP_SMALLER_RK_NUM:     EmitRegisterOp(as, chunk, ip, 1, true); break;
+
+        case OP_CALL_NATIVE:
+        case OP_CLOCK:
+            EmitNativeStep(as, ip);
+            break;
+        case OP_LEN:
+            EmitLength(as, ip);
+            break;
+
+        default:
+            EmitStep(as, ip, !IsStraightLine(*ip));
+            break;
+    }
+}
+
+/// @brief Translates a function's bytecode to native code. On failure the function simply stays interpreted.
+/// @param function Function to compile.
+void JitCompile(ObjFunction* function) {
+    MJ_Chunk* chunk = &function->chunk;
+    Assembler as = {0};
+
+    uint32_t* entries = malloc(sizeof(uint32_t) * (chunk->count + 1));
+    if (entries == NULL)
+        return;
+    for (int i = 0; i <= chunk->count; i++)
+        entries[i] = UINT32_MAX;
+
+    // Prologue: save the callee-saved registers we use (keeping the stack 16-byte aligned) and jump to the entry.
+    Emit(&as, 0x53);                    // push rbx
+    Emit(&as, 0x41); Emit(&as, 0x57);   // push r15
+    Emit(&as, 0x48); Emit(&as, 0x83); Emit(&as, 0xec); Emit(&as, 0x08); // sub rsp, 8
+    Emit(&as, 0x48); Emit(&as, 0x89); Emit(&as, 0xfb);                  // mov rbx, rdi
+    EmitLoadImmediate(&as, VM_REGISTER, (uint64_t)(uintptr_t)vm);
+    Emit(&as, 0xff); Emit(&as, 0xe6);   // jmp rsi
+
+    for (int offset = 0; offset < chunk->count;) {
+        int length = MJ_ChunkInstructionLength(chunk, offset);
+        entries[offset] = (uint32_t)as.count;
+        CompileInstruction(&as, chunk, offset, length);
+        offset += length;
+    }
+
+    // Running off the end can't happen (every function ends in a return), but leave cleanly if it does.
+    entries[chunk->count] = (uint32_t)as.count;
+    Emit(&as, 0xb8);                    // mov eax, JIT_ERROR
+    Emit32(&as, JIT_ERROR);
+
+    int exit = as.count;
+    Emit(&as, 0x48); Emit(&as, 0x83); Emit(&as, 0xc4); Emit(&as, 0x08); // add rsp, 8
+    Emit(&as, 0x41); Emit(&as, 0x5f);   // pop r15
+    Emit(&as, 0x5b);                    // pop rbx
+    Emit(&as, 0xc3);                    // ret
+
+    for (int i = 0; i < as.fixupCount; i++) {
+        AsmFixup* fixup = &as.fixups[i];
+        PatchJump(&as, fixup->at, (fixup->target == EXIT_LABEL) ? exit : (int)entries[fixup->target]);
+    }
+
+    size_t size;
+    uint8_t* code = AsmFinish(&as, &size);
+    if (code == NULL) {
+        free(entries);
+        return;
+    }
+
+    JitCode* jit = malloc(sizeof(JitCode));
+    if (jit == NULL) {
+        AsmRelease(code, size);
+        free(entries);
+        return;
+    }
+
+    jit->code = code;
+    jit->size = size;
+    jit->entries = entries;
+    jit->entryCount = chunk->count + 1;
+    function->jit = jit;
+}
+
+/// @brief Runs a frame's function natively, starting at the frame's current instruction.
+/// @param frame Frame to run (its function must have been compiled).
+/// @return Why native code stopped running.
+JitStatus JitEnter(CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    JitCode* jit = function->jit;
+    uint32_t entry = jit->entries[frame->ip - function->chunk.code];
+
+    return ((JitFunction)(void*)jit->code)(frame, jit->code + entry);
+}
+
+/// @brief Releases a function's native code.
+/// @param jit Code to free (may be NULL).
+void JitFree(JitCode* jit) {
+    if (jit == NULL)
+        return;
+
+    AsmRelease(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+}
+
+#endif
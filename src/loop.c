@@ -0,0 +1,418 @@
+#define _GNU_SOURCE // For fork, pipe2, syscall and waitpid.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Loop.h"
+#include "Memory.h"
+
+#ifdef EVENT_LOOP_AVAILABLE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Operations are owned by the loop until they are handed back by LoopWait: the pending ones in a list (so they
+// can be marked and cancelled), the finished ones in a queue, oldest first.
+
+// Bytes a read asks for at once.
+#define LOOP_READ_CHUNK 4096
+
+// Nanoseconds between checks on whether a command has exited, where the kernel has no pidfds to watch instead.
+#define LOOP_PROCESS_POLL 10000000
+
+struct Loop {
+    int epoll;
+    LoopOperation* pending;
+    int pendingCount;
+    LoopOperation* finished;
+    LoopOperation* finishedLast;
+};
+
+/// @brief [INTERNAL] realloc that gives up on the process when memory runs out, like reallocate does.
+static void* LoopReallocate(void* pointer, size_t size) {
+    void* result = realloc(pointer, size);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+/// @brief Creates an event loop.
+/// @return The loop, or NULL if epoll couldn't be set up (errno tells why).
+Loop* LoopNew() {
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0)
+        return NULL;
+
+    Loop* loop = LoopReallocate(NULL, sizeof(Loop));
+    loop->epoll = epoll;
+    loop->pending = NULL;
+    loop->pendingCount = 0;
+    loop->finished = NULL;
+    loop->finishedLast = NULL;
+    return loop;
+}
+
+/// @brief [INTERNAL] Lets go of an operation's descriptor, and of its command if that hasn't been reaped.
+static void OperationClose(Loop* loop, LoopOperation* operation) {
+    if (operation->watched)
+        epoll_ctl(loop->epoll, EPOLL_CTL_DEL, operation->descriptor, NULL);
+    operation->watched = false;
+
+    if (operation->descriptor >= 0)
+        close(operation->descriptor);
+    operation->descriptor = -1;
+
+    // Only an operation that failed (or was dropped) gets here with its command still running, and it isn't
+    // waited for then.
+    if (operation->process > 0)
+        waitpid(operation->process, NULL, WNOHANG);
+    operation->process = 0;
+}
+
+/// @brief Frees a loop. Operations still pending are dropped, their descriptors closed.
+void LoopFree(Loop* loop) {
+    while (loop->pending != NULL) {
+        LoopOperation* operation = loop->pending;
+        loop->pending = operation->next;
+        OperationClose(loop, operation);
+        LoopOperationFree(operation);
+    }
+
+    while (loop->finished != NULL) {
+        LoopOperation* operation = loop->finished;
+        loop->finished = operation->next;
+        LoopOperationFree(operation);
+    }
+
+    close(loop->epoll);
+    free(loop);
+}
+
+/// @brief Whether fibers are still waiting on the loop.
+bool LoopPending(Loop* loop) {
+    return loop != NULL && (loop->pendingCount > 0 || loop->finished != NULL);
+}
+
+/// @brief Marks the fibers waiting on the loop, which nothing else may reference anymore.
+void LoopMark(Loop* loop) {
+    for (LoopOperation* operation = loop->pending; operation != NULL; operation = operation->next)
+        MarkObject((Object*)operation->fiber);
+    for (LoopOperation* operation = loop->finished; operation != NULL; operation = operation->next)
+        MarkObject((Object*)operation->fiber);
+}
+
+/// @brief [INTERNAL] Starts tracking an operation on a descriptor (which it now owns).
+static LoopOperation* OperationNew(Loop* loop, ObjFiber* fiber, const char* name, LoopKind kind, int descriptor) {
+    LoopOperation* operation = LoopReallocate(NULL, sizeof(LoopOperation));
+    operation->fiber = fiber;
+    operation->name = name;
+    operation->kind = kind;
+    operation->descriptor = descriptor;
+    operation->watched = false;
+    operation->process = 0;
+    operation->status = 0;
+    operation->buffer = NULL;
+    operation->length = 0;
+    operation->capacity = 0;
+    operation->written = 0;
+    operation->error = 0;
+
+    operation->previous = NULL;
+    operation->next = loop->pending;
+    if (loop->pending != NULL)
+        loop->pending->previous = operation;
+    loop->pending = operation;
+    loop->pendingCount++;
+    return operation;
+}
+
+/// @brief [INTERNAL] Moves an operation from the pending list to the back of the finished queue.
+static void OperationFinish(Loop* loop, LoopOperation* operation, int error) {
+    operation->error = error;
+    OperationClose(loop, operation);
+
+    if (operation->previous != NULL)
+        operation->previous->next = operation->next;
+    else
+        loop->pending = operation->next;
+    if (operation->next != NULL)
+        operation->next->previous = operation->previous;
+    loop->pendingCount--;
+
+    operation->previous = NULL;
+    operation->next = NULL;
+    if (loop->finishedLast != NULL)
+        loop->finishedLast->next = operation;
+    else
+        loop->finished = operation;
+    loop->finishedLast = operation;
+}
+
+/// @brief [INTERNAL] Reaps an operation's command if it has exited, finishing the operation with its exit status.
+/// @return Whether the operation finished.
+static bool OperationReap(Loop* loop, LoopOperation* operation) {
+    int status;
+    pid_t reaped;
+    do {
+        reaped = waitpid(operation->process, &status, WNOHANG);
+    } while (reaped < 0 && errno == EINTR);
+
+    if (reaped == 0)
+        return false;
+
+    operation->process = 0;
+    if (reaped < 0) {
+        OperationFinish(loop, operation, errno);
+        return true;
+    }
+
+    // Like the shell, a command killed by a signal gets 128 plus the signal's number.
+    operation->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    OperationFinish(loop, operation, 0);
+    return true;
+}
+
+static void OperationWatch(Loop* loop, LoopOperation* operation);
+
+/// @brief [INTERNAL] Once a command's output has ended, waits for the command itself without blocking: on a pidfd,
+/// which becomes readable when it exits, or, on kernels without pidfds, on a timer that checks every
+/// LOOP_PROCESS_POLL.
+static void OperationAwaitProcess(Loop* loop, LoopOperation* operation) {
+    if (operation->watched)
+        epoll_ctl(loop->epoll, EPOLL_CTL_DEL, operation->descriptor, NULL);
+    operation->watched = false;
+    close(operation->descriptor);
+    operation->descriptor = -1;
+    operation->kind = LOOP_PROCESS;
+
+    if (OperationReap(loop, operation))
+        return;
+
+    int descriptor = -1;
+#ifdef SYS_pidfd_open
+    descriptor = (int)syscall(SYS_pidfd_open, operation->process, 0);
+#endif
+    if (descriptor < 0) {
+        descriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct itimerspec interval = {{0, LOOP_PROCESS_POLL}, {0, LOOP_PROCESS_POLL}};
+        if (descriptor >= 0 && timerfd_settime(descriptor, 0, &interval, NULL) < 0) {
+            int error = errno;
+            close(descriptor);
+            errno = error;
+            descriptor = -1;
+        }
+    }
+
+    if (descriptor < 0) {
+        OperationFinish(loop, operation, errno);
+        return;
+    }
+
+    operation->descriptor = descriptor;
+    OperationWatch(loop, operation);
+}
+
+/// @brief [INTERNAL] Does as much of an operation as its descriptor allows without blocking.
+static void OperationProgress(Loop* loop, LoopOperation* operation) {
+    for (;;) {
+        ssize_t count;
+        switch (operation->kind) {
+            case LOOP_PROCESS: {
+                // A pidfd has nothing to read, but a timer has to be emptied, or it stays ready.
+                uint64_t expirations;
+                while (read(operation->descriptor, &expirations, sizeof(expirations)) < 0 && errno == EINTR)
+                    continue;
+                OperationReap(loop, operation);
+                return;
+            }
+            case LOOP_TIMER: {
+                uint64_t expirations;
+                count = read(operation->descriptor, &expirations, sizeof(expirations));
+                break;
+            }
+            case LOOP_READ:
+                if (operation->capacity - operation->length < LOOP_READ_CHUNK) {
+                    operation->capacity = (operation->capacity < LOOP_READ_CHUNK) ? 2 * LOOP_READ_CHUNK
+                                                                                   : 2 * operation->capacity;
+                    operation->buffer = LoopReallocate(operation->buffer, operation->capacity);
+                }
+                count = read(operation->descriptor, operation->buffer + operation->length,
+                             operation->capacity - operation->length);
+                break;
+            case LOOP_WRITE:
+                if (operation->written == operation->length) {
+                    OperationFinish(loop, operation, 0);
+                    return;
+                }
+                count = write(operation->descriptor, operation->buffer + operation->written,
+                              operation->length - operation->written);
+                break;
+        }
+
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                OperationFinish(loop, operation, errno);
+            return;
+        }
+
+        // A timer only becomes readable once it expires, and a read of nothing is the end of the file.
+        if (operation->kind == LOOP_TIMER || (operation->kind == LOOP_READ && count == 0)) {
+            if (operation->process > 0)
+                OperationAwaitProcess(loop, operation);
+            else
+                OperationFinish(loop, operation, 0);
+            return;
+        }
+
+        if (operation->kind == LOOP_READ)
+            operation->length += (size_t)count;
+        else
+            operation->written += (size_t)count;
+    }
+}
+
+/// @brief [INTERNAL] Hands an operation's descriptor to epoll, or, for files it refuses (regular files, which
+/// never block), does the whole operation right away.
+static void OperationWatch(Loop* loop, LoopOperation* operation) {
+    struct epoll_event event;
+    event.events = (operation->kind == LOOP_WRITE) ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = operation;
+
+    if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, operation->descriptor, &event) == 0) {
+        operation->watched = true;
+        return;
+    }
+
+    if (errno != EPERM) {
+        OperationFinish(loop, operation, errno);
+        return;
+    }
+
+    OperationProgress(loop, operation);
+}
+
+/// @brief Makes a fiber wait for some time.
+/// @return Whether the timer could be made (errno tells why not).
+bool LoopSleep(Loop* loop, ObjFiber* fiber, double seconds) {
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer < 0)
+        return false;
+
+    // A timer set to zero is disarmed, so the shortest sleep is a nanosecond.
+    struct itimerspec expiry = {0};
+    expiry.it_value.tv_sec = (time_t)seconds;
+    expiry.it_value.tv_nsec = (long)((seconds - (double)expiry.it_value.tv_sec) * 1e9);
+    if (expiry.it_value.tv_sec == 0 && expiry.it_value.tv_nsec == 0)
+        expiry.it_value.tv_nsec = 1;
+
+    if (timerfd_settime(timer, 0, &expiry, NULL) < 0) {
+        close(timer);
+        return false;
+    }
+
+    OperationWatch(loop, OperationNew(loop, fiber, "sleep", LOOP_TIMER, timer));
+    return true;
+}
+
+/// @brief Makes a fiber wait for a file (or pipe, or device...) to be read to its end.
+/// @return Whether the file could be opened (errno tells why not).
+bool LoopReadFile(Loop* loop, ObjFiber* fiber, const char* path) {
+    int file = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (file < 0)
+        return false;
+
+    OperationWatch(loop, OperationNew(loop, fiber, "readFile", LOOP_READ, file));
+    return true;
+}
+
+/// @brief Makes a fiber wait for text to be written to a file, which is created or emptied first.
+/// @return Whether the file could be opened (errno tells why not).
+bool LoopWriteFile(Loop* loop, ObjFiber* fiber, const char* path, const char* text, size_t length) {
+    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0666);
+    if (file < 0)
+        return false;
+
+    LoopOperation* operation = OperationNew(loop, fiber, "writeFile", LOOP_WRITE, file);
+    operation->buffer = LoopReallocate(NULL, length + 1);
+    memcpy(operation->buffer, text, length);
+    operation->length = length;
+    operation->capacity = length + 1;
+    OperationWatch(loop, operation);
+    return true;
+}
+
+/// @brief Runs a shell command and makes a fiber wait for everything it prints, then for its exit status.
+/// @return Whether the command could be started (errno tells why not).
+bool LoopCommand(Loop* loop, ObjFiber* fiber, const char* command) {
+    // Both ends are close-on-exec from the start, so commands other threads start never inherit them. The child's
+    // dup2 onto its stdout clears the flag on the copy it keeps.
+    int output[2];
+    if (pipe2(output, O_CLOEXEC) < 0)
+        return false;
+
+    pid_t process = fork();
+    if (process < 0) {
+        close(output[0]);
+        close(output[1]);
+        return false;
+    }
+
+    if (process == 0) {
+        dup2(output[1], STDOUT_FILENO);
+        close(output[0]);
+        close(output[1]);
+        execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+        _exit(127);
+    }
+
+    close(output[1]);
+    fcntl(output[0], F_SETFL, fcntl(output[0], F_GETFL) | O_NONBLOCK);
+
+    LoopOperation* operation = OperationNew(loop, fiber, "exec", LOOP_READ, output[0]);
+    operation->process = process;
+    OperationWatch(loop, operation);
+    return true;
+}
+
+/// @brief Takes the next finished operation, waiting for one if there is none yet.
+/// @return The operation (now the caller's, see LoopOperationFree), or NULL if nothing is pending.
+LoopOperation* LoopWait(Loop* loop) {
+    while (loop->finished == NULL) {
+        if (loop->pendingCount == 0)
+            return NULL;
+
+        struct epoll_event events[LOOP_EVENTS_MAX];
+        int count = epoll_wait(loop->epoll, events, LOOP_EVENTS_MAX, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to wait on the event loop.\n");
+            exit(1);
+        }
+
+        for (int i = 0; i < count; i++)
+            OperationProgress(loop, (LoopOperation*)events[i].data.ptr);
+    }
+
+    LoopOperation* operation = loop->finished;
+    loop->finished = operation->next;
+    if (loop->finished == NULL)
+        loop->finishedLast = NULL;
+    operation->next = NULL;
+    return operation;
+}
+
+void LoopOperationFree(LoopOperation* operation) {
+    free(operation->buffer);
+    free(operation);
+}
+
+#endif
@@ -3,10 +3,14 @@
 #include <string.h>
 #include <stdbool.h>
 #include <locale.h>
+#include <time.h>
 #include "Common.h"
 #include "Chunk.h"
 #include "Debug.h"
+#include "Scanner.h"
 #include "VM.h"
+#include "JIT.h"
+#include "Trace.h"
 
 static bool hasUnclosed(const char* src, size_t len) {
     int parenthesis = 0, braces = 0, squares = 0;
@@ -25,7 +29,7 @@ static bool hasUnclosed(const char* src, size_t len) {
     return parenthesis > 0 || braces > 0 || squares > 0;
 }
 
-static void Repl() {
+static void Repl(VM* interpreter) {
     char *source = NULL;
     size_t capacity = 0;
     size_t length = 0;
@@ -45,7 +49,7 @@ static void Repl() {
 
         if (isBlank && length > 0 && !hasUnclosed(source, length)) {
             source[length] = '\0';
-            InterpretResult result = Interpret(source);
+            InterpretResult result = Interpret(interpreter, source);
             length = 0;
             firstLine = true;
             continue;
@@ -65,7 +69,7 @@ static void Repl() {
 
         if (!hasUnclosed(source, length)) {
             source[length] = '\0';
-            InterpretResult result = Interpret(source);
+            InterpretResult result = Interpret(interpreter, source);
             length = 0;
             firstLine = true;
             continue;
@@ -77,52 +81,89 @@ static void Repl() {
     free(source);
 }
 
-static char* ReadFile(const char* path) {
-    FILE* sourceFile = fopen(path, "rb");
-    if (!sourceFile) {
+static MJ_Source* OpenFile(const char* path) {
+    MJ_Source* source = MJ_SourceOpen(path);
+    if (!source) {
         fprintf(stderr, "[ERROR]: Could not open file \"%s\".\n", path);
         exit(74);
     }
-    fseek(sourceFile, 0L, SEEK_END);
-    size_t fileSize = ftell(sourceFile);
-    rewind(sourceFile);
-    char* dataBuffer = (char*)malloc(fileSize + 1);
-    if (!dataBuffer) {
-        fprintf(stderr, "[ERROR]: Not enough memory to read \"%s\".", path);
-        exit(74);
-    }
-    size_t bytesRead = fread(dataBuffer, sizeof(char), fileSize, sourceFile);
-    if (bytesRead == 0 && fileSize > 0) {
-        fprintf(stderr, "[ERROR]: Failed to read file \"%s\".", path);
-        exit(74);
-    }
-    dataBuffer[bytesRead] = '\0';
-    fclose(sourceFile);
-    return dataBuffer;
+    return source;
 }
 
-static void RunFile(const char* path) {
-    char* source = ReadFile(path);
-    InterpretResult result = Interpret(source);
-    free(source);
+static void RunFile(VM* interpreter, const char* path) {
+    MJ_Source* source = OpenFile(path);
+    InterpretResult result = InterpretFile(interpreter, path, source);
+    MJ_SourceRelease(source);
     if (result.status == INTERPRET_COMPILE_ERROR) exit(65);
     if (result.status == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+/// @brief [INTERNAL] Scans a file without compiling or running it and reports how fast that went.
+static void BenchmarkScanner(const char* path) {
+    MJ_Source* source = OpenFile(path);
+    size_t length = (size_t)source->length;
+
+    clock_t start = clock();
+    ScannerInit(source->text, source->length);
+
+    long tokens = 0;
+    for (Token token = ScannerScanToken(); token.type != TOKEN_EOF; token = ScannerScanToken())
+        tokens++;
+
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%ld tokens, %zu bytes in %.3f s (%.1f MB/s)\n", tokens, length, seconds,
+           seconds > 0 ? length / seconds / (1024 * 1024) : 0.0);
+    MJ_SourceRelease(source);
+}
+
 int main(int argc, const char* argv[]) {
     //setlocale(LC_ALL, "");
 
-    VMInit();
+    VM* interpreter = VMNew();
+
+    // Options come first: --max-depth <frames> changes how deep calls may nest, and --jit <on|off|eager> whether
+    // code gets translated to native code, eager translating every function and loop the first time it runs.
+    int argument = 1;
+    while (argc >= argument + 2) {
+        const char* value = argv[argument + 1];
+        if (strcmp(argv[argument], "--max-depth") == 0) {
+            int maxFrames = atoi(value);
+            if (maxFrames <= 0) {
+                fprintf(stderr, "[ERROR]: Invalid maximum depth \"%s\".\n", value);
+                exit(64);
+            }
+
+            VMSetMaxFrames(interpreter, maxFrames);
+        } else if (strcmp(argv[argument], "--jit") == 0) {
+            if (strcmp(value, "on") == 0) {
+                VMSetJit(interpreter, JIT_THRESHOLD, TRACE_THRESHOLD);
+            } else if (strcmp(value, "off") == 0) {
+                VMSetJit(interpreter, 0, 0);
+            } else if (strcmp(value, "eager") == 0) {
+                VMSetJit(interpreter, 1, 1);
+            } else {
+                fprintf(stderr, "[ERROR]: Invalid JIT mode \"%s\" (on, off or eager).\n", value);
+                exit(64);
+            }
+        } else {
+            break;
+        }
+
+        argument += 2;
+    }
 
-    if (argc == 1) {
-        Repl();
-    } else if (argc == 2) {
-        RunFile(argv[1]);
+    if (argc == argument) {
+        Repl(interpreter);
+    } else if (argc == argument + 1) {
+        RunFile(interpreter, argv[argument]);
+    } else if (argc == argument + 2 && strcmp(argv[argument], "--scan") == 0) {
+        // --scan <path> only runs the scanner over the file, as a benchmark.
+        BenchmarkScanner(argv[argument + 1]);
     } else {
-        fprintf(stderr, COLOR_MAGENTA "Usage" COLOR_RESET ": momiji [path]\n");
+        fprintf(stderr, COLOR_MAGENTA "Usage" COLOR_RESET ": momiji [--max-depth frames] [--jit on|off|eager] [path | --scan path]\n");
         exit(64);
     }
 
-    VMFree();
+    VMFree(interpreter);
     return 0;
 }
@@ -1,9 +1,16 @@
+#define _DEFAULT_SOURCE // For recursive mutexes and sysconf.
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "Compiler.h"
 #include "Memory.h"
 #include "VM.h"
+#include "JIT.h"
+#include "Trace.h"
+#include "Thread.h"
+#include "Loop.h"
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
@@ -12,13 +19,71 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+#if defined(ENABLE_PARALLEL_GC) && defined(ATOMIC_EXCHANGE) && (defined(__unix__) || defined(__APPLE__))
+    #define PARALLEL_MARK_AVAILABLE
+    #include <pthread.h>
+    #include <sched.h>
+    #include <unistd.h>
+#endif
+
+// Heaps of at least this many bytes are marked on several threads: below it, starting them costs more than the
+// marking they would share.
+#ifndef GC_PARALLEL_MIN
+    #define GC_PARALLEL_MIN (8 * 1024 * 1024)
+#endif
+
+#define GC_MARK_THREADS_MAX 16  // Threads marking at once, the collecting one included.
+#define GC_OFFER_MIN 64         // Gray objects a mark thread needs before giving half of them to one that ran out.
+
+/// @brief Lets several threads allocate objects at once (while the compiler runs some of its work in parallel).
+/// Until the heap stops being shared, allocations only get counted and nothing is collected, since the roots of
+/// the other threads aren't known.
+/// @param shared Whether the heap is shared from now on.
+void HeapShare(bool shared) {
+#ifdef PARALLEL_COMPILE_AVAILABLE
+    if (shared && !vm->heapMutexReady) {
+        // Recursive, since interning a string allocates an object under the same lock.
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&vm->heapMutex, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        vm->heapMutexReady = true;
+    }
+#endif
+
+    vm->heapShared = shared;
+}
+
+/// @brief Guards the VM's shared structures (object list, string table, stack) while the heap is shared.
+void HeapLock() {
+#ifdef PARALLEL_COMPILE_AVAILABLE
+    if (vm->heapShared)
+        pthread_mutex_lock(&vm->heapMutex);
+#endif
+}
+
+void HeapUnlock() {
+#ifdef PARALLEL_COMPILE_AVAILABLE
+    if (vm->heapShared)
+        pthread_mutex_unlock(&vm->heapMutex);
+#endif
+}
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.allocatedBytes += newSize - oldSize;
-    if (newSize > oldSize) {
+    if (vm->heapShared) {
+        HeapLock();
+        vm->allocatedBytes += newSize - oldSize;
+        HeapUnlock();
+    } else {
+        vm->allocatedBytes += newSize - oldSize;
+    }
+
+    if (newSize > oldSize && !vm->heapShared) {
 #ifdef DEBUG_STRESS_GC
         CollectGarbage();
 #endif
-        if (vm.allocatedBytes >= vm.nextCollection)
+        if (vm->allocatedBytes >= vm->nextCollection)
             CollectGarbage();
     }
 
@@ -38,10 +103,222 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return Result;
 }
 
+// Blocks are at least this big, so most compilations fit in one or two of them.
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+void ArenaInit(Arena* arena) {
+    arena->blocks = NULL;
+}
+
+/// @brief Hands out size bytes (16 byte aligned) from the arena, starting a new block when the current one is full.
+void* ArenaAllocate(Arena* arena, size_t size) {
+    size = ARENA_ALIGN(size);
+
+    ArenaBlock* block = arena->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        size_t blockSize = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + blockSize);
+        if (block == NULL)
+            exit(1);
+
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = blockSize;
+        arena->blocks = block;
+    }
+
+    void* result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+/// @brief Resizes an arena allocation. The last allocation grows in place when its block has room, anything else
+/// is copied (the old bytes are only given back with the rest of the arena).
+void* ArenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize) {
+    ArenaBlock* block = arena->blocks;
+    if (pointer != NULL && block != NULL && (uint8_t*)pointer + ARENA_ALIGN(oldSize) == block->data + block->used &&
+        (uint8_t*)pointer + ARENA_ALIGN(newSize) <= block->data + block->size) {
+        block->used += ARENA_ALIGN(newSize) - ARENA_ALIGN(oldSize);
+        return pointer;
+    }
+
+    void* result = ArenaAllocate(arena, newSize);
+    if (pointer != NULL)
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    return result;
+}
+
+/// @brief Gives every block back at once, leaving the arena empty (and ready for reuse).
+void ArenaFree(Arena* arena) {
+    ArenaBlock* block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
+
+#ifdef PARALLEL_MARK_AVAILABLE
+typedef struct MarkPool MarkPool;
+
+// A mark thread's gray objects. Those in gray are its own; those in offered are up for grabs by the threads that
+// ran out of work.
+typedef struct {
+    Object** gray;
+    int grayCount;
+    int grayCapacity;
+    pthread_mutex_t lock;       // Guards offered.
+    Object** offered;
+    int offeredCount;
+    int offeredCapacity;
+    MarkPool* pool;
+    pthread_t handle;
+    bool started;
+} Marker;
+
+struct MarkPool {
+    VM* vm;
+    Marker* markers;
+    int count;
+    int idle;                   // Markers out of work. Once all of them are, marking is over.
+};
+
+// Marker of the calling thread while the heap is marked in parallel (NULL otherwise).
+static THREAD_LOCAL Marker* marker = NULL;
+
+/// @brief [INTERNAL] Adds an object to one of a marker's lists, growing it as needed.
+static void MarkerAppend(Object*** list, int* count, int* capacity, Object* object) {
+    if (*capacity < *count + 1) {
+        *capacity = GROW_CAPACITY(*capacity);
+        *list = (Object**)realloc(*list, sizeof(Object*) * *capacity);
+        if (*list == NULL)
+            exit(1);
+    }
+    (*list)[(*count)++] = object;
+}
+
+/// @brief [INTERNAL] Offers the older half of a marker's gray objects (the ones likelier to lead to much of the
+/// heap) to the threads that ran out.
+static void MarkerOffer(Marker* self) {
+    int half = self->grayCount / 2;
+
+    // Others read the count without the lock, to see whether there is anything worth taking it for.
+    pthread_mutex_lock(&self->lock);
+    int offeredCount = self->offeredCount;
+    for (int i = 0; i < half; i++)
+        MarkerAppend(&self->offered, &offeredCount, &self->offeredCapacity, self->gray[i]);
+    ATOMIC_STORE(self->offeredCount, offeredCount);
+    pthread_mutex_unlock(&self->lock);
+
+    memmove(self->gray, self->gray + half, sizeof(Object*) * (self->grayCount - half));
+    self->grayCount -= half;
+}
+
+/// @brief [INTERNAL] Takes everything one marker offers, starting with the calling one's own offer.
+/// @return Whether anything was taken.
+static bool MarkerSteal(Marker* self) {
+    MarkPool* pool = self->pool;
+    int index = (int)(self - pool->markers);
+
+    for (int i = 0; i < pool->count; i++) {
+        Marker* victim = &pool->markers[(index + i) % pool->count];
+        if (ATOMIC_LOAD(victim->offeredCount) == 0)
+            continue;
+
+        pthread_mutex_lock(&victim->lock);
+        for (int j = 0; j < victim->offeredCount; j++)
+            MarkerAppend(&self->gray, &self->grayCount, &self->grayCapacity, victim->offered[j]);
+        ATOMIC_STORE(victim->offeredCount, 0);
+        pthread_mutex_unlock(&victim->lock);
+
+        if (self->grayCount > 0)
+            return true;
+    }
+    return false;
+}
+
+/// @brief [INTERNAL] Whether any marker has work on offer.
+static bool MarkerOffering(MarkPool* pool) {
+    for (int i = 0; i < pool->count; i++) {
+        if (ATOMIC_LOAD(pool->markers[i].offeredCount) > 0)
+            return true;
+    }
+    return false;
+}
+
+static void BlackenObject(Object* object);
+
+/// @brief [INTERNAL] Blackens gray objects until no marker has any left.
+static void MarkerRun(Marker* self) {
+    MarkPool* pool = self->pool;
+    marker = self;
+
+    for (;;) {
+        while (self->grayCount > 0) {
+            BlackenObject(self->gray[--self->grayCount]);
+            if (self->grayCount >= GC_OFFER_MIN && ATOMIC_LOAD(pool->idle) > 0 &&
+                ATOMIC_LOAD(self->offeredCount) == 0)
+                MarkerOffer(self);
+        }
+
+        if (MarkerSteal(self))
+            continue;
+
+        // Out of work. A marker only offers while it isn't idle, and takes its own offer back before going idle,
+        // so once every marker is idle nothing is left anywhere. One about to steal stops being idle first.
+        ATOMIC_INCREMENT(pool->idle);
+        for (;;) {
+            if (ATOMIC_LOAD(pool->idle) == pool->count) {
+                marker = NULL;
+                return;
+            }
+
+            if (MarkerOffering(pool)) {
+                ATOMIC_DECREMENT(pool->idle);
+                if (MarkerSteal(self))
+                    break;
+                ATOMIC_INCREMENT(pool->idle);
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void* MarkerMain(void* argument) {
+    Marker* self = (Marker*)argument;
+    vm = self->pool->vm;
+    MarkerRun(self);
+    vm = NULL;
+    return NULL;
+}
+
+/// @brief [INTERNAL] How many threads should mark the heap: one unless it's big and there are several cores.
+static int MarkThreadCount() {
+    if (vm->allocatedBytes < GC_PARALLEL_MIN)
+        return 1;
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors < 1)
+        return 1;
+    return (processors > GC_MARK_THREADS_MAX) ? GC_MARK_THREADS_MAX : (int)processors;
+}
+#endif
+
 void MarkObject(Object* object) {
     if (object == NULL)
         return;
 
+#ifdef PARALLEL_MARK_AVAILABLE
+    // Several markers can reach the same object at once; only the one that sets its mark grays it.
+    if (marker != NULL) {
+        if (!ATOMIC_EXCHANGE(object->isMarked, true))
+            MarkerAppend(&marker->gray, &marker->grayCount, &marker->grayCapacity, object);
+        return;
+    }
+#endif
+
     if (object->isMarked)
         return;
 
@@ -53,22 +330,22 @@ void MarkObject(Object* object) {
 
     object->isMarked = true;
 
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Object**)realloc(vm.grayStack, sizeof(Object*) * vm.grayCapacity);
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Object**)realloc(vm->grayStack, sizeof(Object*) * vm->grayCapacity);
 
-        if (vm.grayStack == NULL && vm.safeguardStack != NULL) {
-            free(vm.safeguardStack);
-            vm.grayStack = (Object**)realloc(vm.grayStack, sizeof(Object*) * vm.grayCapacity);
+        if (vm->grayStack == NULL && vm->safeguardStack != NULL) {
+            free(vm->safeguardStack);
+            vm->grayStack = (Object**)realloc(vm->grayStack, sizeof(Object*) * vm->grayCapacity);
 
-            if (vm.grayStack == NULL)
+            if (vm->grayStack == NULL)
                 exit(1);
         }
-        else if (vm.grayStack == NULL)
+        else if (vm->grayStack == NULL)
             exit(1);
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    vm->grayStack[vm->grayCount++] = object;
 }
 
 void MarkValue(Value value) {
@@ -92,6 +369,12 @@ static void BlackenObject(Object* object) {
         case OBJ_CLOSURE: {
             ObjClosure* Closure = (ObjClosure*)object;
             MarkObject((Object*)Closure->function);
+
+            // A closure made on the stack only points at its own cells, or at upvalues of the closure running
+            // the frame that made it (which is alive for as long as it is).
+            if (Closure->onStack)
+                break;
+
             for (int i = 0; i < Closure->upvalueCount; i++) {
                 MarkObject((Object*)Closure->upvalues[i]);
             }
@@ -106,14 +389,17 @@ static void BlackenObject(Object* object) {
         }
 
         case OBJ_UPVALUE:
-            MarkValue(((ObjUpvalue*)object)->closed);
+            // An open upvalue may point into a fiber nothing else references any more.
+            MarkValue(*((ObjUpvalue*)object)->location);
             break;
         
         case OBJ_CLASS: {
             ObjClass* Class = (ObjClass*)object;
             MarkObject((Object*)Class->className);
+            MarkValue(Class->constructor);
             MarkArray(&Class->methodNames);
             TableMark(&Class->methods);
+            MarkArray(&Class->vtable);
             TableMark(&Class->defaultFields);
             break;
         }
@@ -123,6 +409,7 @@ static void BlackenObject(Object* object) {
             MarkObject((Object*)Instance->class);
             MarkArray(&Instance->fieldNames);
             TableMark(&Instance->fields);
+            TableMark(&Instance->boundMethods);
             break;
         }
 
@@ -136,19 +423,37 @@ static void BlackenObject(Object* object) {
         case OBJ_ARRAY: {
             ObjArray* Array = (ObjArray*)object;
             MarkArray(&Array->items);
+            break;
         }
 
         case OBJ_MAP: {
             ObjMap* Map = (ObjMap*)object;
             MarkArray(&Map->keys);
             TableMark(&Map->items);
+            break;
         }
 
         case OBJ_NATIVE:
-        case OBJ_STRING:
+            MarkObject((Object*)((ObjNative*)object)->name);
             break;
 
-        
+        case OBJ_FIBER: {
+            // The running fiber's stack is the VM's, which MarkRoots takes care of.
+            ObjFiber* fiber = (ObjFiber*)object;
+            for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++)
+                MarkValue(*slot);
+            for (int i = 0; i < fiber->frameCount; i++)
+                MarkObject((Object*)fiber->frames[i].closure);
+            for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+                MarkObject((Object*)upvalue);
+            MarkObject((Object*)fiber->caller);
+            break;
+        }
+
+        case OBJ_STRING:
+        case OBJ_THREAD:
+        case OBJ_CHANNEL:
+            break;
     }
 }
 
@@ -177,8 +482,7 @@ static void FreeObject(Object* object) {
 
         case OBJ_CLOSURE: {
             ObjClosure* Closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, Closure->upvalues, Closure->upvalueCount);
-            FREE(ObjClosure, object);
+            reallocate(object, Closure->onStack ? STACK_CLOSURE_SIZE(Closure->upvalueCount) : CLOSURE_SIZE(Closure->upvalueCount), 0);
             break;
         }
         
@@ -188,13 +492,22 @@ static void FreeObject(Object* object) {
         
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
+#ifdef JIT_AVAILABLE
+            JitFree(function->jit);
+            TraceFreeAll(function);
+#endif
             MJ_ChunkFree(&function->chunk);
             FREE(ObjFunction, object);
             break;
         }
 
         case OBJ_CLASS: {
-            FREE(OBJ_CLASS, object);
+            ObjClass* Class = (ObjClass*)object;
+            ValueArrayFree(&Class->methodNames);
+            TableFree(&Class->methods);
+            ValueArrayFree(&Class->vtable);
+            TableFree(&Class->defaultFields);
+            FREE(ObjClass, object);
             break;
         }
 
@@ -202,54 +515,145 @@ static void FreeObject(Object* object) {
             ObjInstance* Instance = (ObjInstance*)object;
             ValueArrayFree(&Instance->fieldNames);
             TableFree(&Instance->fields);
+            TableFree(&Instance->boundMethods);
             FREE(ObjInstance, object);
+            break;
         }
 
         case OBJ_BOUND_METHOD:
             FREE(ObjBoundMethod, object);
             break;
+
+        case OBJ_THREAD:
+#ifdef THREADS_AVAILABLE
+            WorkerRelease(((ObjThread*)object)->worker);
+#endif
+            FREE(ObjThread, object);
+            break;
+
+        case OBJ_CHANNEL:
+#ifdef THREADS_AVAILABLE
+            ChannelRelease(((ObjChannel*)object)->channel);
+#endif
+            FREE(ObjChannel, object);
+            break;
+
+        case OBJ_FIBER:
+            FiberFreeStack((ObjFiber*)object);
+            FREE(ObjFiber, object);
+            break;
     }
 }
 
 void FreeObjects() {
-    Object* object = vm.objects;
+    Object* object = vm->objects;
     while (object != NULL) {
         Object* next = object->next;
         FreeObject(object);
         object = next;
     }
 
-    free(vm.grayStack);
-    free(vm.safeguardStack);
+    free(vm->grayStack);
+    free(vm->safeguardStack);
 }
 
 static void MarkRoots() {
-    for (Value* slot = vm.Stack; slot < vm.stackTop; slot++) {
+    for (Value* slot = vm->Stack; slot < vm->stackTop; slot++) {
         MarkValue(*slot);
     }
 
-    for (int i = 0; i < vm.frameCount; i++) {
-        MarkObject((Object*)vm.frames[i].closure);
+    for (int i = 0; i < vm->frameCount; i++) {
+        MarkObject((Object*)vm->frames[i].closure);
     }
 
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
         MarkObject((Object*)upvalue);
     }
 
-    TableMark(&vm.globals); 
+    MarkObject((Object*)vm->fiber);
+#ifdef EVENT_LOOP_AVAILABLE
+    if (vm->loop != NULL)
+        LoopMark(vm->loop);
+#endif
+    TableMark(&vm->globals); 
+
+    for (int i = 0; i < vm->nativeCount; i++) {
+        MarkObject((Object*)vm->natives[i]);
+    }
+
     CompilerMarkRoots();
 }
 
 static void TraceReferences() {
-    while (vm.grayCount > 0) {
-        Object* object = vm.grayStack[--vm.grayCount];
+    while (vm->grayCount > 0) {
+        Object* object = vm->grayStack[--vm->grayCount];
         BlackenObject(object);
     }
 }
 
+#ifdef PARALLEL_MARK_AVAILABLE
+/// @brief [INTERNAL] Marks the heap on several threads. The roots are grayed on the collecting thread, and the
+/// others steal their share of them as they start. The mutator stays stopped throughout.
+/// @param threadCount Threads to mark on, the collecting one included.
+static void MarkParallel(int threadCount) {
+    MarkPool pool;
+    pool.vm = vm;
+    pool.markers = (Marker*)calloc((size_t)threadCount, sizeof(Marker));
+    pool.count = threadCount;
+    pool.idle = 0;
+    if (pool.markers == NULL)
+        exit(1);
+
+    for (int i = 0; i < threadCount; i++) {
+        pool.markers[i].pool = &pool;
+        pthread_mutex_init(&pool.markers[i].lock, NULL);
+    }
+
+    marker = &pool.markers[0];
+    MarkRoots();
+
+    // Threads that fail to start count as idle from the outset, and their share is done by the others.
+    for (int i = 1; i < threadCount; i++) {
+        pool.markers[i].started = pthread_create(&pool.markers[i].handle, NULL, MarkerMain, &pool.markers[i]) == 0;
+        if (!pool.markers[i].started)
+            ATOMIC_INCREMENT(pool.idle);
+    }
+
+    MarkerRun(&pool.markers[0]);
+
+    for (int i = 0; i < threadCount; i++) {
+        if (pool.markers[i].started)
+            pthread_join(pool.markers[i].handle, NULL);
+        pthread_mutex_destroy(&pool.markers[i].lock);
+        free(pool.markers[i].gray);
+        free(pool.markers[i].offered);
+    }
+    free(pool.markers);
+}
+#endif
+
+/// @brief [INTERNAL] Closes the open upvalues of fibers about to be freed, so closures that outlive a fiber keep
+/// the variables they captured from it (the upvalues marked what they point at, so those values are still there).
+static void SweepFibers() {
+    ObjFiber** link = &vm->fibers;
+    while (*link != NULL) {
+        ObjFiber* fiber = *link;
+        if (fiber->object.isMarked) {
+            link = &fiber->nextFiber;
+            continue;
+        }
+
+        for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+            upvalue->closed = *upvalue->location;
+            upvalue->location = &upvalue->closed;
+        }
+        *link = fiber->nextFiber;
+    }
+}
+
 static void Sweep() {
     Object* Previous = NULL;
-    Object* Current = vm.objects;
+    Object* Current = vm->objects;
 
     while (Current != NULL) {
         if (Current->isMarked) {
@@ -270,7 +674,7 @@ static void Sweep() {
             if (Previous != NULL)
                 Previous->next = Current;
             else    // There isn't, so the current element is now the beginning element in the linked list.i
-                vm.objects = Current;
+                vm->objects = Current;
 
             FreeObject(Unreached);
         }
@@ -280,18 +684,29 @@ static void Sweep() {
 void CollectGarbage() {
 #ifdef DEBUG_LOG_GC
     printf("-- [GC BEGIN] --\n");
-    size_t Before = vm.allocatedBytes;
+    size_t Before = vm->allocatedBytes;
 #endif
 
+#ifdef PARALLEL_MARK_AVAILABLE
+    int threadCount = MarkThreadCount();
+    if (threadCount > 1) {
+        MarkParallel(threadCount);
+    } else {
+        MarkRoots();
+        TraceReferences();
+    }
+#else
     MarkRoots();
     TraceReferences();
-    TableRemoveWhite(&vm.strings);
+#endif
+    TableRemoveWhite(&vm->strings);
+    SweepFibers();
     Sweep();
 
-    vm.nextCollection = vm.allocatedBytes * GC_HEAP_GROW_FACTOR;
+    vm->nextCollection = vm->allocatedBytes * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
     printf("-- [GC END] --\n");
-    printf("   > Collected %zu (from %zu to %zu). Next at %zu.\n", Before - vm.allocatedBytes, Before, vm.allocatedBytes, vm.nextCollection);
+    printf("   > Collected %zu (from %zu to %zu). Next at %zu.\n", Before - vm->allocatedBytes, Before, vm->allocatedBytes, vm->nextCollection);
 #endif
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "Memory.h"
@@ -13,8 +14,11 @@ static Object* ObjectAllocate(size_t size, ObjectType objectType) {
     Object* object = (Object*)reallocate(NULL, 0, size);
     object->type = objectType;
     object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+
+    HeapLock();
+    object->next = vm->objects;
+    vm->objects = object;
+    HeapUnlock();
 
 #ifdef DEBUG_LOG_GC
     printf("> %p allocate %zu for %d\n", (void*)object, size, objectType);
@@ -24,16 +28,30 @@ static Object* ObjectAllocate(size_t size, ObjectType objectType) {
 }
 
 ObjClosure* ClosureNew(ObjFunction* function) {
-    ObjUpvalue** Upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-    
+    ObjClosure* Closure = (ObjClosure*)ObjectAllocate(CLOSURE_SIZE(function->upvalueCount), OBJ_CLOSURE);
+    Closure->function = function;
+    Closure->upvalueCount = function->upvalueCount;
+    Closure->onStack = false;
+
     for (int i = 0; i < function->upvalueCount; i++) {
-        Upvalues[i] = NULL;
+        Closure->upvalues[i] = NULL;
     }
 
-    ObjClosure* Closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    return Closure;
+}
+
+/// @brief Allocates a closure that will never outlive the frame making it, along with the cells its upvalues
+/// point at (filled in by OP_CLOSURE_STACK), so capturing needs no ObjUpvalue objects.
+ObjClosure* StackClosureNew(ObjFunction* function) {
+    ObjClosure* Closure = (ObjClosure*)ObjectAllocate(STACK_CLOSURE_SIZE(function->upvalueCount), OBJ_CLOSURE);
     Closure->function = function;
-    Closure->upvalues = Upvalues;
     Closure->upvalueCount = function->upvalueCount;
+    Closure->onStack = true;
+
+    for (int i = 0; i < function->upvalueCount; i++) {
+        Closure->upvalues[i] = NULL;
+    }
+
     return Closure;
 }
 
@@ -41,14 +59,25 @@ ObjFunction* FunctionNew() {
     ObjFunction* newFunction = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     newFunction->arity = 0;
     newFunction->upvalueCount = 0;
+    newFunction->stackSize = 0;
     newFunction->name = NULL;
+    newFunction->callCount = 0;
+    newFunction->jit = NULL;
+    newFunction->traces = NULL;
+    newFunction->traceCount = 0;
+    newFunction->hidden = false;
     MJ_ChunkInit(&newFunction->chunk);
     return newFunction;
 }
 
-ObjNative* NativeNew(NativeFn function) {
+ObjNative* NativeNew(NativeFn function, ObjString* name, int arity, uint8_t flags) {
     ObjNative* newNative = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     newNative->function = function;
+    newNative->name = name;
+    newNative->arity = arity;
+    newNative->flags = flags;
+    newNative->shadowed = false;
+    newNative->intrinsic = OP_CALL_NATIVE;
     return newNative;
 }
 
@@ -57,10 +86,11 @@ static ObjString* StringAllocate(char* chars, int length, uint32_t hash) {
     String->length = length;
     String->chars = chars;
     String->hash = hash;
+    String->methodSlot = -1;
 
-    Push(OBJECT_VALUE(String));
-    TableSet(&vm.strings, String, NULL_VALUE);
-    Pop();
+    Push(vm, OBJECT_VALUE(String));
+    TableSet(&vm->strings, String, NULL_VALUE);
+    Pop(vm);
     
     return String;
 }
@@ -77,20 +107,27 @@ static uint32_t StringHash(const char* key, int length) {
 
 ObjString* StringTake(const char* chars, int length) {
     uint32_t hash = StringHash(chars, length);
-    ObjString* Interned = TableFindString(&vm.strings, chars, length, hash);
+    HeapLock();
+    ObjString* Interned = TableFindString(&vm->strings, chars, length, hash);
     if (Interned != NULL) {
+        HeapUnlock();
         FREE_ARRAY(char, chars, length + 1);
         return Interned;
     }
 
-    return StringAllocate(chars, length, hash);
+    ObjString* String = StringAllocate(chars, length, hash);
+    HeapUnlock();
+    return String;
 }
 
 ObjString* StringCopy(const char* chars, int length) {
     uint32_t hash = StringHash(chars, length);
-    ObjString* Interned = TableFindString(&vm.strings, chars, length, hash);
-    if (Interned != NULL)
+    HeapLock();
+    ObjString* Interned = TableFindString(&vm->strings, chars, length, hash);
+    if (Interned != NULL) {
+        HeapUnlock();
         return Interned;
+    }
 
     char* heapChars = ALLOCATE(char, length + 1);
 
@@ -98,13 +135,16 @@ ObjString* StringCopy(const char* chars, int length) {
     memcpy(heapChars, chars, length);
 
     heapChars[length] = '\0'; // Because we allocated length + 1, length is the last index.
-    return StringAllocate(heapChars, length, hash);
+    ObjString* String = StringAllocate(heapChars, length, hash);
+    HeapUnlock();
+    return String;
 }
 
 ObjUpvalue* UpvalueNew(Value* slot) {
     ObjUpvalue* Upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     Upvalue->location = slot;
     Upvalue->next = NULL;
+    Upvalue->previous = NULL;
     Upvalue->closed = NULL_VALUE;
     return Upvalue;
 }
@@ -127,6 +167,7 @@ ObjClass* ClassNew(ObjString* name) {
     Class->className = name;
     ValueArrayInit(&Class->methodNames);
     TableInit(&Class->methods);
+    ValueArrayInit(&Class->vtable);
     TableInit(&Class->defaultFields);
     Class->constructor = NULL_VALUE;
     return Class;
@@ -137,7 +178,13 @@ ObjInstance* InstanceNew(ObjClass* classObj) {
     Instance->class = classObj;
     ValueArrayInit(&Instance->fieldNames);
     TableInit(&Instance->fields);
+    TableInit(&Instance->boundMethods);
+
+    // Copying the default fields allocates, so the instance has to be reachable meanwhile.
+    Push(vm, OBJECT_VALUE(Instance));
     TableAddAll(&classObj->defaultFields, &Instance->fields);
+    Pop(vm);
+
     return Instance;
 }
 
@@ -148,6 +195,76 @@ ObjBoundMethod* BoundMethodNew(Value receiver, ObjClosure* method) {
     return bound;
 }
 
+/// @brief Wraps a spawned thread in an object, taking over the caller's reference to it.
+ObjThread* ThreadNew(Worker* worker) {
+    ObjThread* Thread = ALLOCATE_OBJ(ObjThread, OBJ_THREAD);
+    Thread->worker = worker;
+    return Thread;
+}
+
+/// @brief Wraps a channel in an object, taking over the caller's reference to it.
+ObjChannel* ChannelNew(Channel* channel) {
+    ObjChannel* channelObject = ALLOCATE_OBJ(ObjChannel, OBJ_CHANNEL);
+    channelObject->channel = channel;
+    return channelObject;
+}
+
+/// @brief Creates a fiber that calls function the first time it's resumed (passing it the value it was resumed
+/// with, if it takes one). Its stack starts out just big enough for that call.
+/// @param function The fiber's function, or NULL for the main fiber, which runs on the stack the VM already has.
+ObjFiber* FiberNew(ObjClosure* function) {
+    Value* stack = NULL;
+    ObjUpvalue** openSlots = NULL;
+    CallFrame* frames = NULL;
+    int stackCapacity = 0;
+
+    if (function != NULL) {
+        stackCapacity = function->function->stackSize + 1;
+        stack = (Value*)malloc(sizeof(Value) * stackCapacity);
+        openSlots = (ObjUpvalue**)calloc(stackCapacity, sizeof(ObjUpvalue*));
+        frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+        if (stack == NULL || openSlots == NULL || frames == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the stack.\n");
+            exit(1);
+        }
+        stack[0] = OBJECT_VALUE(function);
+    }
+
+    ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->frames = frames;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = (function == NULL) ? 0 : FRAMES_INITIAL;
+    fiber->stack = stack;
+    fiber->stackTop = (function == NULL) ? NULL : stack + 1;
+    fiber->stackCapacity = stackCapacity;
+    fiber->openUpvalues = NULL;
+    fiber->openSlots = openSlots;
+    fiber->caller = NULL;
+    fiber->state = (function == NULL) ? FIBER_RUNNING : FIBER_NEW;
+
+    fiber->nextFiber = vm->fibers;
+    vm->fibers = fiber;
+    vm->allocatedBytes += STACK_BYTES(fiber->stackCapacity) + FRAMES_BYTES(fiber->frameCapacity);
+    return fiber;
+}
+
+/// @brief Frees the stack and frames of a fiber that isn't running (one that is done, or about to be freed).
+void FiberFreeStack(ObjFiber* fiber) {
+    vm->allocatedBytes -= STACK_BYTES(fiber->stackCapacity) + FRAMES_BYTES(fiber->frameCapacity);
+    free(fiber->stack);
+    free(fiber->openSlots);
+    free(fiber->frames);
+
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackCapacity = 0;
+    fiber->openSlots = NULL;
+    fiber->openUpvalues = NULL;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+}
+
 static void FunctionPrint(ObjFunction* function) {
     if (function->name == NULL) {
         printf("<script>");
@@ -225,5 +342,17 @@ void ObjectPrint(Value value) {
         case OBJ_BOUND_METHOD:
             FunctionPrint(AS_BOUND_METHOD(value)->method->function);
             break;
+
+        case OBJ_THREAD:
+            printf("<thread>");
+            break;
+
+        case OBJ_CHANNEL:
+            printf("<channel>");
+            break;
+
+        case OBJ_FIBER:
+            printf("<fiber>");
+            break;
     }
 }
@@ -3,30 +3,96 @@
 
 #include "Common.h"
 #include "Scanner.h"
-#include "Utilities.h"
-#include "Memory.h"
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int line;
-    int previousLine;
-    char* source;
-} Scanner;
-
-Scanner scanner;
-bool inStringInterpolation = false;
+THREAD_LOCAL Scanner scanner;
+THREAD_LOCAL bool inStringInterpolation = false;
+
+// Character classes, so identifiers and numbers are scanned with one lookup per character instead of a chain of
+// range checks. Only ASCII letters, digits and '_' have a class, everything else (including '\0') has none.
+#define CHAR_ALPHA 0x1  // Letters and '_', which can start an identifier.
+#define CHAR_DIGIT 0x2
+
+#define A CHAR_ALPHA
+#define D CHAR_DIGIT
+static const uint8_t charClasses[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0,
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, A,
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0,
+};
+#undef A
+#undef D
+
+#define CHAR_IS(character, classes) (charClasses[(uint8_t)(character)] & (classes))
 
-void ScannerInit(const char* source) {
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+// Keywords are found with a perfect hash of an identifier's first two characters and its length: every keyword
+// lands in its own slot, so one comparison tells whether an identifier is that keyword. The multipliers were found
+// by trying small values until no two keywords collided, so they have to be searched for again when one is added.
+// "static" isn't one yet (no rule parses TOKEN_STATIC), so it can still name variables.
+#define KEYWORD_MIN 2
+#define KEYWORD_MAX 8
+#define KEYWORD_HASH(start, length) (((uint8_t)(start)[0] + (uint8_t)(start)[1] * 9 + (length) * 5) & 63)
+
+static const Keyword keywords[64] = {
+    [0]  = {"switch", 6, TOKEN_SWITCH},
+    [3]  = {"yield", 5, TOKEN_YIELD},
+    [5]  = {"else", 4, TOKEN_ELSE},
+    [8]  = {"class", 5, TOKEN_CLASS},
+    [9]  = {"if", 2, TOKEN_IF},
+    [10] = {"true", 4, TOKEN_TRUE},
+    [11] = {"print", 5, TOKEN_PRINT},
+    [14] = {"and", 3, TOKEN_AND},
+    [16] = {"after", 5, TOKEN_AFTER},
+    [17] = {"global", 6, TOKEN_GLOBAL},
+    [20] = {"default", 7, TOKEN_DEFAULT},
+    [21] = {"private", 7, TOKEN_PRIVATE},
+    [28] = {"for", 3, TOKEN_FOR},
+    [29] = {"return", 6, TOKEN_RETURN},
+    [31] = {"null", 4, TOKEN_NULL},
+    [32] = {"case", 4, TOKEN_CASE},
+    [35] = {"const", 5, TOKEN_CONST},
+    [40] = {"false", 5, TOKEN_FALSE},
+    [41] = {"super", 5, TOKEN_SUPER},
+    [43] = {"function", 8, TOKEN_FUNCTION},
+    [46] = {"var", 3, TOKEN_LOCAL},
+    [47] = {"maybe", 5, TOKEN_MAYBE},
+    [48] = {"this", 4, TOKEN_THIS},
+    [50] = {"continue", 8, TOKEN_CONTINUE},
+    [54] = {"as", 2, TOKEN_AS},
+    [56] = {"while", 5, TOKEN_WHILE},
+    [59] = {"or", 2, TOKEN_OR},
+    [61] = {"break", 5, TOKEN_BREAK},
+    [62] = {"is", 2, TOKEN_IS},
+};
+
+void ScannerInit(const char* source, int length) {
     scanner.start = source;
     scanner.current = source;
+    scanner.end = source + length;
     scanner.line = 1;
-    scanner.previousLine = 0;
-    scanner.source = NULL;
 }
 
+Scanner ScannerSave() {
+    return scanner;
+}
+
+void ScannerRestore(Scanner state) {
+    scanner = state;
+}
+
+// A '\0' still ends the source early, as it always has.
 static bool ScannerAtEnd() {
-    return (*scanner.current == '\0');
+    return scanner.current >= scanner.end || *scanner.current == '\0';
 }
 
 static Token TokenMake(TokenType type) {
@@ -68,11 +134,13 @@ static char ScannerMatch(char expected) {
 }
 
 static char ScannerPeek() {
+    if (ScannerAtEnd())
+        return '\0';
     return *scanner.current;
 }
 
 static char ScannerPeekNext() {
-    if (ScannerAtEnd())
+    if (ScannerAtEnd() || scanner.current + 1 >= scanner.end)
         return '\0';
     return scanner.current[1];
 }
@@ -128,163 +196,42 @@ static Token ScannerScanString() {
 
 static Token ScannerScanNumber() {
     //Checks if the current character is either a digit or a underscore separator.
-    while (IsDigit(ScannerPeek()))
+    while (CHAR_IS(ScannerPeek(), CHAR_DIGIT))
         ScannerAdvance();
 
-    if (ScannerPeek() == '.' && IsDigit(ScannerPeekNext())) {
+    if (ScannerPeek() == '.' && CHAR_IS(ScannerPeekNext(), CHAR_DIGIT)) {
         ScannerAdvance();
 
-        while (IsDigit(ScannerPeek()) || (ScannerPeek() == '_' && IsDigit(ScannerPeekNext())))
+        while (CHAR_IS(ScannerPeek(), CHAR_DIGIT) || (ScannerPeek() == '_' && CHAR_IS(ScannerPeekNext(), CHAR_DIGIT)))
             ScannerAdvance();
     }
 
     return TokenMake(TOKEN_NUMBER);
 }
 
-static TokenType CheckKeyword(int start, const char* rest, TokenType type) {
-    int restLength = (int)strlen(rest);
+/// @brief [INTERNAL] Looks an identifier up in the keyword table.
+/// @param start First character of the identifier.
+/// @param length Length of the identifier.
+/// @return The keyword's token type, or TOKEN_IDENTIFIER.
+static TokenType IdentifierType(const char* start, int length) {
+    if (length < KEYWORD_MIN || length > KEYWORD_MAX)
+        return TOKEN_IDENTIFIER;
 
-    if ((scanner.current - scanner.start == start + restLength) && memcmp(scanner.start + start, rest, restLength) == 0)
-        return type;
-    
-    return TOKEN_IDENTIFIER;
-}
-
-static TokenType IdentifierType() {
-    switch (scanner.start[0]) {
-        case 'a':
-            if (scanner.current - scanner.start > 1) {
-                TokenType possible = CheckKeyword(1, "s", TOKEN_AS);
-
-                if (possible != TOKEN_IDENTIFIER) {
-                    return possible;
-                }
-
-                switch(scanner.start[1]) {
-                    case 'n': return CheckKeyword(2, "d", TOKEN_AND);
-                    case 'f': return CheckKeyword(2, "ter", TOKEN_AFTER);
-                }
-            }
-        case 'b': return CheckKeyword(1, "reak", TOKEN_BREAK);
-        case 'c':
-            if (scanner.current - scanner.start > 1) {
-                switch(scanner.start[1]) {
-                    case 'l': return CheckKeyword(2, "ass", TOKEN_CLASS);
-                    case 'o': {
-                        TokenType possible;
-
-                        possible = CheckKeyword(2, "nst", TOKEN_CONST);
-          
-                        if (possible == TOKEN_IDENTIFIER) {
-                            possible = CheckKeyword(2, "ntinue", TOKEN_CONTINUE);
-                        }
-
-                        return possible;
-                    }
-                    case 'a': return CheckKeyword(2, "se", TOKEN_CASE);
-                }
-            }
-        case 'd': return CheckKeyword(1, "efault", TOKEN_DEFAULT);
-        case 'e': return CheckKeyword(1, "lse", TOKEN_ELSE);
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch(scanner.start[1]) {
-                    case 'a': return CheckKeyword(2, "lse", TOKEN_FALSE);
-                    case 'o': return CheckKeyword(2, "r", TOKEN_FOR);
-                    case 'u': return CheckKeyword(2, "nction", TOKEN_FUNCTION);
-                }
-            }
-        case 'g': return CheckKeyword(1, "lobal", TOKEN_GLOBAL);
-        case 'i': {
-            TokenType possible = CheckKeyword(1, "f", TOKEN_IF);
+    const Keyword* keyword = &keywords[KEYWORD_HASH(start, length)];
+    if (keyword->length == length && memcmp(start, keyword->name, length) == 0)
+        return keyword->type;
 
-            if (possible == TOKEN_IDENTIFIER) {
-                return CheckKeyword(1, "s", TOKEN_IS);
-            }
-
-            return possible;
-        }
-        case 'm': return CheckKeyword(1, "aybe", TOKEN_MAYBE);
-        case 'n': return CheckKeyword(1, "ull", TOKEN_NULL);
-        case 'o': return CheckKeyword(1, "r", TOKEN_OR);
-        case 'p': if (scanner.current - scanner.start > 1) {
-                switch(scanner.start[1]) {
-                    case 'r': {
-                        TokenType possible = CheckKeyword(2, "int", TOKEN_PRINT);
-
-                        if (possible == TOKEN_IDENTIFIER) {
-                            return CheckKeyword(2, "ivate", TOKEN_PRIVATE);
-                        }
-
-                        return possible;
-                    }
-                }
-            }//
-        case 'r': return CheckKeyword(1, "eturn", TOKEN_RETURN);
-        case 's': if (scanner.current - scanner.start > 1) {
-                switch(scanner.start[1]) {
-                    case 't': return CheckKeyword(1, "atic", TOKEN_STATIC);
-                    case 'w': return CheckKeyword(2, "itch", TOKEN_SWITCH);
-                    case 'u': return CheckKeyword(2, "per", TOKEN_SUPER);
-                }
-            }
-        case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch(scanner.start[1]) {
-                    case 'h': return CheckKeyword(2, "is", TOKEN_THIS);
-                    case 'r': return CheckKeyword(2, "ue", TOKEN_TRUE);
-                }
-            }
-        case 'v': return CheckKeyword(1, "ar", TOKEN_LOCAL);
-        case 'w': return CheckKeyword(1, "hile", TOKEN_WHILE);
-    }
     return TOKEN_IDENTIFIER;
 }
 
 static Token ScannerScanIdentifier() {
-    while(IsAlphanumeric(ScannerPeek()) || IsDigit(ScannerPeek()))
+    while (CHAR_IS(ScannerPeek(), CHAR_ALPHA | CHAR_DIGIT))
         ScannerAdvance();
 
-    return TokenMake(IdentifierType());
-}
-
-static int ScannerGetLineLength() {
-    char* p = &scanner.start[0];
-    int l = 0;
-    while (*p != '\0' && *p != '\n') {
-        l++;
-        p++;
-    }
-    return l;
-}
-
-static void ScannerSetSource() {
-    int length = ScannerGetLineLength();
-
-    if (length <= 0)
-        return;
-
-    if (scanner.source != NULL)
-        FREE(char, scanner.source);
-
-    scanner.source = ALLOCATE(char, length + 1);
-    memcpy(scanner.source, scanner.start, length);
-    scanner.source[length] = '\0';
-}
-
-char* ScannerGetSource() {
-    if (scanner.source == NULL)
-        ScannerSetSource();
-
-    return scanner.source;
+    return TokenMake(IdentifierType(scanner.start, (int)(scanner.current - scanner.start)));
 }
 
 Token ScannerScanToken() {
-    if (scanner.previousLine != scanner.line) {
-        ScannerSetSource();
-        scanner.previousLine = scanner.line;
-    }
-
     SkipWhitespace();
     scanner.start = scanner.current;
 
@@ -293,9 +240,9 @@ Token ScannerScanToken() {
 
     char currentChar = ScannerAdvance();
 
-    if (IsAlphanumeric(currentChar))
+    if (CHAR_IS(currentChar, CHAR_ALPHA))
         return ScannerScanIdentifier();
-    if (IsDigit(currentChar))
+    if (CHAR_IS(currentChar, CHAR_DIGIT))
         return ScannerScanNumber();
   
     switch (currentChar) {
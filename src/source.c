@@ -0,0 +1,188 @@
+#define _DEFAULT_SOURCE // For mmap, madvise and fdopen.
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Source.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define SOURCE_MAPPING_AVAILABLE
+#endif
+
+#ifdef SOURCE_MAPPING_AVAILABLE
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Sources aren't objects of any VM (a script can be opened before there is one, and outlive it), so they are
+// allocated with malloc rather than reallocate.
+
+/// @brief [INTERNAL] realloc that gives up on the process when memory runs out, like reallocate does.
+static void* SourceReallocate(void* pointer, size_t size) {
+    void* result = realloc(pointer, size);
+    if (result == NULL)
+        exit(1);
+    return result;
+}
+
+/// @brief [INTERNAL] Wraps text in a source with one reference.
+static MJ_Source* SourceAdopt(const char* text, int length, size_t mapped) {
+    MJ_Source* source = SourceReallocate(NULL, sizeof(MJ_Source));
+    source->text = text;
+    source->length = length;
+    source->references = 1;
+    source->mapped = mapped;
+    return source;
+}
+
+/// @brief Copies source code into a buffer that chunks compiled from it can share.
+/// @param text Source code.
+/// @return The source, with one reference (the caller's).
+MJ_Source* MJ_SourceNew(const char* text) {
+    int length = (int)strlen(text);
+    char* copy = SourceReallocate(NULL, (size_t)length + 1);
+    memcpy(copy, text, length + 1);
+    return SourceAdopt(copy, length, 0);
+}
+
+/// @brief [INTERNAL] Reads a stream to its end, for files that can't be mapped (pipes, other platforms...).
+/// @return The source, or NULL if reading failed.
+static MJ_Source* SourceRead(FILE* stream) {
+    char* text = NULL;
+    int capacity = 0;
+    int length = 0;
+
+    for (;;) {
+        if (capacity - length < 4096 + 1) {
+            if (capacity > INT_MAX / 2) {
+                free(text);
+                return NULL;
+            }
+
+            capacity = (capacity < 4096) ? 8192 : capacity * 2;
+            text = SourceReallocate(text, (size_t)capacity);
+        }
+
+        size_t bytesRead = fread(text + length, 1, (size_t)(capacity - length - 1), stream);
+        length += (int)bytesRead;
+        if (bytesRead == 0)
+            break;
+    }
+
+    if (ferror(stream)) {
+        free(text);
+        return NULL;
+    }
+
+    text = SourceReallocate(text, (size_t)length + 1);
+    text[length] = '\0';
+    return SourceAdopt(text, length, 0);
+}
+
+/// @brief Opens a script. Regular files are mapped instead of read, so a large script isn't copied into memory
+/// before compiling it, and the scanner only waits on the pages it has reached. The mapping is only meant to last
+/// until the script is compiled (see MJ_SourceUnmap).
+/// @param path Path of the script.
+/// @return The source, with one reference (the caller's), or NULL if the file couldn't be read.
+MJ_Source* MJ_SourceOpen(const char* path) {
+#ifdef SOURCE_MAPPING_AVAILABLE
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+        return NULL;
+
+    struct stat info;
+    if (fstat(file, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0 && info.st_size < INT_MAX) {
+        void* text = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (text != MAP_FAILED) {
+            close(file);
+            madvise(text, (size_t)info.st_size, MADV_SEQUENTIAL);
+            return SourceAdopt(text, (int)info.st_size, (size_t)info.st_size);
+        }
+    }
+
+    FILE* stream = fdopen(file, "rb");
+    if (stream == NULL) {
+        close(file);
+        return NULL;
+    }
+#else
+    FILE* stream = fopen(path, "rb");
+    if (stream == NULL)
+        return NULL;
+#endif
+
+    MJ_Source* source = SourceRead(stream);
+    fclose(stream);
+    return source;
+}
+
+/// @brief Copies a mapped script into memory of its own and drops the mapping. Once the script is compiled, only
+/// error messages read its text, and reading a mapping of a file that has since been truncated (an editor saving
+/// over it, or the script writing to it) kills the process instead of printing the error.
+/// @param source Source to copy, which nothing may be reading meanwhile (so before the script runs).
+void MJ_SourceUnmap(MJ_Source* source) {
+#ifdef SOURCE_MAPPING_AVAILABLE
+    if (source == NULL || source->mapped == 0)
+        return;
+
+    char* copy = SourceReallocate(NULL, (size_t)source->length + 1);
+    memcpy(copy, source->text, (size_t)source->length);
+    copy[source->length] = '\0';
+
+    munmap((void*)source->text, source->mapped);
+    source->text = copy;
+    source->mapped = 0;
+#endif
+}
+
+MJ_Source* MJ_SourceRetain(MJ_Source* source) {
+    if (source != NULL)
+        ATOMIC_INCREMENT(source->references);
+    return source;
+}
+
+void MJ_SourceRelease(MJ_Source* source) {
+    if (source == NULL || ATOMIC_DECREMENT(source->references) > 0)
+        return;
+
+#ifdef SOURCE_MAPPING_AVAILABLE
+    if (source->mapped > 0)
+        munmap((void*)source->text, source->mapped);
+    else
+#endif
+        free((char*)source->text);
+
+    free(source);
+}
+
+/// @brief Finds a line of source code, for error messages.
+/// @param source Source to look in (may be NULL).
+/// @param line Line number, counting from 1.
+/// @param length Set to the length of the line (0 if there is no such line).
+/// @return Start of the line, past its indentation. It isn't null-terminated.
+const char* MJ_SourceLine(MJ_Source* source, int line, int* length) {
+    *length = 0;
+    if (source == NULL)
+        return "";
+
+    const char* start = source->text;
+    const char* end = source->text + source->length;
+    for (int current = 1; current < line && start < end; start++) {
+        if (*start == '\n')
+            current++;
+    }
+
+    while (start < end && (*start == ' ' || *start == '\t'))
+        start++;
+
+    const char* stop = start;
+    while (stop < end && *stop != '\n' && *stop != '\r')
+        stop++;
+
+    *length = (int)(stop - start);
+    return start;
+}
@@ -0,0 +1,843 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Thread.h"
+#include "Array.h"
+#include "Map.h"
+#include "Memory.h"
+#include "Source.h"
+#include "VM.h"
+
+#ifdef THREADS_AVAILABLE
+
+#include <pthread.h>
+#include <unistd.h>
+
+// Message layout (integers in the machine's byte order, like the bytecode cache, since a message never leaves the
+// process that wrote it):
+//  value:      a tag, then whatever the tag needs (nothing for null).
+//  function:   name, arity, upvalueCount, stackSize, code, line table, source, constants.
+// Sources and channels are written as indices into the message's own lists, which hold a reference to each of
+// them for as long as the message exists. Natives are written as their index in vm->natives, which is the same
+// in every VM.
+
+typedef enum {
+    MESSAGE_NULL,
+    MESSAGE_BOOL,
+    MESSAGE_NUMBER,
+    MESSAGE_STRING,
+    MESSAGE_ARRAY,
+    MESSAGE_MAP,
+    MESSAGE_FUNCTION,
+    MESSAGE_CLOSURE,
+    MESSAGE_NATIVE,
+    MESSAGE_CHANNEL
+} MessageTag;
+
+struct Message {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    MJ_Source** sources;
+    int sourceCount;
+    int sourceCapacity;
+    Channel** channels;
+    int channelCount;
+    int channelCapacity;
+    struct Message* next;       // Next message in a channel's queue.
+};
+
+struct Channel {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       // Signalled whenever a message is queued.
+    Message* first;             // Oldest message, the one received next.
+    Message* last;
+    int references;             // Channel objects (of any VM) and messages holding on to it.
+};
+
+struct Worker {
+    pthread_t handle;
+    Message* input;             // Argument count, function, arguments and globals, read when the thread starts.
+    Message* output;            // The function's result, or NULL if it failed.
+    const char* error;          // Why it failed, unless the VM running it has already reported that.
+    int references;             // The thread object and the thread itself.
+    bool joined;
+    int jitThreshold;           // The spawning VM's (see VMSetJit), so the new VM runs code the same way.
+    int traceThreshold;
+};
+
+typedef struct {
+    Message* message;
+    size_t at;
+    ObjArray* roots;    // Every object read so far, so a collection started by the next allocation doesn't take it.
+} MessageReader;
+
+/// @brief [INTERNAL] realloc that gives up on the process when memory runs out, like reallocate does. Messages,
+/// channels and workers belong to no VM, so they don't come from any heap.
+static void* ThreadReallocate(void* pointer, size_t size) {
+    void* result = realloc(pointer, size);
+    if (result == NULL) {
+        fprintf(stderr, "Failed to allocate memory for a message.\n");
+        exit(1);
+    }
+    return result;
+}
+
+Message* MessageNew() {
+    Message* message = ThreadReallocate(NULL, sizeof(Message));
+    memset(message, 0, sizeof(Message));
+    return message;
+}
+
+void MessageFree(Message* message) {
+    if (message == NULL)
+        return;
+
+    for (int i = 0; i < message->sourceCount; i++)
+        MJ_SourceRelease(message->sources[i]);
+    for (int i = 0; i < message->channelCount; i++)
+        ChannelRelease(message->channels[i]);
+
+    free(message->sources);
+    free(message->channels);
+    free(message->bytes);
+    free(message);
+}
+
+static void WriteBytes(Message* message, const void* bytes, size_t count) {
+    if (message->capacity < message->count + count) {
+        size_t capacity = (message->capacity < 256) ? 256 : message->capacity;
+        while (capacity < message->count + count)
+            capacity *= 2;
+
+        message->bytes = ThreadReallocate(message->bytes, capacity);
+        message->capacity = capacity;
+    }
+
+    memcpy(message->bytes + message->count, bytes, count);
+    message->count += count;
+}
+
+static void WriteInt(Message* message, int32_t value) {
+    WriteBytes(message, &value, sizeof(value));
+}
+
+/// @brief [INTERNAL] Writes a string as its length and bytes, with a length of -1 for NULL.
+static void WriteString(Message* message, ObjString* string) {
+    WriteInt(message, (string == NULL) ? -1 : string->length);
+    if (string != NULL)
+        WriteBytes(message, string->chars, (size_t)string->length);
+}
+
+/// @brief [INTERNAL] Writes the index of a source in the message's list, adding it (and a reference) if needed.
+static void WriteSource(Message* message, MJ_Source* source) {
+    int index = -1;
+    for (int i = 0; i < message->sourceCount && source != NULL; i++) {
+        if (message->sources[i] == source)
+            index = i;
+    }
+
+    if (index == -1 && source != NULL) {
+        if (message->sourceCount == message->sourceCapacity) {
+            message->sourceCapacity = GROW_CAPACITY(message->sourceCapacity);
+            message->sources = ThreadReallocate(message->sources, sizeof(MJ_Source*) * message->sourceCapacity);
+        }
+
+        index = message->sourceCount;
+        message->sources[message->sourceCount++] = MJ_SourceRetain(source);
+    }
+
+    WriteInt(message, index);
+}
+
+/// @brief [INTERNAL] Writes the index of a channel in the message's list, adding it (and a reference) if needed.
+static void WriteChannel(Message* message, Channel* channel) {
+    int index = -1;
+    for (int i = 0; i < message->channelCount; i++) {
+        if (message->channels[i] == channel)
+            index = i;
+    }
+
+    if (index == -1) {
+        if (message->channelCount == message->channelCapacity) {
+            message->channelCapacity = GROW_CAPACITY(message->channelCapacity);
+            message->channels = ThreadReallocate(message->channels, sizeof(Channel*) * message->channelCapacity);
+        }
+
+        index = message->channelCount;
+        message->channels[message->channelCount++] = ChannelRetain(channel);
+    }
+
+    WriteInt(message, index);
+}
+
+static bool WriteValue(Message* message, Value value, int depth, const char** error);
+
+static bool WriteFunction(Message* message, ObjFunction* function, int depth, const char** error) {
+    WriteString(message, function->name);
+    WriteInt(message, function->arity);
+    WriteInt(message, function->upvalueCount);
+    WriteInt(message, function->stackSize);
+
+    MJ_Chunk* chunk = &function->chunk;
+    WriteInt(message, chunk->count);
+    WriteBytes(message, chunk->code, (size_t)chunk->count);
+
+    WriteInt(message, chunk->lineBytes);
+    WriteBytes(message, chunk->lines, (size_t)chunk->lineBytes);
+    WriteInt(message, chunk->lastOffset);
+    WriteInt(message, chunk->lastLine);
+    WriteSource(message, chunk->source);
+
+    WriteInt(message, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!WriteValue(message, chunk->constants.values[i], depth + 1, error))
+            return false;
+    }
+    return true;
+}
+
+static bool WriteValue(Message* message, Value value, int depth, const char** error) {
+    if (depth > MESSAGE_DEPTH_MAX) {
+        *error = "Value is nested too deeply to be sent to another thread (or contains itself).";
+        return false;
+    }
+
+    switch (value.type) {
+        case VALUE_NULL:
+            WriteInt(message, MESSAGE_NULL);
+            return true;
+        case VALUE_BOOL:
+            WriteInt(message, MESSAGE_BOOL);
+            WriteInt(message, AS_BOOL(value));
+            return true;
+        case VALUE_NUMBER: {
+            double number = AS_NUMBER(value);
+            WriteInt(message, MESSAGE_NUMBER);
+            WriteBytes(message, &number, sizeof(number));
+            return true;
+        }
+        case VALUE_OBJECT:
+            break;
+    }
+
+    switch (OBJECT_TYPE(value)) {
+        case OBJ_STRING:
+            WriteInt(message, MESSAGE_STRING);
+            WriteString(message, AS_STRING(value));
+            return true;
+
+        case OBJ_ARRAY: {
+            ValueArray* items = &AS_ARRAY(value)->items;
+            WriteInt(message, MESSAGE_ARRAY);
+            WriteInt(message, items->count);
+            for (int i = 0; i < items->count; i++) {
+                if (!WriteValue(message, items->values[i], depth + 1, error))
+                    return false;
+            }
+            return true;
+        }
+
+        case OBJ_MAP: {
+            ObjMap* map = AS_MAP(value);
+            WriteInt(message, MESSAGE_MAP);
+            WriteInt(message, map->keys.count);
+            for (int i = 0; i < map->keys.count; i++) {
+                ObjString* key = AS_STRING(map->keys.values[i]);
+                Value item = NULL_VALUE;
+                TableGet(&map->items, key, &item);
+
+                WriteString(message, key);
+                if (!WriteValue(message, item, depth + 1, error))
+                    return false;
+            }
+            return true;
+        }
+
+        case OBJ_FUNCTION:
+            WriteInt(message, MESSAGE_FUNCTION);
+            return WriteFunction(message, AS_FUNCTION(value), depth, error);
+
+        case OBJ_CLOSURE:
+            // The variables a closure captured live on the heap of the VM that made it.
+            if (AS_CLOSURE(value)->upvalueCount > 0) {
+                *error = "Only functions that capture no variables can be sent to another thread.";
+                return false;
+            }
+
+            WriteInt(message, MESSAGE_CLOSURE);
+            return WriteFunction(message, AS_CLOSURE(value)->function, depth, error);
+
+        case OBJ_NATIVE:
+            for (int i = 0; i < vm->nativeCount; i++) {
+                if (vm->natives[i] == AS_NATIVE(value)) {
+                    WriteInt(message, MESSAGE_NATIVE);
+                    WriteInt(message, i);
+                    return true;
+                }
+            }
+            break;
+
+        case OBJ_CHANNEL:
+            WriteInt(message, MESSAGE_CHANNEL);
+            WriteChannel(message, AS_CHANNEL(value)->channel);
+            return true;
+
+        default:
+            break;
+    }
+
+    *error = "Classes, instances, methods, threads and fibers can't be sent to another thread.";
+    return false;
+}
+
+/// @brief Copies a value into a message. Whatever it refers to is copied along, so the message doesn't depend
+/// on the VM's heap afterwards.
+/// @param instance VM the value belongs to.
+/// @param error Set to the reason when the value can't be sent.
+/// @return Whether it was written. If it wasn't, the message is left as it was.
+bool MessageWrite(VM* instance, Message* message, Value value, const char** error) {
+    size_t count = message->count;
+    int sourceCount = message->sourceCount;
+    int channelCount = message->channelCount;
+
+    VM* previous = vm;
+    vm = instance;
+    bool written = WriteValue(message, value, 0, error);
+    vm = previous;
+    if (written)
+        return true;
+
+    message->count = count;
+    for (int i = sourceCount; i < message->sourceCount; i++)
+        MJ_SourceRelease(message->sources[i]);
+    for (int i = channelCount; i < message->channelCount; i++)
+        ChannelRelease(message->channels[i]);
+    message->sourceCount = sourceCount;
+    message->channelCount = channelCount;
+    return false;
+}
+
+static void ReadBytes(MessageReader* reader, void* bytes, size_t count) {
+    memcpy(bytes, reader->message->bytes + reader->at, count);
+    reader->at += count;
+}
+
+static int32_t ReadInt(MessageReader* reader) {
+    int32_t value;
+    ReadBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+/// @brief [INTERNAL] Keeps an object that was just read alive until the whole message has been read.
+static Value Root(MessageReader* reader, Value value) {
+    MJ_ArrayAdd(reader->roots, value);
+    return value;
+}
+
+/// @brief [INTERNAL] Reads a string written by WriteString into the current VM.
+/// @return The string, or NULL.
+static ObjString* ReadString(MessageReader* reader) {
+    int length = ReadInt(reader);
+    if (length == -1)
+        return NULL;
+
+    ObjString* string = StringCopy((const char*)reader->message->bytes + reader->at, length);
+    reader->at += (size_t)length;
+    Root(reader, OBJECT_VALUE(string));
+    return string;
+}
+
+static Value ReadValue(MessageReader* reader);
+
+static ObjFunction* ReadFunction(MessageReader* reader) {
+    ObjFunction* function = FunctionNew();
+    Root(reader, OBJECT_VALUE(function));
+
+    function->name = ReadString(reader);
+    function->arity = ReadInt(reader);
+    function->upvalueCount = ReadInt(reader);
+    function->stackSize = ReadInt(reader);
+
+    MJ_Chunk* chunk = &function->chunk;
+    int count = ReadInt(reader);
+    chunk->code = ALLOCATE(uint8_t, count);
+    chunk->capacity = count;
+    chunk->count = count;
+    ReadBytes(reader, chunk->code, (size_t)count);
+
+    int lineBytes = ReadInt(reader);
+    chunk->lines = ALLOCATE(uint8_t, lineBytes);
+    chunk->lineCapacity = lineBytes;
+    chunk->lineBytes = lineBytes;
+    ReadBytes(reader, chunk->lines, (size_t)lineBytes);
+    chunk->lastOffset = ReadInt(reader);
+    chunk->lastLine = ReadInt(reader);
+
+    int source = ReadInt(reader);
+    chunk->source = (source == -1) ? NULL : MJ_SourceRetain(reader->message->sources[source]);
+
+    int constantCount = ReadInt(reader);
+    for (int i = 0; i < constantCount; i++)
+        MJ_ChunkAddConstant(chunk, ReadValue(reader));
+
+    return function;
+}
+
+static Value ReadValue(MessageReader* reader) {
+    switch (ReadInt(reader)) {
+        case MESSAGE_BOOL:
+            return BOOL_VALUE(ReadInt(reader) != 0);
+
+        case MESSAGE_NUMBER: {
+            double number;
+            ReadBytes(reader, &number, sizeof(number));
+            return NUMBER_VALUE(number);
+        }
+
+        case MESSAGE_STRING:
+            return OBJECT_VALUE(ReadString(reader));
+
+        case MESSAGE_ARRAY: {
+            ObjArray* array = ArrayNew();
+            Root(reader, OBJECT_VALUE(array));
+
+            int count = ReadInt(reader);
+            for (int i = 0; i < count; i++)
+                ValueArrayWrite(&array->items, ReadValue(reader));
+            return OBJECT_VALUE(array);
+        }
+
+        case MESSAGE_MAP: {
+            ObjMap* map = MapNew();
+            Root(reader, OBJECT_VALUE(map));
+
+            int count = ReadInt(reader);
+            for (int i = 0; i < count; i++) {
+                ObjString* key = ReadString(reader);
+                MapSet(map, OBJECT_VALUE(key), ReadValue(reader));
+            }
+            return OBJECT_VALUE(map);
+        }
+
+        case MESSAGE_FUNCTION:
+            return OBJECT_VALUE(ReadFunction(reader));
+
+        case MESSAGE_CLOSURE: {
+            ObjFunction* function = ReadFunction(reader);
+            return Root(reader, OBJECT_VALUE(ClosureNew(function)));
+        }
+
+        case MESSAGE_NATIVE:
+            return OBJECT_VALUE(vm->natives[ReadInt(reader)]);
+
+        case MESSAGE_CHANNEL: {
+            Channel* channel = reader->message->channels[ReadInt(reader)];
+            return Root(reader, OBJECT_VALUE(ChannelNew(ChannelRetain(channel))));
+        }
+
+        default:
+            return NULL_VALUE;
+    }
+}
+
+/// @brief Reads copies of every value in a message into a VM.
+/// @param instance VM to read them into.
+/// @return A new array of the values, in the order they were written. It is left on top of the VM's stack so it
+/// isn't collected; the caller pops it when done with it.
+ObjArray* MessageRead(VM* instance, Message* message) {
+    VM* previous = vm;
+    vm = instance;
+
+    ObjArray* values = ArrayNew();
+    Push(instance, OBJECT_VALUE(values));
+    MessageReader reader = {message, 0, ArrayNew()};
+    Push(instance, OBJECT_VALUE(reader.roots));
+
+    while (reader.at < message->count)
+        MJ_ArrayAdd(values, ReadValue(&reader));
+
+    Pop(instance);
+    vm = previous;
+    return values;
+}
+
+/// @brief [INTERNAL] Drops a reference to a worker, freeing it with the last one.
+static void WorkerDrop(Worker* worker) {
+    if (ATOMIC_DECREMENT(worker->references) > 0)
+        return;
+
+    MessageFree(worker->input);
+    MessageFree(worker->output);
+    free(worker);
+}
+
+/// @brief [INTERNAL] Writes every global of the current VM that can be sent, as name and value pairs. Globals that
+/// can't (classes, say) are left out rather than failing the whole message.
+static void WriteGlobals(Message* message) {
+    for (int i = 0; i < vm->globals.capacity; i++) {
+        Entry* entry = &vm->globals.entries[i];
+        if (entry->Key == NULL)
+            continue;
+
+        const char* ignored;
+        size_t count = message->count;
+        if (MessageWrite(vm, message, OBJECT_VALUE(entry->Key), &ignored) &&
+            !MessageWrite(vm, message, entry->value, &ignored))
+            message->count = count;
+    }
+}
+
+/// @brief [INTERNAL] Sets the globals written by WriteGlobals, which were read into values starting at from.
+static void ReadGlobals(VM* instance, ObjArray* values, int from) {
+    Value* items = values->items.values;
+    for (int i = from; i + 1 < values->items.count; i += 2)
+        VMSetGlobal(instance, AS_STRING(items[i]), items[i + 1]);
+}
+
+/// @brief [INTERNAL] Body of a spawned thread: sets up a VM of its own from the worker's input, runs the function
+/// on it, and leaves a copy of the result for whoever joins the thread.
+static void* WorkerMain(void* argument) {
+    Worker* worker = (Worker*)argument;
+    VM* instance = VMNew();
+    VMSetJit(instance, worker->jitThreshold, worker->traceThreshold);
+
+    ObjArray* values = MessageRead(instance, worker->input);
+    MessageFree(worker->input);
+    worker->input = NULL;
+
+    int argumentCount = (int)AS_NUMBER(values->items.values[0]);
+    ReadGlobals(instance, values, argumentCount + 2);
+
+    // The function and its arguments go on the stack by themselves, since that is all the room a call is sure
+    // to have there.
+    Pop(instance);
+    for (int i = 1; i <= argumentCount + 1; i++)
+        Push(instance, values->items.values[i]);
+
+    InterpretResult result = InterpretCall(instance, argumentCount);
+    if (result.status == INTERPRET_OK) {
+        Message* output = MessageNew();
+        if (MessageWrite(instance, output, result.value, &worker->error))
+            worker->output = output;
+        else
+            MessageFree(output);
+    }
+
+    VMFree(instance);
+    WorkerDrop(worker);
+    return NULL;
+}
+
+/// @brief Starts a function on a new thread, with a VM of its own. The VM gets copies of the function, its
+/// arguments and every global of the current VM that can be sent (named functions are globals, so the functions
+/// it calls come along); from then on the two VMs' globals are separate.
+/// @param argumentCount Number of values in arguments (the function, then its arguments).
+/// @param arguments The function and its arguments.
+/// @param error Set to the reason if the thread couldn't be started.
+/// @return The worker, with one reference (the caller's), or NULL.
+Worker* WorkerSpawn(int argumentCount, Value* arguments, const char** error) {
+    Message* input = MessageNew();
+    MessageWrite(vm, input, NUMBER_VALUE(argumentCount - 1), error);
+    for (int i = 0; i < argumentCount; i++) {
+        if (!MessageWrite(vm, input, arguments[i], error)) {
+            MessageFree(input);
+            return NULL;
+        }
+    }
+
+    WriteGlobals(input);
+
+    Worker* worker = ThreadReallocate(NULL, sizeof(Worker));
+    worker->input = input;
+    worker->output = NULL;
+    worker->error = NULL;
+    worker->references = 2;
+    worker->joined = false;
+    worker->jitThreshold = vm->jitThreshold;
+    worker->traceThreshold = vm->traceThreshold;
+
+    if (pthread_create(&worker->handle, NULL, WorkerMain, worker) != 0) {
+        MessageFree(input);
+        free(worker);
+        *error = "Failed to start a thread.";
+        return NULL;
+    }
+
+    return worker;
+}
+
+/// @brief Waits for a spawned thread to finish (only the first time; after that its result is just there).
+/// @param error Set to the reason if the function failed.
+/// @return The message holding the function's result, which stays the worker's, or NULL.
+Message* WorkerJoin(Worker* worker, const char** error) {
+    if (!worker->joined) {
+        pthread_join(worker->handle, NULL);
+        worker->joined = true;
+    }
+
+    if (worker->output == NULL)
+        *error = (worker->error != NULL) ? worker->error : "The spawned function failed.";
+    return worker->output;
+}
+
+/// @brief Drops the thread object's reference to a worker. A thread nobody joined is detached, and cleans up
+/// after itself once it's done.
+void WorkerRelease(Worker* worker) {
+    if (!worker->joined)
+        pthread_detach(worker->handle);
+    WorkerDrop(worker);
+}
+
+/// @brief Creates a channel: a queue of messages that any number of threads can send to and receive from.
+/// @return The channel, with one reference (the caller's).
+Channel* ChannelOpen() {
+    Channel* channel = ThreadReallocate(NULL, sizeof(Channel));
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->ready, NULL);
+    channel->first = NULL;
+    channel->last = NULL;
+    channel->references = 1;
+    return channel;
+}
+
+Channel* ChannelRetain(Channel* channel) {
+    ATOMIC_INCREMENT(channel->references);
+    return channel;
+}
+
+/// @brief Drops a reference to a channel. With the last one, messages nobody received are freed along with it.
+/// (A channel that was sent through itself keeps itself alive, like any other reference cycle would.)
+void ChannelRelease(Channel* channel) {
+    if (ATOMIC_DECREMENT(channel->references) > 0)
+        return;
+
+    Message* message = channel->first;
+    while (message != NULL) {
+        Message* next = message->next;
+        MessageFree(message);
+        message = next;
+    }
+
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->ready);
+    free(channel);
+}
+
+/// @brief Queues a message on a channel, which takes it over. Sending never waits.
+void ChannelSend(Channel* channel, Message* message) {
+    message->next = NULL;
+
+    pthread_mutex_lock(&channel->lock);
+    if (channel->last == NULL)
+        channel->first = message;
+    else
+        channel->last->next = message;
+    channel->last = message;
+    pthread_cond_signal(&channel->ready);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+/// @brief Takes the oldest message off a channel, waiting for one to be sent if there is none.
+/// @return The message, which the caller has to free.
+Message* ChannelReceive(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    while (channel->first == NULL)
+        pthread_cond_wait(&channel->ready, &channel->lock);
+
+    Message* message = channel->first;
+    channel->first = message->next;
+    if (channel->first == NULL)
+        channel->last = NULL;
+    pthread_mutex_unlock(&channel->lock);
+    return message;
+}
+
+// parallelMap splits an array into chunks, each written to a message of its own, and maps them on a pool of
+// threads that each have a VM (set up like a spawned function's). Every thread starts with an even share of the
+// chunks and takes them from the front of it; once its share is gone it steals from the back of another's, so
+// elements that take longer than others don't leave cores idle.
+
+typedef struct {
+    pthread_mutex_t lock;
+    int next;                   // Chunk the share's owner takes next.
+    int end;                    // One past the share's last chunk (thieves take the one below it).
+} PoolShare;
+
+typedef struct {
+    Message* setup;             // The function, then the globals (name, value...).
+    Message** inputs;           // Each chunk's elements.
+    Message** outputs;          // Each chunk's results, once it's mapped.
+    int chunkCount;
+    PoolShare* shares;          // One per thread.
+    int threadCount;
+    int failed;                 // Calls that failed: once there is one, the other threads stop taking chunks.
+    const char* error;          // Why, unless the VM that failed has already reported it.
+    int jitThreshold;           // The mapping VM's (see VMSetJit).
+    int traceThreshold;
+} Pool;
+
+typedef struct {
+    Pool* pool;
+    int index;
+    pthread_t handle;
+} PoolThread;
+
+/// @brief [INTERNAL] Takes the next chunk for a thread: from its own share, or else stolen from another's.
+/// @return The chunk, or -1 once there are none left (or a call failed).
+static int PoolTake(Pool* pool, int index) {
+    for (int i = 0; i < pool->threadCount && ATOMIC_LOAD(pool->failed) == 0; i++) {
+        PoolShare* share = &pool->shares[(index + i) % pool->threadCount];
+        int chunk = -1;
+
+        pthread_mutex_lock(&share->lock);
+        if (share->next < share->end)
+            chunk = (i == 0) ? share->next++ : --share->end;
+        pthread_mutex_unlock(&share->lock);
+
+        if (chunk >= 0)
+            return chunk;
+    }
+    return -1;
+}
+
+/// @brief [INTERNAL] Body of a pool thread: maps chunks until there are none left.
+static void* PoolMain(void* argument) {
+    PoolThread* thread = (PoolThread*)argument;
+    Pool* pool = thread->pool;
+    VM* instance = VMNew();
+    VMSetJit(instance, pool->jitThreshold, pool->traceThreshold);
+
+    // The setup and the chunk being mapped stay on the stack, below each call, so they aren't collected.
+    ObjArray* setup = MessageRead(instance, pool->setup);
+    ReadGlobals(instance, setup, 1);
+    Value function = setup->items.values[0];
+
+    for (int chunk = PoolTake(pool, thread->index); chunk >= 0; chunk = PoolTake(pool, thread->index)) {
+        ObjArray* elements = MessageRead(instance, pool->inputs[chunk]);
+
+        Message* output = MessageNew();
+        for (int i = 0; i < elements->items.count; i++) {
+            Push(instance, function);
+            Push(instance, elements->items.values[i]);
+            InterpretResult result = InterpretCall(instance, 1);
+
+            const char* error = NULL;
+            if (result.status != INTERPRET_OK || !MessageWrite(instance, output, result.value, &error)) {
+                MessageFree(output);
+                output = NULL;
+                if (ATOMIC_INCREMENT(pool->failed) == 1)
+                    pool->error = error;
+                break;
+            }
+        }
+
+        pool->outputs[chunk] = output;
+        if (output == NULL)
+            break;
+        Pop(instance);
+    }
+
+    VMFree(instance);
+    return NULL;
+}
+
+/// @brief Calls a function on every element of an array, spread over a pool of threads. The function and the
+/// elements have to be sendable, like spawn's function and arguments, and so do the results.
+/// @param array Array to map.
+/// @param function Function taking one argument.
+/// @param results Array the results are added to, in the order of the elements. It has to be reachable.
+/// @param error Set to the reason if mapping failed.
+/// @return Whether every element was mapped.
+bool ParallelMap(ObjArray* array, Value function, ObjArray* results, const char** error) {
+    int count = array->items.count;
+    if (count == 0)
+        return true;
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadCount = (processors < 1) ? 1 : (processors > POOL_THREADS_MAX) ? POOL_THREADS_MAX : (int)processors;
+    int chunkSize = (count + threadCount * POOL_CHUNKS_PER_THREAD - 1) / (threadCount * POOL_CHUNKS_PER_THREAD);
+    int chunkCount = (count + chunkSize - 1) / chunkSize;
+    if (threadCount > chunkCount)
+        threadCount = chunkCount;
+
+    Pool pool;
+    pool.setup = MessageNew();
+    pool.inputs = ThreadReallocate(NULL, sizeof(Message*) * chunkCount);
+    pool.outputs = ThreadReallocate(NULL, sizeof(Message*) * chunkCount);
+    pool.chunkCount = chunkCount;
+    pool.shares = ThreadReallocate(NULL, sizeof(PoolShare) * threadCount);
+    pool.threadCount = threadCount;
+    pool.failed = 0;
+    pool.error = NULL;
+    pool.jitThreshold = vm->jitThreshold;
+    pool.traceThreshold = vm->traceThreshold;
+    memset(pool.inputs, 0, sizeof(Message*) * chunkCount);
+    memset(pool.outputs, 0, sizeof(Message*) * chunkCount);
+
+    bool written = MessageWrite(vm, pool.setup, function, error);
+    if (written)
+        WriteGlobals(pool.setup);
+
+    for (int chunk = 0; chunk < chunkCount && written; chunk++) {
+        pool.inputs[chunk] = MessageNew();
+        int end = (chunk + 1) * chunkSize;
+        for (int i = chunk * chunkSize; i < end && i < count && written; i++)
+            written = MessageWrite(vm, pool.inputs[chunk], array->items.values[i], error);
+    }
+
+    PoolThread* threads = ThreadReallocate(NULL, sizeof(PoolThread) * threadCount);
+    int started = 0;
+    if (written) {
+        for (int i = 0; i < threadCount; i++) {
+            pthread_mutex_init(&pool.shares[i].lock, NULL);
+            pool.shares[i].next = chunkCount * i / threadCount;
+            pool.shares[i].end = chunkCount * (i + 1) / threadCount;
+        }
+
+        for (; started < threadCount; started++) {
+            threads[started].pool = &pool;
+            threads[started].index = started;
+            if (pthread_create(&threads[started].handle, NULL, PoolMain, &threads[started]) != 0)
+                break;
+        }
+
+        // Chunks in the shares of threads that didn't start get stolen by those that did.
+        if (started == 0) {
+            *error = "Failed to start a thread.";
+            written = false;
+        }
+
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i].handle, NULL);
+        for (int i = 0; i < threadCount; i++)
+            pthread_mutex_destroy(&pool.shares[i].lock);
+    }
+
+    bool mapped = written && !pool.failed;
+    if (written && pool.failed)
+        *error = (pool.error != NULL) ? pool.error : "The mapped function failed.";
+
+    for (int chunk = 0; chunk < chunkCount; chunk++) {
+        if (mapped) {
+            ObjArray* values = MessageRead(vm, pool.outputs[chunk]);
+            for (int i = 0; i < values->items.count; i++)
+                MJ_ArrayAdd(results, values->items.values[i]);
+            Pop(vm);
+        }
+        MessageFree(pool.inputs[chunk]);
+        MessageFree(pool.outputs[chunk]);
+    }
+
+    MessageFree(pool.setup);
+    free(pool.inputs);
+    free(pool.outputs);
+    free(pool.shares);
+    free(threads);
+    return mapped;
+}
+
+#endif
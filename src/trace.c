@@ -0,0 +1,747 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Trace.h"
+
+#ifdef JIT_AVAILABLE
+
+#include "Assembler.h"
+#include "Chunk.h"
+#include "VM.h"
+
+// A trace is one recorded iteration of a hot loop, compiled to straight-line code. Branches become guards on the
+// direction the recording took, and numeric instructions are specialized to the types that were observed.
+// Anything that doesn't hold leaves the trace through a side exit, which hands the interpreter the instruction
+// the guard was protecting.
+//
+// Stack positions are fixed along a trace, so values are addressed straight from frame->slots and vm->stackTop is
+// only written back when the interpreter needs it (side exits and instructions it runs for us).
+//
+// Register use inside a trace:
+//  rbx - Current CallFrame*.
+//  r14 - frame->slots.
+//  r15 - the VM the code was compiled for.
+//  rax, rcx, rdx, xmm0, xmm1 - Scratch.
+
+#define FRAME_REGISTER  RBX
+#define SLOTS_REGISTER  R14
+#define VM_REGISTER     R15
+
+#define STACK_TOP       ((int32_t)offsetof(VM, stackTop))
+#define FRAME_IP        ((int32_t)offsetof(CallFrame, ip))
+#define FRAME_SLOTS     ((int32_t)offsetof(CallFrame, slots))
+#define FRAME_CLOSURE   ((int32_t)offsetof(CallFrame, closure))
+#define FRAME_COUNT     ((int32_t)offsetof(VM, frameCount))
+#define VALUE_TYPE      ((int32_t)offsetof(Value, type))
+#define VALUE_PAYLOAD   ((int32_t)offsetof(Value, as))
+#define VALUE_SIZE      ((int32_t)sizeof(Value))
+#define ARRAY_COUNT     ((int32_t)(offsetof(ObjArray, items) + offsetof(ValueArray, count)))
+#define ARRAY_CAPACITY  ((int32_t)(offsetof(ObjArray, items) + offsetof(ValueArray, capacity)))
+#define ARRAY_VALUES    ((int32_t)(offsetof(ObjArray, items) + offsetof(ValueArray, values)))
+#define STRING_LENGTH   ((int32_t)offsetof(ObjString, length))
+
+// Displacement of a stack position (counted from frame->slots) and of its payload.
+#define POSITION(position)  ((int32_t)(position) * VALUE_SIZE)
+#define PAYLOAD(position)   (POSITION(position) + VALUE_PAYLOAD)
+
+// Jump labels: side exits are numbered from 0, and these two are fixed.
+#define LOOP_LABEL -1
+#define EXIT_LABEL -2
+
+#define TYPE_UNKNOWN -1
+
+typedef struct {
+    int offset;         // Instruction that ran.
+    int next;           // Instruction the interpreter went to afterwards.
+    int depth;          // Stack depth (from frame->slots) before it ran.
+    int left;           // Observed operand types (TYPE_UNKNOWN if it doesn't matter).
+    int right;
+    bool leftIsArray;   // Whether the left operand was an array (for indexing).
+} RecordedInstruction;
+
+typedef struct {
+    int offset;         // Instruction the interpreter resumes at.
+    int depth;          // Stack depth at that point.
+} SideExit;
+
+typedef struct {
+    Assembler as;
+    MJ_Chunk* chunk;
+
+    int8_t* known;      // Type each stack position is known to have at this point of the trace, or TYPE_UNKNOWN.
+    int knownCount;
+
+    SideExit* exits;
+    int exitCount;
+    int exitCapacity;
+} TraceCompiler;
+
+/// @brief [INTERNAL] Runs an instruction through the interpreter from inside a trace.
+/// @param ip Instruction to run.
+/// @param next Where the recording went next.
+/// @return JIT_CONTINUE if execution went the same way as in the recording, JIT_EXIT if not.
+static JitStatus TraceStep(uint8_t* ip, uint8_t* next) {
+    ObjFiber* fiber = vm->fiber;
+    int frameCount = vm->frameCount;
+    CallFrame* frame = &vm->frames[frameCount - 1];
+    uint8_t instruction = *ip;
+    frame->ip = ip;
+
+    InterpretResult result = VMStep(vm);
+
+    // A quickened instruction whose guard failed only rewrote itself, so the generic form still has to run.
+    bool sameFrame = vm->fiber == fiber && vm->frameCount == frameCount;
+    if (result.status == INTERPRET_OK && sameFrame && frame->ip == ip && *ip != instruction) {
+        result = VMStep(vm);
+        sameFrame = vm->fiber == fiber && vm->frameCount == frameCount;
+    }
+
+    if (result.status != INTERPRET_OK)
+        return JIT_ERROR;
+
+    return (sameFrame && frame->ip == next) ? JIT_CONTINUE : JIT_EXIT;
+}
+
+static bool IsRegisterOp(uint8_t instruction) {
+    return (instruction >= OP_ADD_RK && instruction <= OP_SMALLER_RK) ||
+           (instruction >= OP_ADD_RK_NUM && instruction <= OP_SMALLER_RK_NUM);
+}
+
+static int OperandType(CallFrame* frame, uint8_t operand) {
+    if (operand & RK_CONSTANT)
+        return frame->closure->function->chunk.constants.values[operand & RK_MAX].type;
+    return frame->slots[operand].type;
+}
+
+/// @brief [INTERNAL] Notes down the types an instruction is about to see.
+static void Observe(RecordedInstruction* recorded, CallFrame* frame) {
+    uint8_t* ip = frame->ip;
+    Value* top = vm->stackTop;
+    int available = (int)(top - vm->Stack);
+
+    recorded->left = TYPE_UNKNOWN;
+    recorded->right = TYPE_UNKNOWN;
+    recorded->leftIsArray = false;
+
+    if (IsRegisterOp(*ip)) {
+        recorded->left = OperandType(frame, ip[1]);
+        recorded->right = OperandType(frame, ip[2]);
+        return;
+    }
+
+    // SET_INDEX has the value on top, so its array and index sit one position lower.
+    int base = (*ip == OP_SET_INDEX) ? 1 : 0;
+    if (available < base + 2)
+        return;
+
+    Value left = top[-base - 2];
+    recorded->left = left.type;
+    recorded->right = top[-base - 1].type;
+    recorded->leftIsArray = IS_ARRAY(left);
+}
+
+static void Forget(TraceCompiler* tc) {
+    memset(tc->known, TYPE_UNKNOWN, tc->knownCount);
+}
+
+// Writes vm->stackTop back for a stack depth.
+static void EmitSyncStack(TraceCompiler* tc, int depth) {
+    EmitLoadAddress(&tc->as, RAX, SLOTS_REGISTER, POSITION(depth));
+    EmitStore(&tc->as, VM_REGISTER, STACK_TOP, RAX);
+}
+
+/// @brief [INTERNAL] Emits a conditional jump to a side exit resuming at offset.
+static void EmitSideExit(TraceCompiler* tc, Condition condition, int offset, int depth) {
+    if (tc->exitCapacity < tc->exitCount + 1) {
+        tc->exitCapacity = (tc->exitCapacity < 8) ? 8 : tc->exitCapacity * 2;
+        tc->exits = realloc(tc->exits, sizeof(SideExit) * tc->exitCapacity);
+        if (tc->exits == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the JIT.\n");
+            exit(1);
+        }
+    }
+
+    tc->exits[tc->exitCount] = (SideExit){offset, depth};
+    EmitJumpTo(&tc->as, condition, tc->exitCount++);
+}
+
+/// @brief [INTERNAL] Makes sure a stack position holds a given type, leaving the trace otherwise.
+static void EmitGuard(TraceCompiler* tc, int position, ValueType type, RecordedInstruction* recorded) {
+    if (tc->known[position] == (int8_t)type)
+        return;
+
+    EmitCompareType(&tc->as, SLOTS_REGISTER, POSITION(position) + VALUE_TYPE, type);
+    EmitSideExit(tc, CONDITION_NOT_EQUAL, recorded->offset, recorded->depth);
+    tc->known[position] = (int8_t)type;
+}
+
+/// @brief [INTERNAL] Lets the interpreter run an instruction, leaving the trace if it doesn't go where it went
+/// while recording.
+/// @param forget Whether the instruction may change locals behind the trace's back.
+static void EmitStep(TraceCompiler* tc, RecordedInstruction* recorded, bool forget) {
+    EmitSyncStack(tc, recorded->depth);
+    EmitLoadImmediate(&tc->as, RDI, (uint64_t)(uintptr_t)&tc->chunk->code[recorded->offset]);
+    EmitLoadImmediate(&tc->as, RSI, (uint64_t)(uintptr_t)&tc->chunk->code[recorded->next]);
+    EmitCall(&tc->as, (void*)TraceStep);
+    Emit(&tc->as, 0x85); // test eax, eax
+    Emit(&tc->as, 0xc0);
+    EmitJumpTo(&tc->as, CONDITION_NOT_EQUAL, EXIT_LABEL);
+
+    // The interpreter may have moved the stack.
+    EmitLoad(&tc->as, SLOTS_REGISTER, FRAME_REGISTER, FRAME_SLOTS);
+
+    if (forget)
+        Forget(tc);
+}
+
+static void EmitStoreValue(TraceCompiler* tc, int position, Value value) {
+    uint64_t payload;
+    memcpy(&payload, &value.as, sizeof(payload));
+
+    EmitStoreImmediate(&tc->as, SLOTS_REGISTER, POSITION(position) + VALUE_TYPE, value.type);
+    EmitLoadImmediate(&tc->as, RAX, payload);
+    EmitStore(&tc->as, SLOTS_REGISTER, PAYLOAD(position), RAX);
+    tc->known[position] = (int8_t)value.type;
+}
+
+static void EmitCopy(TraceCompiler* tc, int from, int to) {
+    int8_t known = tc->known[from];
+
+    // Values are copied as two 8 byte halves, the same size as the stores that produced them: a 16 byte load over
+    // two 8 byte stores can't be forwarded and stalls the loop. With the type known, only the payload is needed.
+    EmitLoad(&tc->as, RAX, SLOTS_REGISTER, PAYLOAD(from));
+    EmitStore(&tc->as, SLOTS_REGISTER, PAYLOAD(to), RAX);
+
+    if (known == TYPE_UNKNOWN) {
+        EmitLoad(&tc->as, RAX, SLOTS_REGISTER, POSITION(from) + VALUE_TYPE);
+        EmitStore(&tc->as, SLOTS_REGISTER, POSITION(to) + VALUE_TYPE, RAX);
+    } else if (tc->known[to] != known) {
+        EmitStoreImmediate(&tc->as, SLOTS_REGISTER, POSITION(to) + VALUE_TYPE, known);
+    }
+
+    tc->known[to] = known;
+}
+
+// Stores the result of a ucomisd as a bool.
+static void EmitStoreAbove(TraceCompiler* tc, int position) {
+    EmitSetAbove(&tc->as);
+    EmitStoreImmediate(&tc->as, SLOTS_REGISTER, POSITION(position) + VALUE_TYPE, VALUE_BOOL);
+    EmitStore(&tc->as, SLOTS_REGISTER, PAYLOAD(position), RAX);
+    tc->known[position] = VALUE_BOOL;
+}
+
+// Loads the address of upvalue `index`'s variable into rax.
+static void EmitUpvalueAddress(TraceCompiler* tc, int index) {
+    EmitLoad(&tc->as, RAX, FRAME_REGISTER, FRAME_CLOSURE);
+    EmitLoad(&tc->as, RAX, RAX, (int32_t)offsetof(ObjClosure, upvalues) + index * (int32_t)sizeof(ObjUpvalue*));
+    EmitLoad(&tc->as, RAX, RAX, (int32_t)offsetof(ObjUpvalue, location));
+}
+
+static void CompileJumpIfFalse(TraceCompiler* tc, RecordedInstruction* recorded) {
+    Assembler* as = &tc->as;
+    uint8_t* ip = &tc->chunk->code[recorded->offset];
+    int position = recorded->depth - 1;
+    int fallthrough = recorded->offset + 3;
+    bool taken = recorded->next != fallthrough;
+    int8_t known = tc->known[position];
+
+    // If the value turns out the other way, the interpreter resumes where the branch would have gone.
+    int otherTarget = taken ? fallthrough : fallthrough + ((ip[1] << 8) | ip[2]);
+
+    // Numbers and objects are always truthy, so a trace that recorded them can't branch here.
+    if (!taken && (known == VALUE_NUMBER || known == VALUE_OBJECT))
+        return;
+
+    if (known == VALUE_BOOL) {
+        EmitCompareZeroByte(as, SLOTS_REGISTER, PAYLOAD(position));
+        EmitSideExit(tc, taken ? CONDITION_NOT_EQUAL : CONDITION_EQUAL, otherTarget, recorded->depth);
+        return;
+    }
+
+    // null and false are the only falsey values.
+    EmitCompareType(as, SLOTS_REGISTER, POSITION(position) + VALUE_TYPE, VALUE_NULL);
+    if (taken) {
+        int isNull = EmitJump(as, CONDITION_EQUAL);
+        EmitCompareType(as, SLOTS_REGISTER, POSITION(position) + VALUE_TYPE, VALUE_BOOL);
+        EmitSideExit(tc, CONDITION_NOT_EQUAL, otherTarget, recorded->depth);
+        EmitCompareZeroByte(as, SLOTS_REGISTER, PAYLOAD(position));
+        EmitSideExit(tc, CONDITION_NOT_EQUAL, otherTarget, recorded->depth);
+        PatchJump(as, isNull, as->count);
+    } else {
+        EmitSideExit(tc, CONDITION_EQUAL, otherTarget, recorded->depth);
+        EmitCompareType(as, SLOTS_REGISTER, POSITION(position) + VALUE_TYPE, VALUE_BOOL);
+        int notBool = EmitJump(as, CONDITION_NOT_EQUAL);
+        EmitCompareZeroByte(as, SLOTS_REGISTER, PAYLOAD(position));
+        EmitSideExit(tc, CONDITION_EQUAL, otherTarget, recorded->depth);
+        PatchJump(as, notBool, as->count);
+    }
+}
+
+static void CompileStackArithmetic(TraceCompiler* tc, RecordedInstruction* recorded, uint8_t operation) {
+    if (recorded->left != VALUE_NUMBER || recorded->right != VALUE_NUMBER) {
+        EmitStep(tc, recorded, true);
+        return;
+    }
+
+    int left = recorded->depth - 2;
+    int right = recorded->depth - 1;
+    EmitGuard(tc, left, VALUE_NUMBER, recorded);
+    EmitGuard(tc, right, VALUE_NUMBER, recorded);
+
+    EmitSse(&tc->as, SSE_DOUBLE, MOVSD_LOAD, 0, SLOTS_REGISTER, PAYLOAD(left));
+    EmitSse(&tc->as, SSE_DOUBLE, operation, 0, SLOTS_REGISTER, PAYLOAD(right));
+    EmitSse(&tc->as, SSE_DOUBLE, MOVSD_STORE, 0, SLOTS_REGISTER, PAYLOAD(left));
+}
+
+static void CompileStackComparison(TraceCompiler* tc, RecordedInstruction* recorded, bool swapped) {
+    if (recorded->left != VALUE_NUMBER || recorded->right != VALUE_NUMBER) {
+        EmitStep(tc, recorded, true);
+        return;
+    }
+
+    int left = recorded->depth - 2;
+    int right = recorded->depth - 1;
+    EmitGuard(tc, left, VALUE_NUMBER, recorded);
+    EmitGuard(tc, right, VALUE_NUMBER, recorded);
+
+    // a < b is computed as b > a.
+    EmitSse(&tc->as, SSE_DOUBLE, MOVSD_LOAD, 0, SLOTS_REGISTER, PAYLOAD(swapped ? right : left));
+    EmitSse(&tc->as, SSE_COMPARE, UCOMISD, 0, SLOTS_REGISTER, PAYLOAD(swapped ? left : right));
+    EmitStoreAbove(tc, left);
+}
+
+static void CompileRegisterOperand(TraceCompiler* tc, RecordedInstruction* recorded, uint8_t operand, int xmm) {
+    if (operand & RK_CONSTANT) {
+        uint64_t bits;
+        memcpy(&bits, &tc->chunk->constants.values[operand & RK_MAX].as.number, sizeof(bits));
+        EmitLoadImmediate(&tc->as, RDX, bits);
+        EmitMoveToXmm(&tc->as, xmm, RDX);
+        return;
+    }
+
+    EmitGuard(tc, operand, VALUE_NUMBER, recorded);
+    EmitSse(&tc->as, SSE_DOUBLE, MOVSD_LOAD, xmm, SLOTS_REGISTER, PAYLOAD(operand));
+}
+
+/// @brief [INTERNAL] Register op. operation is an SSE opcode, or 0 / 1 for a > b / a < b.
+static void CompileRegisterOp(TraceCompiler* tc, RecordedInstruction* recorded, uint8_t operation, bool compare) {
+    if (recorded->left != VALUE_NUMBER || recorded->right != VALUE_NUMBER) {
+        EmitStep(tc, recorded, true);
+        return;
+    }
+
+    uint8_t* ip = &tc->chunk->code[recorded->offset];
+    int result = recorded->depth;
+    CompileRegisterOperand(tc, recorded, ip[1], 0);
+    CompileRegisterOperand(tc, recorded, ip[2], 1);
+
+    if (compare) {
+        EmitSseRegister(&tc->as, SSE_COMPARE, UCOMISD, operation, 1 - operation);
+        EmitStoreAbove(tc, result);
+        return;
+    }
+
+    EmitSseRegister(&tc->as, SSE_DOUBLE, operation, 0, 1);
+    EmitStoreImmediate(&tc->as, SLOTS_REGISTER, POSITION(result) + VALUE_TYPE, VALUE_NUMBER);
+    EmitSse(&tc->as, SSE_DOUBLE, MOVSD_STORE, 0, SLOTS_REGISTER, PAYLOAD(result));
+    tc->known[result] = VALUE_NUMBER;
+}
+
+/// @brief [INTERNAL] Array indexing. Leaves rcx pointing at the element, or jumps to the returned slow path.
+/// Writing right at the end of the array appends in place when there's room (storing is true).
+/// @return Jumps to patch to the slow path.
+static int EmitArrayElement(TraceCompiler* tc, RecordedInstruction* recorded, int array, int index, bool storing, int* slowPaths) {
+    Assembler* as = &tc->as;
+    int count = 0;
+
+    EmitGuard(tc, array, VALUE_OBJECT, recorded);
+    EmitGuard(tc, index, VALUE_NUMBER, recorded);
+
+    EmitLoad(as, RAX, SLOTS_REGISTER, PAYLOAD(array));
+    EmitCompareType(as, RAX, (int32_t)offsetof(Object, type), (ValueType)OBJ_ARRAY);
+    slowPaths[count++] = EmitJump(as, CONDITION_NOT_EQUAL);
+
+    EmitSse(as, SSE_DOUBLE, CVTTSD2SI, RDX, SLOTS_REGISTER, PAYLOAD(index));    // edx = (int)index
+    Emit(as, 0x83); // cmp edx, 0
+    Emit(as, 0xfa);
+    Emit(as, 0x00);
+    slowPaths[count++] = EmitJump(as, CONDITION_LESS);
+    EmitCompareRegister32(as, RDX, RAX, ARRAY_COUNT);
+
+    if (storing) {
+        int inBounds = EmitJump(as, CONDITION_LESS);
+        slowPaths[count++] = EmitJump(as, CONDITION_NOT_EQUAL);
+        EmitCompareRegister32(as, RDX, RAX, ARRAY_CAPACITY);
+        slowPaths[count++] = EmitJump(as, CONDITION_GREATER_EQUAL);
+        EmitIncrement32(as, RAX, ARRAY_COUNT);
+        PatchJump(as, inBounds, as->count);
+    } else {
+        slowPaths[count++] = EmitJump(as, CONDITION_GREATER_EQUAL);
+    }
+
+    EmitLoad(as, RCX, RAX, ARRAY_VALUES);
+    Emit(as, 0x48); // shl rdx, 4
+    Emit(as, 0xc1);
+    Emit(as, 0xe2);
+    Emit(as, 0x04);
+    Emit(as, 0x48); // add rcx, rdx
+    Emit(as, 0x01);
+    Emit(as, 0xd1);
+    return count;
+}
+
+static void CompileIndex(TraceCompiler* tc, RecordedInstruction* recorded, bool storing) {
+    if (!recorded->leftIsArray || recorded->right != VALUE_NUMBER) {
+        EmitStep(tc, recorded, true);
+        return;
+    }
+
+    Assembler* as = &tc->as;
+    int depth = recorded->depth;
+    int array = depth - (storing ? 3 : 2);
+    int index = array + 1;
+    int slowPaths[4];
+    int slowPathCount = EmitArrayElement(tc, recorded, array, index, storing, slowPaths);
+
+    if (storing) {
+        EmitSse(as, SSE_UNALIGNED, MOVDQU_LOAD, 0, SLOTS_REGISTER, POSITION(depth - 1));
+        EmitSse(as, SSE_UNALIGNED, MOVDQU_STORE, 0, RCX, 0);
+    } else {
+        EmitSse(as, SSE_UNALIGNED, MOVDQU_LOAD, 0, RCX, 0);
+    }
+    EmitSse(as, SSE_UNALIGNED, MOVDQU_STORE, 0, SLOTS_REGISTER, POSITION(array));
+    int done = EmitJump(as, CONDITION_ALWAYS);
+
+    // Out of range, negative, growing... the interpreter sorts it out. Indexing never touches locals.
+    for (int i = 0; i < slowPathCount; i++)
+        PatchJump(as, slowPaths[i], as->count);
+    EmitStep(tc, recorded, false);
+    PatchJump(as, done, as->count);
+
+    tc->known[array] = storing ? tc->known[depth - 1] : TYPE_UNKNOWN;
+}
+
+/// @brief [INTERNAL] Calls a native straight from the trace. Only natives that can't start a collection qualify,
+/// since the collector scans the stack up to vm->stackTop and the trace doesn't keep that up to date. Natives
+/// that can make the fiber wait don't either, as that switches stacks.
+static void CompileCallNative(TraceCompiler* tc, RecordedInstruction* recorded) {
+    uint8_t* ip = &tc->chunk->code[recorded->offset];
+    ObjNative* native = vm->natives[ip[1]];
+    int argumentCount = ip[2];
+
+    if (native->flags & (NATIVE_ALLOCATES | NATIVE_SUSPENDS)) {
+        EmitStep(tc, recorded, true);
+        return;
+    }
+
+    Assembler* as = &tc->as;
+    int base = recorded->depth - argumentCount;
+
+    // Once its global is assigned, the interpreter works out what to call instead.
+    EmitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)&native->shadowed);
+    EmitCompareZeroByte(as, RAX, 0);
+    EmitSideExit(tc, CONDITION_NOT_EQUAL, recorded->offset, recorded->depth);
+
+    // Errors are reported against frame->ip, which the interpreter would have moved past the operands.
+    EmitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)(ip + 3));
+    EmitStore(as, FRAME_REGISTER, FRAME_IP, RAX);
+
+    EmitLoadImmediate(as, RDI, (uint64_t)argumentCount);
+    EmitLoadAddress(as, RSI, SLOTS_REGISTER, POSITION(base));
+    EmitCall(as, (void*)native->function);
+
+    // The Value comes back in rax (type) and rdx (payload).
+    EmitStore(as, SLOTS_REGISTER, POSITION(base) + VALUE_TYPE, RAX);
+    EmitStore(as, SLOTS_REGISTER, PAYLOAD(base), RDX);
+    tc->known[base] = TYPE_UNKNOWN;
+
+    // A native that reported an error has reset the stack, frames included.
+    Emit(as, 0x31); // xor eax, eax
+    Emit(as, 0xc0);
+    EmitCompareRegister32(as, RAX, VM_REGISTER, FRAME_COUNT);
+    EmitLoadImmediate(as, RAX, JIT_ERROR);
+    EmitJumpTo(as, CONDITION_EQUAL, EXIT_LABEL);
+}
+
+/// @brief [INTERNAL] OP_LEN on an array or a string. Anything else leaves the trace, so the result is always a number.
+static void CompileLength(TraceCompiler* tc, RecordedInstruction* recorded) {
+    uint8_t* ip = &tc->chunk->code[recorded->offset];
+    Assembler* as = &tc->as;
+    int position = recorded->depth - 1;
+
+    EmitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)&vm->natives[ip[1]]->shadowed);
+    EmitCompareZeroByte(as, RAX, 0);
+    EmitSideExit(tc, CONDITION_NOT_EQUAL, recorded->offset, recorded->depth);
+    EmitGuard(tc, position, VALUE_OBJECT, recorded);
+
+    EmitLoad(as, RAX, SLOTS_REGISTER, PAYLOAD(position));
+    EmitCompareType(as, RAX, (int32_t)offsetof(Object, type), (ValueType)OBJ_ARRAY);
+    int notArray = EmitJump(as, CONDITION_NOT_EQUAL);
+    EmitSse(as, SSE_DOUBLE, CVTSI2SD, 0, RAX, ARRAY_COUNT);
+    int arrayDone = EmitJump(as, CONDITION_ALWAYS);
+
+    PatchJump(as, notArray, as->count);
+    EmitCompareType(as, RAX, (int32_t)offsetof(Object, type), (ValueType)OBJ_STRING);
+    EmitSideExit(tc, CONDITION_NOT_EQUAL, recorded->offset, recorded->depth);
+    EmitSse(as, SSE_DOUBLE, CVTSI2SD, 0, RAX, STRING_LENGTH);
+
+    PatchJump(as, arrayDone, as->count);
+    EmitSse(as, SSE_DOUBLE, MOVSD_STORE, 0, SLOTS_REGISTER, PAYLOAD(position));
+    EmitStoreImmediate(as, SLOTS_REGISTER, POSITION(position) + VALUE_TYPE, VALUE_NUMBER);
+    tc->known[position] = VALUE_NUMBER;
+}
+
+static void CompileInstruction(TraceCompiler* tc, RecordedInstruction* recorded) {
+    uint8_t* ip = &tc->chunk->code[recorded->offset];
+    int depth = recorded->depth;
+
+    switch (*ip) {
+        case OP_CONSTANT:
+            EmitStoreValue(tc, depth, tc->chunk->constants.values[ip[1]]);
+            break;
+        case OP_CONSTANT_LONG:
+            EmitStoreValue(tc, depth, tc->chunk->constants.values[(ip[1] << 24) | (ip[2] << 16) | (ip[3] << 8) | ip[4]]);
+            break;
+        case OP_NULL:   EmitStoreValue(tc, depth, NULL_VALUE);          break;
+        case OP_TRUE:   EmitStoreValue(tc, depth, BOOL_VALUE(true));    break;
+        case OP_FALSE:  EmitStoreValue(tc, depth, BOOL_VALUE(false));   break;
+        case OP_POP:
+        case OP_JUMP:
+        case OP_LOOP:
+            // Nothing to do: stack positions are fixed and the trace already follows the jump.
+            break;
+        case OP_DUPLICATE:  EmitCopy(tc, depth - 1, depth);         break;
+        case OP_GET_LOCAL:  EmitCopy(tc, ip[1], depth);             break;
+        case OP_SET_LOCAL:  EmitCopy(tc, depth - 1, ip[1]);         break;
+        case OP_GET_UPVALUE:
+            EmitUpvalueAddress(tc, ip[1]);
+            EmitSse(&tc->as, SSE_UNALIGNED, MOVDQU_LOAD, 0, RAX, 0);
+            EmitSse(&tc->as, SSE_UNALIGNED, MOVDQU_STORE, 0, SLOTS_REGISTER, POSITION(depth));
+            tc->known[depth] = TYPE_UNKNOWN;
+            break;
+        case OP_SET_UPVALUE:
+            EmitUpvalueAddress(tc, ip[1]);
+            EmitSse(&tc->as, SSE_UNALIGNED, MOVDQU_LOAD, 0, SLOTS_REGISTER, POSITION(depth - 1));
+            EmitSse(&tc->as, SSE_UNALIGNED, MOVDQU_STORE, 0, RAX, 0);
+            // The upvalue may point at one of our own locals.
+            Forget(tc);
+            break;
+        case OP_JUMP_IF_FALSE:
+            CompileJumpIfFalse(tc, recorded);
+            break;
+
+        case OP_ADD:
+        case OP_ADD_NUM:            CompileStackArithmetic(tc, recorded, ADDSD); break;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:       CompileStackArithmetic(tc, recorded, SUBSD); break;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:       CompileStackArithmetic(tc, recorded, MULSD); break;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:         CompileStackArithmetic(tc, recorded, DIVSD); break;
+        case OP_GREATER:
+        case OP_GREATER_NUM:        CompileStackComparison(tc, recorded, false); break;
+        case OP_SMALLER:
+        case OP_SMALLER_NUM:        CompileStackComparison(tc, recorded, true); break;
+
+        case OP_ADD_RK:
+        case OP_ADD_RK_NUM:         CompileRegisterOp(tc, recorded, ADDSD, false); break;
+        case OP_SUBTRACT_RK:
+        case OP_SUBTRACT_RK_NUM:    CompileRegisterOp(tc, recorded, SUBSD, false); break;
+        case OP_MULTIPLY_RK:
+        case OP_MULTIPLY_RK_NUM:    CompileRegisterOp(tc, recorded, MULSD, false); break;
+        case OP_DIVIDE_RK:
+        case OP_DIVIDE_RK_NUM:      CompileRegisterOp(tc, recorded, DIVSD, false); break;
+        case OP_GREATER_RK:
+        case OP_GREATER_RK_NUM:     CompileRegisterOp(tc, recorded, 0, true); break;
+        case OP_SMALLER_RK:
+        case OP_SMALLER_RK_NUM:     CompileRegisterOp(tc, recorded, 1, true); break;
+
+        case OP_GET_INDEX:          CompileIndex(tc, recorded, false); break;
+        case OP_SET_INDEX:          CompileIndex(tc, recorded, true); break;
+        case OP_CALL_NATIVE:        CompileCallNative(tc, recorded); break;
+        case OP_LEN:                CompileLength(tc, recorded); break;
+
+        default:
+            EmitStep(tc, recorded, true);
+            break;
+    }
+}
+
+/// @brief [INTERNAL] Compiles a recorded iteration into the trace's native code.
+static void CompileTrace(ObjFunction* function, Trace* trace, RecordedInstruction* recording, int length) {
+    TraceCompiler tc = {0};
+    tc.chunk = &function->chunk;
+
+    int maxDepth = 0;
+    for (int i = 0; i < length; i++) {
+        if (recording[i].depth > maxDepth)
+            maxDepth = recording[i].depth;
+    }
+
+    // Locals are stack positions too, so they get tracked along with the temporaries.
+    tc.knownCount = (maxDepth > UINT8_COUNT ? maxDepth : UINT8_COUNT) + 1;
+    tc.known = malloc(tc.knownCount);
+    if (tc.known == NULL)
+        return;
+    Forget(&tc);
+
+    Assembler* as = &tc.as;
+    Emit(as, 0x53);                 // push rbx
+    Emit(as, 0x41); Emit(as, 0x56); // push r14
+    Emit(as, 0x41); Emit(as, 0x57); // push r15
+    Emit(as, 0x48); Emit(as, 0x89); Emit(as, 0xfb);     // mov rbx, rdi
+    EmitLoadImmediate(as, VM_REGISTER, (uint64_t)(uintptr_t)vm);
+    EmitLoad(as, SLOTS_REGISTER, FRAME_REGISTER, FRAME_SLOTS);
+
+    // Nothing is known about the stack when an iteration starts.
+    int loop = as->count;
+    for (int i = 0; i < length; i++)
+        CompileInstruction(&tc, &recording[i]);
+    EmitJumpTo(as, CONDITION_ALWAYS, LOOP_LABEL);
+
+    // Side exits: hand the interpreter a consistent stack and the instruction to resume at.
+    int* exitPositions = malloc(sizeof(int) * (tc.exitCount + 1));
+    if (exitPositions == NULL) {
+        free(tc.known);
+        free(tc.exits);
+        AsmFree(as);
+        return;
+    }
+
+    for (int i = 0; i < tc.exitCount; i++) {
+        exitPositions[i] = as->count;
+        EmitSyncStack(&tc, tc.exits[i].depth);
+        EmitLoadImmediate(as, RAX, (uint64_t)(uintptr_t)&function->chunk.code[tc.exits[i].offset]);
+        EmitStore(as, FRAME_REGISTER, FRAME_IP, RAX);
+        Emit(as, 0xb8); // mov eax, JIT_EXIT
+        Emit32(as, JIT_EXIT);
+        EmitJumpTo(as, CONDITION_ALWAYS, EXIT_LABEL);
+    }
+
+    int exit = as->count;
+    Emit(as, 0x41); Emit(as, 0x5f); // pop r15
+    Emit(as, 0x41); Emit(as, 0x5e); // pop r14
+    Emit(as, 0x5b);                 // pop rbx
+    Emit(as, 0xc3);                 // ret
+
+    for (int i = 0; i < as->fixupCount; i++) {
+        AsmFixup* fixup = &as->fixups[i];
+        int target = (fixup->target == LOOP_LABEL) ? loop : (fixup->target == EXIT_LABEL) ? exit : exitPositions[fixup->target];
+        PatchJump(as, fixup->at, target);
+    }
+
+    free(exitPositions);
+    free(tc.known);
+    free(tc.exits);
+
+    trace->code = AsmFinish(as, &trace->size);
+}
+
+/// @brief [INTERNAL] Records one iteration of the loop by single-stepping the interpreter, then compiles it.
+/// @return Like TraceLoop.
+static JitStatus RecordTrace(CallFrame* frame, ObjFunction* function, Trace* trace) {
+    RecordedInstruction recording[TRACE_MAX_LENGTH];
+    uint8_t* code = function->chunk.code;
+    ObjFiber* fiber = vm->fiber;
+    int frameCount = vm->frameCount;
+    int length = 0;
+
+    for (;;) {
+        // Nested loops and very long bodies end up here; the inner loops get traces of their own.
+        if (length == TRACE_MAX_LENGTH) {
+            trace->aborts++;
+            return JIT_EXIT;
+        }
+
+        RecordedInstruction* recorded = &recording[length++];
+        uint8_t* ip = frame->ip;
+        uint8_t instruction = *ip;
+        recorded->offset = (int)(ip - code);
+        recorded->depth = (int)(vm->stackTop - frame->slots);
+        Observe(recorded, frame);
+
+        InterpretResult result = VMStep(vm);
+        if (result.status == INTERPRET_OK && vm->fiber == fiber && vm->frameCount == frameCount && frame->ip == ip &&
+            *ip != instruction)
+            result = VMStep(vm);
+
+        if (result.status != INTERPRET_OK)
+            return JIT_ERROR;
+
+        // Calls into (and returns from) other functions aren't traced, and neither are tail calls or fiber switches.
+        if (vm->fiber != fiber || vm->frameCount != frameCount || frame->closure->function != function) {
+            trace->aborts++;
+            return JIT_EXIT;
+        }
+
+        recorded->next = (int)(frame->ip - code);
+        if (recorded->next == trace->anchor)
+            break;
+    }
+
+    CompileTrace(function, trace, recording, length);
+    if (trace->code == NULL)
+        trace->aborts = TRACE_MAX_ABORTS;
+
+    // We are back at the loop header, in the same frame.
+    return JIT_CONTINUE;
+}
+
+static Trace* FindTrace(ObjFunction* function, int anchor) {
+    for (int i = 0; i < function->traceCount; i++) {
+        if (function->traces[i].anchor == anchor)
+            return &function->traces[i];
+    }
+
+    Trace* traces = realloc(function->traces, sizeof(Trace) * (function->traceCount + 1));
+    if (traces == NULL)
+        return NULL;
+
+    function->traces = traces;
+    Trace* trace = &traces[function->traceCount++];
+    *trace = (Trace){anchor, 0, 0, NULL, 0};
+    return trace;
+}
+
+/// @brief Called on every back-edge, with frame->ip already at the loop header.
+/// Counts the loop's iterations, records and compiles it once it gets hot, and runs its trace if there is one.
+/// @param frame Frame running the loop.
+/// @return JIT_CONTINUE if execution carries on at the loop header, JIT_EXIT if it moved (the interpreter
+/// continues from the top frame's ip) or JIT_ERROR.
+JitStatus TraceLoop(CallFrame* frame) {
+    if (vm->traceThreshold == 0)
+        return JIT_CONTINUE;
+
+    ObjFunction* function = frame->closure->function;
+    Trace* trace = FindTrace(function, (int)(frame->ip - function->chunk.code));
+
+    if (trace == NULL || trace->aborts >= TRACE_MAX_ABORTS)
+        return JIT_CONTINUE;
+
+    if (trace->code == NULL) {
+        if (++trace->hits < vm->traceThreshold)
+            return JIT_CONTINUE;
+
+        trace->hits = 0;
+        JitStatus status = RecordTrace(frame, function, trace);
+        if (status != JIT_CONTINUE || trace->code == NULL)
+            return status;
+    }
+
+    return ((JitFunction)(void*)trace->code)(frame, NULL);
+}
+
+/// @brief Releases a function's traces.
+void TraceFreeAll(ObjFunction* function) {
+    for (int i = 0; i < function->traceCount; i++) {
+        if (function->traces[i].code != NULL)
+            AsmRelease(function->traces[i].code, function->traces[i].size);
+    }
+
+    free(function->traces);
+    function->traces = NULL;
+    function->traceCount = 0;
+}
+
+#endif
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <time.h>
@@ -8,20 +9,165 @@
 #include "Common.h"
 #include "Scanner.h"
 #include "Compiler.h"
+#include "Cache.h"
 #include "Debug.h"
 #include "Object.h"
 #include "Memory.h"
 #include "Array.h"
 #include "Map.h"
 #include "VM.h"
+#include "JIT.h"
+#include "Trace.h"
+#include "Thread.h"
+#include "Loop.h"
+
+THREAD_LOCAL VM* vm = NULL;
+
+// Frames shown at each end of the traceback of a runtime error.
+#define TRACEBACK_ENDS 16
+
+/// @brief [INTERNAL] Makes another fiber the running one: the VM's stack and frames are stored in the fiber that
+/// was running, and the new one's take their place. Nothing is copied but the pointers.
+static void FiberSwitch(ObjFiber* to) {
+    ObjFiber* from = vm->fiber;
+    from->frames = vm->frames;
+    from->frameCount = vm->frameCount;
+    from->frameCapacity = vm->frameCapacity;
+    from->stack = vm->Stack;
+    from->stackTop = vm->stackTop;
+    from->stackCapacity = vm->stackCapacity;
+    from->openUpvalues = vm->openUpvalues;
+    from->openSlots = vm->openSlots;
+
+    vm->frames = to->frames;
+    vm->frameCount = to->frameCount;
+    vm->frameCapacity = to->frameCapacity;
+    vm->Stack = to->stack;
+    vm->stackTop = to->stackTop;
+    vm->stackCapacity = to->stackCapacity;
+    vm->openUpvalues = to->openUpvalues;
+    vm->openSlots = to->openSlots;
+
+    // The running fiber's stack is the VM's alone (so it's neither marked nor freed twice).
+    to->frames = NULL;
+    to->frameCount = 0;
+    to->frameCapacity = 0;
+    to->stack = NULL;
+    to->stackTop = NULL;
+    to->stackCapacity = 0;
+    to->openUpvalues = NULL;
+    to->openSlots = NULL;
+    vm->fiber = to;
+}
 
-VM vm;
+/// @brief [INTERNAL] Leaves the running fiber for the one that resumed it, marking it as done or suspended.
+static void FiberLeave(FiberState state) {
+    ObjFiber* fiber = vm->fiber;
+    ObjFiber* caller = fiber->caller;
+    fiber->caller = NULL;
+    fiber->state = state;
+    FiberSwitch(caller);
+}
 
 /// @brief Resets the VM's value stack.
 static void ResetStack() {
-    vm.stackTop = vm.Stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    // An error in a fiber ends it, along with every fiber waiting on it, back to the main one.
+    while (vm->fiber != NULL && vm->fiber->caller != NULL)
+        FiberLeave(FIBER_DONE);
+    if (vm->fiber != NULL)
+        vm->fiber->state = FIBER_RUNNING;
+
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        vm->openSlots[upvalue->location - vm->Stack] = NULL;
+
+    vm->stackTop = vm->Stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
+}
+
+/// @brief [INTERNAL] Grows the value stack (and openSlots along with it) to hold at least the given number of
+/// values. The stack may move, so the frames, stackTop and open upvalues are pointed at the new one.
+static void StackGrow(int needed) {
+    int capacity = vm->stackCapacity * 2;
+    if (capacity < needed)
+        capacity = needed;
+
+    // Not realloc: the old stack is still needed to work out where things were.
+    Value* old = vm->Stack;
+    Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (stack == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the stack.\n");
+        exit(1);
+    }
+    memcpy(stack, old, sizeof(Value) * (vm->stackTop - old));
+
+    for (int i = 0; i < vm->frameCount; i++)
+        vm->frames[i].slots = stack + (vm->frames[i].slots - old);
+
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+        upvalue->location = stack + (upvalue->location - old);
+
+    // Closures made on the stack can only be referenced from the stack, so that is where their cells are found.
+    // A closure can sit in more than one slot, so cells already moved are left alone.
+    for (Value* slot = stack; slot < stack + (vm->stackTop - old); slot++) {
+        if (!IS_CLOSURE(*slot) || !AS_CLOSURE(*slot)->onStack)
+            continue;
+
+        ObjClosure* closure = AS_CLOSURE(*slot);
+        ObjUpvalue* cells = STACK_CLOSURE_CELLS(closure);
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            uintptr_t location = (uintptr_t)cells[i].location;
+            if (location >= (uintptr_t)old && location < (uintptr_t)vm->stackTop)
+                cells[i].location = stack + (cells[i].location - old);
+        }
+    }
+
+    vm->stackTop = stack + (vm->stackTop - old);
+    free(old);
+
+    ObjUpvalue** openSlots = (ObjUpvalue**)realloc(vm->openSlots, sizeof(ObjUpvalue*) * capacity);
+    if (openSlots == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the stack.\n");
+        exit(1);
+    }
+    memset(openSlots + vm->stackCapacity, 0, sizeof(ObjUpvalue*) * (capacity - vm->stackCapacity));
+
+    vm->allocatedBytes += STACK_BYTES(capacity) - STACK_BYTES(vm->stackCapacity);
+    vm->Stack = stack;
+    vm->openSlots = openSlots;
+    vm->stackCapacity = capacity;
+}
+
+/// @brief [INTERNAL] Makes sure a frame starting at slots has room for size values.
+static inline void StackReserve(Value* slots, int size) {
+    int needed = (int)(slots - vm->Stack) + size;
+    if (needed > vm->stackCapacity)
+        StackGrow(needed);
+}
+
+/// @brief [INTERNAL] Makes room for one more call frame.
+/// @return false if the call depth limit has been reached.
+static bool FramesReserve() {
+    if (vm->frameCount >= vm->maxFrames)
+        return false;
+
+    if (vm->frameCount == vm->frameCapacity) {
+        int capacity = vm->frameCapacity * 2;
+        if (capacity > vm->maxFrames)
+            capacity = vm->maxFrames;
+
+        CallFrame* frames = (CallFrame*)realloc(vm->frames, sizeof(CallFrame) * capacity);
+        if (frames == NULL) {
+            fprintf(stderr, "Failed to allocate memory for the call frames.\n");
+            exit(1);
+        }
+
+        vm->allocatedBytes += FRAMES_BYTES(capacity) - FRAMES_BYTES(vm->frameCapacity);
+        vm->frames = frames;
+        vm->frameCapacity = capacity;
+    }
+
+    return true;
 }
 
 /// @brief For reporting a Runtime Error.
@@ -29,20 +175,29 @@ static void RuntimeError(const char* format, ...) {
     fprintf(stderr, "Exception Stacktrace (most recent call FIRST):\n");
 
     // We iterate through all of the frames to get the full traceback.
-    for (int n = vm.frameCount - 1; n >= 0; n--) {
-        CallFrame* frame = &vm.frames[n];
+    // Deep recursion would drown the message, so only both ends of a long traceback are shown.
+    for (int n = vm->frameCount - 1; n >= 0; n--) {
+        if (vm->frameCount > 2 * TRACEBACK_ENDS && n == vm->frameCount - 1 - TRACEBACK_ENDS) {
+            fprintf(stderr, "        ... %d more calls ...\n", vm->frameCount - 2 * TRACEBACK_ENDS);
+            n = TRACEBACK_ENDS - 1;
+        }
+
+        CallFrame* frame = &vm->frames[n];
         ObjFunction* function = frame->closure->function;
+        if (function->hidden)
+            continue;
         size_t instruction = frame->ip - function->chunk.code - 1;
 
         int line = MJ_ChunkGetLine(&function->chunk, instruction);
-        char* content = MJ_ChunkGetSource(&function->chunk, instruction);
+        int length;
+        const char* content = MJ_ChunkGetSource(&function->chunk, instruction, &length);
 
         fprintf(stderr, COLOR_MAGENTA "   %4d " COLOR_RESET "| ", line);
         if (function->name == NULL)
             fprintf(stderr, COLOR_CYAN "<script>" COLOR_RESET);
         else
             fprintf(stderr, COLOR_CYAN "%s()" COLOR_RESET, function->name->chars);
-        fprintf(stderr, " | %s\n", content);
+        fprintf(stderr, " | %.*s\n", length, content);
     }
 
     // We print out the error message.
@@ -54,26 +209,53 @@ static void RuntimeError(const char* format, ...) {
     fputs("\n", stderr);
 
     // We print out the current line that triggered the error.
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
     ObjFunction* function = frame->closure->function;
+    if (function->hidden) {
+        ResetStack();
+        return;
+    }
+
     size_t instruction = frame->ip - function->chunk.code - 1;
     int line = MJ_ChunkGetLine(&function->chunk, instruction);
-    char* content = MJ_ChunkGetSource(&function->chunk, instruction);
+    int length;
+    const char* content = MJ_ChunkGetSource(&function->chunk, instruction, &length);
 
     if (function->name == NULL)
         fprintf(stderr, "In <script>: \n");
     else
         fprintf(stderr, "In <%s()>: \n", function->name->chars);
     
-    fprintf(stderr, "   %4d | %s\n", line, content);
+    fprintf(stderr, "   %4d | %.*s\n", line, length, content);
     ResetStack();
 }
 
-static void DefineNative(const char* name, NativeFn function) {
-    Push(OBJECT_VALUE(StringCopy(name, (int)strlen(name))));
-    Push(OBJECT_VALUE(NativeNew(function)));
-    TableSet(&vm.globals, AS_STRING(vm.Stack[0]), vm.Stack[1]);
-    PopN(2);
+/// @brief [INTERNAL] Defines a global native function.
+/// @param arity Number of arguments the VM makes sure it gets, or NATIVE_VARIADIC if it checks them itself.
+/// @param flags NativeFlags describing what the native may do.
+/// @return The native, for setting up an intrinsic.
+static ObjNative* DefineNative(const char* name, NativeFn function, int arity, uint8_t flags) {
+    if (vm->nativeCount == NATIVES_MAX) {
+        fprintf(stderr, "Too many natives defined.\n");
+        exit(1);
+    }
+
+    Push(vm, OBJECT_VALUE(StringCopy(name, (int)strlen(name))));
+    Push(vm, OBJECT_VALUE(NativeNew(function, AS_STRING(vm->Stack[0]), arity, flags)));
+    TableSet(&vm->globals, AS_STRING(vm->Stack[0]), vm->Stack[1]);
+    ObjNative* native = AS_NATIVE(vm->Stack[1]);
+    vm->natives[vm->nativeCount++] = native;
+    PopN(vm, 2);
+    return native;
+}
+
+/// @brief [INTERNAL] Called when a global is assigned, so calls compiled against a native of the same name
+/// stop calling it directly.
+static void ShadowNative(ObjString* name) {
+    for (int i = 0; i < vm->nativeCount; i++) {
+        if (vm->natives[i]->name == name)
+            vm->natives[i]->shadowed = true;
+    }
 }
 
 static Value ToNumberNative(int argumentCount, Value* arguments) {
@@ -111,10 +293,6 @@ static Value ClockNative(int argumentCount, Value* arguments) {
 }
 
 static Value LengthNative(int argumentCount, Value* arguments) {
-    if (argumentCount != 1) {
-        RuntimeError("len expected 1 argument, got %d.", argumentCount);
-    }
-
     if (IS_STRING(arguments[0])) {
         ObjString* string = AS_STRING(arguments[0]);
         return NUMBER_VALUE(string->length);
@@ -129,26 +307,86 @@ static Value LengthNative(int argumentCount, Value* arguments) {
     return NULL_VALUE;
 }
 
-static Value ExecNative(int argumentCount, Value* arguments) {
-    if (argumentCount != 1) {
-        RuntimeError("\"exec\" expected 1 argument, got %d.", argumentCount);
+#ifdef EVENT_LOOP_AVAILABLE
+/// @brief [INTERNAL] The VM's event loop, made on first use.
+/// @return The loop, or NULL (with the error reported) if it couldn't be made.
+static Loop* EventLoop() {
+    if (vm->loop == NULL) {
+        vm->loop = LoopNew();
+        if (vm->loop == NULL)
+            RuntimeError("Could not start the event loop: %s.", strerror(errno));
+    }
+    return vm->loop;
+}
+
+/// @brief [INTERNAL] Ends a native that started an operation for the running fiber (see FiberWait), or reports
+/// why it couldn't.
+static Value WaitOn(bool started, const char* name) {
+    if (started)
+        vm->fiber->state = FIBER_WAITING;
+    else
+        RuntimeError("\"%s\" failed: %s.", name, strerror(errno));
+    return NULL_VALUE;
+}
+
+static Value SleepNative(int argumentCount, Value* arguments) {
+    if (!IS_NUMBER(arguments[0]) || !(AS_NUMBER(arguments[0]) >= 0)) {
+        RuntimeError("\"sleep\" expected a number of seconds.");
         return NULL_VALUE;
     }
 
+    Loop* loop = EventLoop();
+    if (loop == NULL)
+        return NULL_VALUE;
+    return WaitOn(LoopSleep(loop, vm->fiber, AS_NUMBER(arguments[0])), "sleep");
+}
+
+static Value ReadFileNative(int argumentCount, Value* arguments) {
     if (!IS_STRING(arguments[0])) {
-        RuntimeError("\"exec\" expected a string.");
+        RuntimeError("\"readFile\" expected a path.");
         return NULL_VALUE;
     }
 
-    return NULL_VALUE;
+    Loop* loop = EventLoop();
+    if (loop == NULL)
+        return NULL_VALUE;
+    return WaitOn(LoopReadFile(loop, vm->fiber, AS_CSTRING(arguments[0])), "readFile");
 }
 
-static Value SystemNative(int argumentCount, Value* arguments) {
-    if (argumentCount != 1) {
-        RuntimeError("\"system\" expected 1 argument, got %d.", argumentCount);
+static Value WriteFileNative(int argumentCount, Value* arguments) {
+    if (!IS_STRING(arguments[0]) || !IS_STRING(arguments[1])) {
+        RuntimeError("\"writeFile\" expected a path and a string.");
         return NULL_VALUE;
     }
 
+    Loop* loop = EventLoop();
+    if (loop == NULL)
+        return NULL_VALUE;
+
+    ObjString* text = AS_STRING(arguments[1]);
+    return WaitOn(LoopWriteFile(loop, vm->fiber, AS_CSTRING(arguments[0]), text->chars, text->length), "writeFile");
+}
+#endif
+
+/// @brief [INTERNAL] Runs a shell command, and returns what it printed and its exit status, as [output, status].
+/// The fiber waits on the command meanwhile.
+static Value ExecNative(int argumentCount, Value* arguments) {
+    if (!IS_STRING(arguments[0])) {
+        RuntimeError("\"exec\" expected a string.");
+        return NULL_VALUE;
+    }
+
+#ifdef EVENT_LOOP_AVAILABLE
+    Loop* loop = EventLoop();
+    if (loop == NULL)
+        return NULL_VALUE;
+    return WaitOn(LoopCommand(loop, vm->fiber, AS_CSTRING(arguments[0])), "exec");
+#else
+    return NULL_VALUE;
+#endif
+}
+
+static Value SystemNative(int argumentCount, Value* arguments) {
     if (!IS_STRING(arguments[0])) {
         RuntimeError("\"system\" expected a string.");
         return NULL_VALUE;
@@ -159,12 +397,132 @@ static Value SystemNative(int argumentCount, Value* arguments) {
     return NUMBER_VALUE(result);
 }
 
+static Value FiberNative(int argumentCount, Value* arguments) {
+    if (!IS_CLOSURE(arguments[0]) || AS_CLOSURE(arguments[0])->function->arity > 1) {
+        RuntimeError("\"fiber\" expected a function taking at most 1 argument.");
+        return NULL_VALUE;
+    }
+
+    return OBJECT_VALUE(FiberNew(AS_CLOSURE(arguments[0])));
+}
+
+static Value DoneNative(int argumentCount, Value* arguments) {
+    if (!IS_FIBER(arguments[0])) {
+        RuntimeError("\"done\" expected a fiber.");
+        return NULL_VALUE;
+    }
+
+    return BOOL_VALUE(AS_FIBER(arguments[0])->state == FIBER_DONE);
+}
+
+#ifdef THREADS_AVAILABLE
+/// @brief [INTERNAL] Reads the single value of a message into the current VM.
+static Value MessageValue(Message* message) {
+    ObjArray* values = MessageRead(vm, message);
+    Pop(vm);
+    return values->items.values[0];
+}
+
+static Value SpawnNative(int argumentCount, Value* arguments) {
+    if (argumentCount == 0 || (!IS_CLOSURE(arguments[0]) && !IS_NATIVE(arguments[0]))) {
+        RuntimeError("\"spawn\" expected a function.");
+        return NULL_VALUE;
+    }
+
+    const char* error;
+    Worker* worker = WorkerSpawn(argumentCount, arguments, &error);
+    if (worker == NULL) {
+        RuntimeError("%s", error);
+        return NULL_VALUE;
+    }
+
+    return OBJECT_VALUE(ThreadNew(worker));
+}
+
+static Value JoinNative(int argumentCount, Value* arguments) {
+    if (!IS_THREAD(arguments[0])) {
+        RuntimeError("\"join\" expected a thread.");
+        return NULL_VALUE;
+    }
+
+    const char* error;
+    Message* result = WorkerJoin(AS_THREAD(arguments[0])->worker, &error);
+    if (result == NULL) {
+        RuntimeError("%s", error);
+        return NULL_VALUE;
+    }
+
+    return MessageValue(result);
+}
+
+static Value ChannelNative(int argumentCount, Value* arguments) {
+    return OBJECT_VALUE(ChannelNew(ChannelOpen()));
+}
+
+static Value SendNative(int argumentCount, Value* arguments) {
+    if (!IS_CHANNEL(arguments[0])) {
+        RuntimeError("\"send\" expected a channel.");
+        return NULL_VALUE;
+    }
+
+    const char* error;
+    Message* message = MessageNew();
+    if (!MessageWrite(vm, message, arguments[1], &error)) {
+        MessageFree(message);
+        RuntimeError("%s", error);
+        return NULL_VALUE;
+    }
+
+    ChannelSend(AS_CHANNEL(arguments[0])->channel, message);
+    return NULL_VALUE;
+}
+
+static Value ReceiveNative(int argumentCount, Value* arguments) {
+    if (!IS_CHANNEL(arguments[0])) {
+        RuntimeError("\"receive\" expected a channel.");
+        return NULL_VALUE;
+    }
+
+    Message* message = ChannelReceive(AS_CHANNEL(arguments[0])->channel);
+    Value value = MessageValue(message);
+    MessageFree(message);
+    return value;
+}
+
+static Value ParallelMapNative(int argumentCount, Value* arguments) {
+    if (!IS_ARRAY(arguments[0])) {
+        RuntimeError("\"parallelMap\" expected an array.");
+        return NULL_VALUE;
+    }
+
+    Value function = arguments[1];
+    if ((!IS_CLOSURE(function) || AS_CLOSURE(function)->function->arity != 1) && !IS_NATIVE(function)) {
+        RuntimeError("\"parallelMap\" expected a function taking 1 argument.");
+        return NULL_VALUE;
+    }
+
+    ObjArray* results = ArrayNew();
+    Push(vm, OBJECT_VALUE(results));
+
+    const char* error;
+    bool mapped = ParallelMap(AS_ARRAY(arguments[0]), function, results, &error);
+    Pop(vm);
+
+    if (!mapped) {
+        RuntimeError("%s", error);
+        return NULL_VALUE;
+    }
+    return OBJECT_VALUE(results);
+}
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
 static void PrintCallFrame(const CallFrame* frame) {
     ObjFunction* function = frame->closure->function;
     // Figure out the instruction‐pointer offset
     size_t ipOffset = (size_t)(frame->ip - function->chunk.code);
     // Figure out which slot in the VM stack this frame's locals start at
-    int slotIndex = (int)(frame->slots - vm.Stack);
+    int slotIndex = (int)(frame->slots - vm->Stack);
 
     // Print header line
     printf(
@@ -189,60 +547,166 @@ static void PrintCallFrame(const CallFrame* frame) {
     }
     printf("===========================\n");
 }
+#endif
+
+/// @brief Creates an interpreter. Each one has its own heap, globals and natives, and several can be used at once
+/// (from different threads, or one after the other on the same thread).
+/// @return The new VM.
+VM* VMNew() {
+    VM* instance = (VM*)calloc(1, sizeof(VM));
+    if (instance == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the VM.\n");
+        exit(1);
+    }
+
+    VM* previous = vm;
+    vm = instance;
+
+    vm->Stack = (Value*)malloc(sizeof(Value) * STACK_INITIAL);
+    vm->openSlots = (ObjUpvalue**)calloc(STACK_INITIAL, sizeof(ObjUpvalue*));
+    vm->frames = (CallFrame*)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    if (vm->Stack == NULL || vm->openSlots == NULL || vm->frames == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the stack.\n");
+        exit(1);
+    }
 
-void VMInit() {
+    vm->stackCapacity = STACK_INITIAL;
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->maxFrames = DEFAULT_MAX_FRAMES;
+    vm->jitThreshold = JIT_THRESHOLD;
+    vm->traceThreshold = TRACE_THRESHOLD;
     ResetStack();
     srand(time(NULL));
-    vm.objects = NULL;
+    vm->objects = NULL;
 
-    vm.allocatedBytes = 0;
-    vm.nextCollection = 1024 * 1024;
+    vm->allocatedBytes = 0;
+    vm->nextCollection = 1024 * 1024;
 
-    vm.grayCapacity = 0;
-    vm.grayCount = 0;
-    vm.grayStack = NULL;
+    vm->grayCapacity = 0;
+    vm->grayCount = 0;
+    vm->grayStack = NULL;
 
-    vm.safeguardStack = malloc(sizeof(Object*) * 4);
-    if (vm.safeguardStack == NULL)
+    vm->safeguardStack = malloc(sizeof(Object*) * 4);
+    if (vm->safeguardStack == NULL)
         printf("> Failed to allocate safeguard stack.\n");
 
-    TableInit(&vm.strings);
-    TableInit(&vm.globals);
-
-    vm.initString = NULL;
+    TableInit(&vm->strings);
+    TableInit(&vm->globals);
+
+    vm->initString = NULL;
+    vm->nativeCount = 0;
+    vm->fibers = NULL;
+    vm->loop = NULL;
+    vm->fiber = FiberNew(NULL);
+
+    DefineNative("clock", ClockNative, 0, 0)->intrinsic = OP_CLOCK;
+    DefineNative("input", InputNative, NATIVE_VARIADIC, NATIVE_ALLOCATES);
+    DefineNative("exit", ExitNative, NATIVE_VARIADIC, 0);
+    DefineNative("len", LengthNative, 1, 0)->intrinsic = OP_LEN;
+    DefineNative("exec", ExecNative, 1, NATIVE_SUSPENDS);
+    DefineNative("system", SystemNative, 1, 0);
+    DefineNative("fiber", FiberNative, 1, NATIVE_ALLOCATES);
+    DefineNative("done", DoneNative, 1, 0);
+#ifdef THREADS_AVAILABLE
+    DefineNative("spawn", SpawnNative, NATIVE_VARIADIC, NATIVE_ALLOCATES);
+    DefineNative("join", JoinNative, 1, NATIVE_ALLOCATES);
+    DefineNative("channel", ChannelNative, 0, NATIVE_ALLOCATES);
+    DefineNative("send", SendNative, 2, 0);
+    DefineNative("receive", ReceiveNative, 1, NATIVE_ALLOCATES);
+    DefineNative("parallelMap", ParallelMapNative, 2, NATIVE_ALLOCATES);
+#endif
+#ifdef EVENT_LOOP_AVAILABLE
+    DefineNative("sleep", SleepNative, 1, NATIVE_SUSPENDS);
+    DefineNative("readFile", ReadFileNative, 1, NATIVE_SUSPENDS);
+    DefineNative("writeFile", WriteFileNative, 2, NATIVE_SUSPENDS);
+#endif
 
-    DefineNative("clock", ClockNative);
-    DefineNative("input", InputNative);
-    DefineNative("exit", ExitNative);
-    DefineNative("len", LengthNative);
-    DefineNative("exec", ExecNative);
-    DefineNative("system", SystemNative);
+    vm = previous;
+    return instance;
 }
 
-void VMFree() {
-    TableFree(&vm.strings);
-    TableFree(&vm.globals);
-    vm.initString = NULL;
+/// @brief Frees an interpreter and everything it allocated.
+void VMFree(VM* instance) {
+    VM* previous = vm;
+    vm = instance;
+
+#ifdef EVENT_LOOP_AVAILABLE
+    if (vm->loop != NULL)
+        LoopFree(vm->loop);
+    vm->loop = NULL;
+#endif
+
+    TableFree(&vm->strings);
+    TableFree(&vm->globals);
+    vm->initString = NULL;
     FreeObjects();
+
+    free(vm->Stack);
+    free(vm->openSlots);
+    free(vm->frames);
+    vm->Stack = NULL;
+    vm->openSlots = NULL;
+    vm->frames = NULL;
+#ifdef PARALLEL_COMPILE_AVAILABLE
+    if (vm->heapMutexReady)
+        pthread_mutex_destroy(&vm->heapMutex);
+#endif
+
+    free(instance);
+    vm = (previous == instance) ? NULL : previous;
 }
 
-void Push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+/// @brief Sets how deep calls may nest before a stack overflow is reported.
+/// @param instance VM to change.
+/// @param maxFrames New limit (at least 1). Frames already in use are kept even above it.
+void VMSetMaxFrames(VM* instance, int maxFrames) {
+    instance->maxFrames = (maxFrames < 1) ? 1 : maxFrames;
 }
 
-Value Pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+/// @brief Sets how soon code gets translated to native code (where the JIT is available), so that the same
+/// script can be run by the interpreter alone, by the JIT as soon as possible, or anything in between.
+/// @param instance VM to change.
+/// @param jitThreshold Calls before a function is translated, or 0 to never translate functions.
+/// @param traceThreshold Back-edges before a loop is traced, or 0 to never trace loops.
+void VMSetJit(VM* instance, int jitThreshold, int traceThreshold) {
+    instance->jitThreshold = (jitThreshold < 0) ? 0 : jitThreshold;
+    instance->traceThreshold = (traceThreshold < 0) ? 0 : traceThreshold;
 }
 
-Value PopN(int n) {
-    vm.stackTop -= n;
-    return *vm.stackTop;
+/// @brief Pushes a value on a VM's stack (the arguments of InterpretCall, or an object kept from being collected).
+void Push(VM* instance, Value value) {
+    *instance->stackTop = value;
+    instance->stackTop++;
+}
+
+Value Pop(VM* instance) {
+    instance->stackTop--;
+    return *instance->stackTop;
+}
+
+Value PopN(VM* instance, int n) {
+    instance->stackTop -= n;
+    return *instance->stackTop;
 }
 
 static Value Peek(int distance) {
-    return vm.stackTop[-1 - distance];
+    return vm->stackTop[-1 - distance];
+}
+
+/// @brief Reads an RK operand: a slot of the current frame, or a constant when the high bit is set.
+static inline Value ReadRK(CallFrame* frame) {
+    uint8_t operand = *frame->ip++;
+    if (operand & RK_CONSTANT)
+        return frame->closure->function->chunk.constants.values[operand & RK_MAX];
+    return frame->slots[operand];
+}
+
+/// @brief Counts a call to a function, compiling it once it gets hot.
+static inline void CountCall(ObjFunction* function) {
+#ifdef JIT_AVAILABLE
+    if (function->jit == NULL && vm->jitThreshold > 0 && ++function->callCount == vm->jitThreshold)
+        JitCompile(function);
+#endif
 }
 
 static bool Call(ObjClosure* closure, int argumentCount) {
@@ -251,25 +715,152 @@ static bool Call(ObjClosure* closure, int argumentCount) {
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
-        RuntimeError("Stack Overflow. Limit is %d.", FRAMES_MAX);
+    if (!FramesReserve()) {
+        RuntimeError("Stack Overflow. Limit is %d.", vm->maxFrames);
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CountCall(closure->function);
+    StackReserve(vm->stackTop - argumentCount - 1, closure->function->stackSize);
+
+    CallFrame* frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argumentCount - 1;
+    frame->slots = vm->stackTop - argumentCount - 1;
+#ifdef DEBUG_TRACE_EXECUTION
     PrintCallFrame(frame);
+#endif
     return true;
 }
 
+/// @brief [INTERNAL] Resumes a fiber (calling one does that): its caller's stack loses the fiber and the
+/// argument, and gets back whatever the fiber yields or returns once control comes back to it.
+/// @return Whether the fiber could be resumed.
+static bool FiberResume(ObjFiber* fiber, int argumentCount) {
+    if (argumentCount > 1) {
+        RuntimeError("A fiber is resumed with at most 1 argument but got %d.", argumentCount);
+        return false;
+    }
+
+    if (fiber->state == FIBER_DONE) {
+        RuntimeError("Cannot resume a fiber that has finished.");
+        return false;
+    }
+
+    if (fiber->state == FIBER_RUNNING) {
+        RuntimeError("Cannot resume a fiber that is already running.");
+        return false;
+    }
+
+    if (fiber->state == FIBER_WAITING) {
+        RuntimeError("Cannot resume a fiber that is waiting on the event loop.");
+        return false;
+    }
+
+    Value value = (argumentCount == 1) ? Peek(0) : NULL_VALUE;
+    vm->stackTop -= argumentCount + 1;
+
+    bool started = (fiber->state == FIBER_NEW);
+    fiber->caller = vm->fiber;
+    fiber->state = FIBER_RUNNING;
+    FiberSwitch(fiber);
+
+    if (!started) {
+        Push(vm, value);
+        return true;
+    }
+
+    ObjClosure* closure = AS_CLOSURE(vm->Stack[0]);
+    if (closure->function->arity == 1)
+        Push(vm, value);
+    return Call(closure, closure->function->arity);
+}
+
+/// @brief [INTERNAL] Runs whichever fiber the event loop wakes up next, waiting for one if none is ready. The
+/// running fiber is waiting on the loop itself: it either is the one woken up, or becomes the woken one's caller,
+/// to be woken up later.
+/// @return false if the woken fiber's operation failed (which is reported as an error in that fiber).
+static bool FiberSchedule() {
+#ifdef EVENT_LOOP_AVAILABLE
+    LoopOperation* operation = (vm->loop != NULL) ? LoopWait(vm->loop) : NULL;
+#else
+    void* operation = NULL;
+#endif
+
+    // Nothing left to wait on: only a script waiting for its fibers before it ends waits like that.
+    if (operation == NULL) {
+        vm->fiber->state = FIBER_RUNNING;
+        return true;
+    }
+
+#ifdef EVENT_LOOP_AVAILABLE
+    ObjFiber* fiber = operation->fiber;
+    if (fiber != vm->fiber) {
+        fiber->caller = vm->fiber;
+        FiberSwitch(fiber);
+    }
+    fiber->state = FIBER_RUNNING;
+
+    if (operation->error != 0) {
+        RuntimeError("\"%s\" failed: %s.", operation->name, strerror(operation->error));
+        LoopOperationFree(operation);
+        return false;
+    }
+
+    if (operation->kind == LOOP_READ || operation->kind == LOOP_PROCESS)
+        Push(vm, OBJECT_VALUE(StringCopy(operation->buffer != NULL ? operation->buffer : "", (int)operation->length)));
+    else
+        Push(vm, NULL_VALUE);
+
+    // exec gives the command's exit status along with its output.
+    if (operation->kind == LOOP_PROCESS) {
+        ObjArray* result = ArrayNew();
+        Push(vm, OBJECT_VALUE(result));
+        MJ_ArrayAdd(result, Peek(1));
+        MJ_ArrayAdd(result, NUMBER_VALUE(operation->status));
+        PopN(vm, 2);
+        Push(vm, OBJECT_VALUE(result));
+    }
+
+    LoopOperationFree(operation);
+#endif
+    return true;
+}
+
+/// @brief [INTERNAL] Leaves the running fiber for its caller, which gets value. A caller waiting on the event loop
+/// (it only resumed this fiber because the loop woke it up) takes no values, and goes back to waiting instead.
+/// @return Like FiberSchedule.
+static bool FiberReturn(FiberState state, Value value) {
+    ObjFiber* fiber = vm->fiber;
+    FiberLeave(state);
+
+    // A fiber that is done no longer needs its stack (its upvalues were closed). It goes now, while the fiber is
+    // sure to be alive: nothing may reference it anymore, so going back to waiting could collect it.
+    if (state == FIBER_DONE)
+        FiberFreeStack(fiber);
+
+    if (vm->fiber->state == FIBER_WAITING)
+        return FiberSchedule();
+
+    Push(vm, value);
+    return true;
+}
+
+/// @brief [INTERNAL] Called once a native started an operation for the running fiber: a fiber that was resumed
+/// hands null to its caller, and the main fiber waits until the loop wakes something up.
+/// @return Like FiberSchedule.
+static bool FiberWait() {
+    if (vm->fiber->caller != NULL)
+        return FiberReturn(FIBER_WAITING, NULL_VALUE);
+    return FiberSchedule();
+}
+
 static bool CallValue(Value callee, int argumentCount) {
     if (IS_OBJECT(callee)) {
         switch (OBJECT_TYPE(callee)) {
             case OBJ_CLASS: {
                 ObjClass* class = AS_CLASS(callee);
-                vm.stackTop[-argumentCount - 1] = OBJECT_VALUE(InstanceNew(class));
+                vm->stackTop[-argumentCount - 1] = OBJECT_VALUE(InstanceNew(class));
                 if (IS_CLOSURE(class->constructor)) {
                     return Call(AS_CLOSURE(class->constructor), argumentCount);
                 } else if (argumentCount != 0) {
@@ -279,19 +870,33 @@ static bool CallValue(Value callee, int argumentCount) {
                 return true;
             }
             case OBJ_NATIVE: {
-                NativeFn Native = AS_NATIVE(callee);
-                Value Result = Native(argumentCount, vm.stackTop - argumentCount);
-                vm.stackTop -= argumentCount + 1;
-                Push(Result);
+                ObjNative* native = AS_NATIVE(callee);
+                if (native->arity != NATIVE_VARIADIC && native->arity != argumentCount) {
+                    RuntimeError("\"%s\" expected %d arguments but got %d instead.", native->name->chars, native->arity, argumentCount);
+                    return false;
+                }
+
+                Value result = native->function(argumentCount, vm->stackTop - argumentCount);
+
+                // A native that reported an error has already reset the stack.
+                if (vm->frameCount == 0)
+                    return false;
+
+                vm->stackTop -= argumentCount + 1;
+                if (vm->fiber->state == FIBER_WAITING)
+                    return FiberWait();
+                Push(vm, result);
                 return true;
             }
             case OBJ_CLOSURE: 
                 return Call(AS_CLOSURE(callee), argumentCount);
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-                vm.stackTop[-argumentCount - 1] = bound->receiver;
+                vm->stackTop[-argumentCount - 1] = bound->receiver;
                 return Call(bound->method, argumentCount);
             }
+            case OBJ_FIBER:
+                return FiberResume(AS_FIBER(callee), argumentCount);
             default:
                 break;
         }
@@ -300,10 +905,71 @@ static bool CallValue(Value callee, int argumentCount) {
     return false;
 }
 
+/// @brief [INTERNAL] Runs OP_CALL_NATIVE: the compiler already matched the arity, and there is no callee below the
+/// arguments. If the native's global has been assigned since, whatever it holds now is called instead.
+/// @return Whether the call succeeded.
+static bool CallNative(ObjNative* native, int argumentCount) {
+    if (!native->shadowed) {
+        Value result = native->function(argumentCount, vm->stackTop - argumentCount);
+        if (vm->frameCount == 0)
+            return false;
+
+        vm->stackTop -= argumentCount;
+        if (vm->fiber->state == FIBER_WAITING)
+            return FiberWait();
+        Push(vm, result);
+        return true;
+    }
+
+    Value callee;
+    if (!TableGet(&vm->globals, native->name, &callee)) {
+        RuntimeError("Global variable '%s' not set before reading it.", native->name->chars);
+        return false;
+    }
+
+    // Slide the arguments up to make room for the callee, as OP_GET_GLOBAL would have left it.
+    Value* arguments = vm->stackTop - argumentCount;
+    memmove(arguments + 1, arguments, sizeof(Value) * argumentCount);
+    arguments[0] = callee;
+    vm->stackTop++;
+    return CallValue(callee, argumentCount);
+}
+
+/// @brief [INTERNAL] Looks a method up by its name's vtable slot, or in the methods table if another name has
+/// that slot in this class.
+static inline bool FindMethod(ObjClass* class, ObjString* name, Value* method) {
+    int slot = name->methodSlot;
+    if (slot >= 0 && slot < class->vtable.count && AS_OBJECT(class->methodNames.values[slot]) == (Object*)name) {
+        *method = class->vtable.values[slot];
+        return true;
+    }
+
+    return TableGet(&class->methods, name, method);
+}
+
+/// @brief [INTERNAL] Puts a method in a class's vtable, growing it up to the slot if needed.
+static void VtableSet(ObjClass* class, int slot, ObjString* name, Value method) {
+    while (class->vtable.count <= slot) {
+        ValueArrayWrite(&class->vtable, NULL_VALUE);
+        ValueArrayWrite(&class->methodNames, NULL_VALUE);
+    }
+
+    class->vtable.values[slot] = method;
+    class->methodNames.values[slot] = OBJECT_VALUE(name);
+}
+
+/// @brief [INTERNAL] Finds the first slot of a class's vtable that no method has taken yet.
+static int VtableFreeSlot(ObjClass* class) {
+    int slot = 0;
+    while (slot < class->vtable.count && !IS_NULL(class->vtable.values[slot]))
+        slot++;
+    return slot;
+}
+
 static bool InvokeFromClass(ObjClass* class, ObjString* name, int argumentCount) {
     Value method;
 
-    if (!TableGet(&class->methods, name, &method)) {
+    if (!FindMethod(class, name, &method)) {
         RuntimeError("\"%s\" object has no property \"%s\".", class->className->chars, name->chars);
         return false;
     }
@@ -323,76 +989,147 @@ static bool Invoke(ObjString* name, int argumentCount) {
 
     Value value;
     if (TableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argumentCount - 1] = value;
+        vm->stackTop[-argumentCount - 1] = value;
         return CallValue(value, argumentCount);
     }
 
     return InvokeFromClass(instance->class, name, argumentCount);
 }
 
+/// @brief [INTERNAL] Replaces the instance on top of the stack with one of its class's methods bound to it.
+/// Bound methods are kept on the instance, so taking the same method off it again reuses the same object.
 static bool BindMethod(ObjClass* class, ObjString* name) {
     Value method;
 
-    if (!TableGet(&class->methods, name, &method)) {
+    if (!FindMethod(class, name, &method)) {
         RuntimeError("\"%s\" object has no property \"%s\".", class->className->chars, name->chars);
         return false;
     }
 
+    ObjInstance* instance = AS_INSTANCE(Peek(0));
+    Value cached;
+
+    // The entry can hold the other method of that name when both this.name and super.name get bound.
+    if (TableGet(&instance->boundMethods, name, &cached) && AS_BOUND_METHOD(cached)->method == AS_CLOSURE(method)) {
+        vm->stackTop[-1] = cached;
+        return true;
+    }
+
     ObjBoundMethod* bound = BoundMethodNew(Peek(0), AS_CLOSURE(method));
+    Push(vm, OBJECT_VALUE(bound));
+    TableSet(&instance->boundMethods, name, OBJECT_VALUE(bound));
 
-    Pop();
-    Push(OBJECT_VALUE(bound));
+    Pop(vm);
+    vm->stackTop[-1] = OBJECT_VALUE(bound);
     return true;
 }
 
+/// @brief [INTERNAL] Gets the open upvalue for a local of the current frame, creating it if needed.
 static ObjUpvalue* CaptureUpvalue(Value* local) {
-    ObjUpvalue* previousUpvalue = NULL;
-    ObjUpvalue* Upvalue = vm.openUpvalues;
-    while (Upvalue != NULL && Upvalue->location > local) {
-        previousUpvalue = Upvalue;
-        Upvalue = Upvalue->next;
-    }
-
-    if (Upvalue != NULL && Upvalue->location == local) 
-        return Upvalue;
+    ObjUpvalue** open = &vm->openSlots[local - vm->Stack];
+    if (*open != NULL)
+        return *open;
 
+    // Only the top frame captures, so pushing to the front keeps each frame's upvalues ahead of the frames below.
     ObjUpvalue* createdUpvalue = UpvalueNew(local);
+    createdUpvalue->next = vm->openUpvalues;
+    if (vm->openUpvalues != NULL)
+        vm->openUpvalues->previous = createdUpvalue;
 
-    createdUpvalue->next = Upvalue;
-    if (previousUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
-    }
-    else {
-        previousUpvalue->next = createdUpvalue;
-    }
-
+    vm->openUpvalues = createdUpvalue;
+    *open = createdUpvalue;
     return createdUpvalue;
 }
 
+/// @brief [INTERNAL] Moves an open upvalue's value off the stack and into the upvalue.
+static void CloseUpvalue(ObjUpvalue* Upvalue) {
+    vm->openSlots[Upvalue->location - vm->Stack] = NULL;
+
+    if (Upvalue->previous != NULL)
+        Upvalue->previous->next = Upvalue->next;
+    else
+        vm->openUpvalues = Upvalue->next;
+    if (Upvalue->next != NULL)
+        Upvalue->next->previous = Upvalue->previous;
+
+    Upvalue->next = NULL;
+    Upvalue->previous = NULL;
+    Upvalue->closed = *Upvalue->location;
+    Upvalue->location = &Upvalue->closed;
+}
+
+/// @brief [INTERNAL] Closes the upvalues of every slot from last up, which all belong to the top frame.
 static void CloseUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* Upvalue = vm.openUpvalues;
-        Upvalue->closed = *Upvalue->location;
-        Upvalue->location = &Upvalue->closed;
-        vm.openUpvalues = Upvalue->next;
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last)
+        CloseUpvalue(vm->openUpvalues);
+}
+
+/// @brief Calls a value from tail position, reusing the current frame when the callee is a function.
+/// Anything else (natives, classes) gets an ordinary call, and the OP_RETURN after the call returns its result.
+/// @param frame The frame making the call.
+/// @param callee Value being called.
+/// @param argumentCount Number of arguments on top of the stack.
+/// @return Whether the call succeeded.
+static bool TailCallValue(CallFrame* frame, Value callee, int argumentCount) {
+    ObjClosure* closure;
+
+    // A closure made on the stack points into the frame it would replace.
+    if (IS_CLOSURE(callee) && !AS_CLOSURE(callee)->onStack) {
+        closure = AS_CLOSURE(callee);
+    } else if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argumentCount - 1] = bound->receiver;
+        closure = bound->method;
+    } else {
+        return CallValue(callee, argumentCount);
     }
+
+    if (argumentCount != closure->function->arity) {
+        RuntimeError("Expected %d arguments but got %d instead.", closure->function->arity, argumentCount);
+        return false;
+    }
+
+    CountCall(closure->function);
+    StackReserve(frame->slots, closure->function->stackSize);
+
+    // The caller's locals are dead from here on: close over them, then slide the callee and its arguments down.
+    CloseUpvalues(frame->slots);
+    Value* calleeSlot = vm->stackTop - argumentCount - 1;
+    memmove(frame->slots, calleeSlot, sizeof(Value) * (argumentCount + 1));
+    vm->stackTop = frame->slots + argumentCount + 1;
+
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
 }
 
-static bool DefineMethod(ObjString* name) {
+static void DefineMethod(ObjString* name) {
     Value method = Peek(0);
     ObjClass* class = AS_CLASS(Peek(1));
 
-    if (strcmp(name->chars, class->className->chars) == 0) {
-        if (!IS_NULL(class->constructor)) {
-            RuntimeError("Duplicate constructor defined for class \"%s\".", class->className->chars);
-            return false;
-        }
-        class->constructor = method;
-    } else {
-        TableSet(&class->methods, name, method);
+    // A name gets the first slot free in the first class defining it. Names that no class has both of end up
+    // sharing slots, so vtables stay about as long as the most methods a class has. A class that has both takes
+    // the second one from its methods table.
+    if (name->methodSlot == -1)
+        name->methodSlot = VtableFreeSlot(class);
+
+    int slot = name->methodSlot;
+    TableSet(&class->methods, name, method);
+    if (slot >= class->vtable.count || IS_NULL(class->vtable.values[slot]) ||
+        AS_OBJECT(class->methodNames.values[slot]) == (Object*)name)
+        VtableSet(class, slot, name, method);
+    Pop(vm);
+}
+
+static bool DefineConstructor() {
+    ObjClass* class = AS_CLASS(Peek(1));
+
+    if (!IS_NULL(class->constructor)) {
+        RuntimeError("Duplicate constructor defined for class \"%s\".", class->className->chars);
+        return false;
     }
 
-    Pop();
+    class->constructor = Pop(vm);
     return true;
 }
 
@@ -412,12 +1149,27 @@ static void Concatenate() {
     chars[length] = '\0';
 
     ObjString* Result = StringTake(chars, length);
-    PopN(2);
-    Push(OBJECT_VALUE(Result));
+    PopN(vm, 2);
+    Push(vm, OBJECT_VALUE(Result));
 }
 
-static InterpretResult Run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+/// @brief Runs bytecode until the script returns.
+/// @param singleStep If true, only the instruction at the top frame's ip is run (this is how native code runs its slow paths).
+static InterpretResult Run(bool singleStep) {
+    CallFrame* frame;
+#ifdef JIT_AVAILABLE
+    // Whenever the top frame changes, compiled functions continue natively.
+    #define LOAD_FRAME() \
+        do { \
+            frame = &vm->frames[vm->frameCount - 1]; \
+            if (!singleStep && frame->closure->function->jit != NULL) \
+                goto runNative; \
+        } while (false)
+#else
+    #define LOAD_FRAME() (frame = &vm->frames[vm->frameCount - 1])
+#endif
+    LOAD_FRAME();
+
     #define READ_BYTE() (*frame->ip++)
     #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
     #define READ_CONSTANT_LONG() (frame->closure->function->chunk.constants.values[(READ_BYTE() << 24) + (READ_BYTE() << 16) + (READ_BYTE() << 8) + READ_BYTE()])
@@ -429,18 +1181,58 @@ static InterpretResult Run() {
                 RuntimeError("Operands must be numbers."); \
                 return RUNTIME_ERROR(NULL_VALUE); \
             } \
-            Value first = Pop(); \
-            Value second = Pop(); \
+            Value first = Pop(vm); \
+            Value second = Pop(vm); \
             double b = (IS_BOOL(first)) ? (double)AS_BOOL(first) : AS_NUMBER(first); \
             double a = (IS_BOOL(second)) ? (double)AS_BOOL(second) : AS_NUMBER(second); \
-            Push(ValueType(a op b)); \
+            Push(vm, ValueType(a op b)); \
+        } while (false)
+    // Rewrites the generic instruction that was just read into its number-only form.
+    #define QUICKEN(length, fastOp, a, b) \
+        do { \
+            if (IS_NUMBER(a) && IS_NUMBER(b)) \
+                frame->ip[-(length)] = fastOp; \
+        } while (false)
+    // Number-only stack op. If the guard fails, the instruction goes back to its generic form and runs again.
+    #define NUMBER_OP(genericOp, ValueType, op) \
+        do { \
+            Value b = Peek(0); \
+            Value a = Peek(1); \
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+                frame->ip[-1] = genericOp; \
+                frame->ip--; \
+                break; \
+            } \
+            vm->stackTop[-2] = ValueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+            vm->stackTop--; \
+        } while (false)
+    #define NUMBER_RK_OP(genericOp, ValueType, op) \
+        do { \
+            Value a = ReadRK(frame); \
+            Value b = ReadRK(frame); \
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+                frame->ip -= 3; \
+                frame->ip[0] = genericOp; \
+                break; \
+            } \
+            Push(vm, ValueType(AS_NUMBER(a) op AS_NUMBER(b))); \
+        } while (false)
+    #define REGISTER_OP(ValueType, op, a, b) \
+        do { \
+            if ((!IS_NUMBER(a) && !IS_BOOL(a)) || (!IS_NUMBER(b) && !IS_BOOL(b))) { \
+                RuntimeError("Operands must be numbers."); \
+                return RUNTIME_ERROR(NULL_VALUE); \
+            } \
+            double left = (IS_BOOL(a)) ? (double)AS_BOOL(a) : AS_NUMBER(a); \
+            double right = (IS_BOOL(b)) ? (double)AS_BOOL(b) : AS_NUMBER(b); \
+            Push(vm, ValueType(left op right)); \
         } while (false)
 
     for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
         printf("( ");
-        for (Value* Slot = vm.Stack; Slot < vm.stackTop; Slot++) {
+        for (Value* Slot = vm->Stack; Slot < vm->stackTop; Slot++) {
             printf("[");
             ValuePrint(*Slot);
             printf(" ]");
@@ -453,46 +1245,48 @@ static InterpretResult Run() {
         switch(Instruction = READ_BYTE()) {
             case OP_CONSTANT: {
                 Value Constant = READ_CONSTANT();
-                Push(Constant);
+                Push(vm, Constant);
                 break;
             }
             case OP_CONSTANT_LONG: {
                 Value Constant = READ_CONSTANT_LONG();
-                Push(Constant);
+                Push(vm, Constant);
                 break;
             }
-            case OP_NULL:       Push(NULL_VALUE);           break;
-            case OP_TRUE:       Push(BOOL_VALUE(true));     break;
-            case OP_FALSE:      Push(BOOL_VALUE(false));    break;
-            case OP_MAYBE:      Push(BOOL_VALUE((bool)(rand() % 2))); break;
+            case OP_NULL:       Push(vm, NULL_VALUE);           break;
+            case OP_TRUE:       Push(vm, BOOL_VALUE(true));     break;
+            case OP_FALSE:      Push(vm, BOOL_VALUE(false));    break;
+            case OP_MAYBE:      Push(vm, BOOL_VALUE((bool)(rand() % 2))); break;
             case OP_POP: {
-                Pop();
+                Pop(vm);
                 break;
             }
-            case OP_DUPLICATE:  Push(Peek(0));              break;
+            case OP_DUPLICATE:  Push(vm, Peek(0));              break;
             case OP_DEFINE_GLOBAL: {
                 ObjString* name = READ_STRING();
-                TableSet(&vm.globals, name, Peek(0));
-                Pop();
+                ShadowNative(name);
+                TableSet(&vm->globals, name, Peek(0));
+                Pop(vm);
                 break;
             }
             case OP_GET_GLOBAL: {
                 ObjString* name = READ_STRING();
                 Value value;
-                if (!TableGet(&vm.globals, name, &value)) {
+                if (!TableGet(&vm->globals, name, &value)) {
                     RuntimeError("Global variable '%s' not set before reading it.", name->chars);
                     return RUNTIME_ERROR(NULL_VALUE);
                 }
-                Push(value);
+                Push(vm, value);
                 break;
             }
             case OP_SET_GLOBAL: {
                 ObjString* name = READ_STRING();
-                if (TableSet(&vm.globals, name, Peek(0))) {
-                    TableDelete(&vm.globals, name);
+                if (TableSet(&vm->globals, name, Peek(0))) {
+                    TableDelete(&vm->globals, name);
                     RuntimeError("Global variable '%s' not set before reading it.", name->chars);
                     return RUNTIME_ERROR(NULL_VALUE);
                 }
+                ShadowNative(name);
                 break;
             }
             case OP_SET_LOCAL: {
@@ -502,7 +1296,7 @@ static InterpretResult Run() {
             }
             case OP_GET_LOCAL: {
                 uint8_t Slot = READ_BYTE();
-                Push(frame->slots[Slot]);
+                Push(vm, frame->slots[Slot]);
                 break;
             }
             case OP_SET_INDEX: {
@@ -532,10 +1326,14 @@ static InterpretResult Run() {
                         }
                         break;
                     }
+
+                    default:
+                        RuntimeError("Only arrays and maps can be indexed.");
+                        return RUNTIME_ERROR(NULL_VALUE);
                 }
                 
-                PopN(3);    // We pop out the value, the index and the list from the stack.
-                Push(value);
+                PopN(vm, 3);    // We pop out the value, the index and the list from the stack.
+                Push(vm, value);
                 break;
             }
             case OP_GET_INDEX: {
@@ -563,10 +1361,14 @@ static InterpretResult Run() {
                         }
                         break;
                     }
+
+                    default:
+                        RuntimeError("Only arrays and maps can be indexed.");
+                        return RUNTIME_ERROR(NULL_VALUE);
                 }
 
-                PopN(2);
-                Push(value);
+                PopN(vm, 2);
+                Push(vm, value);
                 break;
             }
             case OP_GET_INDEX_RANGED: {
@@ -582,8 +1384,8 @@ static InterpretResult Run() {
                     return RUNTIME_ERROR(NULL_VALUE);
                 }
 
-                PopN(3);
-                Push(newArray);
+                PopN(vm, 3);
+                Push(vm, newArray);
                 break;
             }
             case OP_SET_UPVALUE: {
@@ -593,7 +1395,7 @@ static InterpretResult Run() {
             }
             case OP_GET_UPVALUE: {
                 uint8_t Slot = READ_BYTE();
-                Push(*frame->closure->upvalues[Slot]->location);
+                Push(vm, *frame->closure->upvalues[Slot]->location);
                 break;
             }
             case OP_INIT_PROPERTY: {
@@ -615,7 +1417,7 @@ static InterpretResult Run() {
                 }
 
                 TableSet(&class->defaultFields, string, Peek(0));
-                Pop();
+                Pop(vm);
                 break;
             }
             case OP_SET_PROPERTY: {
@@ -637,9 +1439,9 @@ static InterpretResult Run() {
                 }
 
                 TableSet(&instance->fields, string, Peek(0));
-                Value value = Pop();
-                Pop();
-                Push(value);
+                Value value = Pop(vm);
+                Pop(vm);
+                Push(vm, value);
                 break;
             }
             case OP_GET_PROPERTY: {
@@ -653,8 +1455,8 @@ static InterpretResult Run() {
 
                 Value value;
                 if (TableGet(&instance->fields, name, &value)) {
-                    Pop();
-                    Push(value);
+                    Pop(vm);
+                    Push(vm, value);
                     break;
                 }
 
@@ -665,7 +1467,7 @@ static InterpretResult Run() {
             }
             case OP_GET_SUPER: {
                 ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(Pop());
+                ObjClass* superclass = AS_CLASS(Pop(vm));
 
                 if (!BindMethod(superclass, name)) {
                     return RUNTIME_ERROR(NULL_VALUE);
@@ -673,27 +1475,33 @@ static InterpretResult Run() {
                 break;
             }
             case OP_EQUAL: {
-                Value b = Pop();
-                Value a = Pop();
-                Push(BOOL_VALUE(ValuesEqual(a, b)));
+                Value b = Pop(vm);
+                Value a = Pop(vm);
+                Push(vm, BOOL_VALUE(ValuesEqual(a, b)));
                 break;   
             }
             case OP_NOT_EQUAL: {
-                Value b = Pop();
-                Value a = Pop();
-                Push(BOOL_VALUE(!ValuesEqual(a, b)));
+                Value b = Pop(vm);
+                Value a = Pop(vm);
+                Push(vm, BOOL_VALUE(!ValuesEqual(a, b)));
                 break;
             }
-            case OP_GREATER:    BINARY_OP(BOOL_VALUE, >);   break;
-            case OP_SMALLER:    BINARY_OP(BOOL_VALUE, <);   break;
+            case OP_GREATER:
+                QUICKEN(1, OP_GREATER_NUM, Peek(1), Peek(0));
+                BINARY_OP(BOOL_VALUE, >);
+                break;
+            case OP_SMALLER:
+                QUICKEN(1, OP_SMALLER_NUM, Peek(1), Peek(0));
+                BINARY_OP(BOOL_VALUE, <);
+                break;
             case OP_GREATER_EQ: {
                 Value b = Peek(0);
                 Value a = Peek(1);
                 bool valuesAreEqual = ValuesEqual(a, b);
                 if (valuesAreEqual) {
-                    Pop();
-                    Pop();
-                    Push(BOOL_VALUE(valuesAreEqual));
+                    Pop(vm);
+                    Pop(vm);
+                    Push(vm, BOOL_VALUE(valuesAreEqual));
                     break;
                 }
 
@@ -705,9 +1513,9 @@ static InterpretResult Run() {
                 Value a = Peek(1);
                 bool valuesAreEqual = ValuesEqual(a, b);
                 if (valuesAreEqual) {
-                    Pop();
-                    Pop();
-                    Push(BOOL_VALUE(valuesAreEqual));
+                    Pop(vm);
+                    Pop(vm);
+                    Push(vm, BOOL_VALUE(valuesAreEqual));
                     break;
                 }
 
@@ -718,17 +1526,17 @@ static InterpretResult Run() {
                 Value b = Peek(0);
                 Value a = Peek(1);
 
+                PopN(vm, 2);
                 if ((!IS_OBJECT(a) || !IS_OBJECT(b)) || (IS_STRING(a) && IS_STRING(b))) {
-                    Push(BOOL_VALUE(ValuesEqual(a, b)));
+                    Push(vm, BOOL_VALUE(ValuesEqual(a, b)));
                     break;
                 }
 
                 if (OBJECT_TYPE(a) != OBJECT_TYPE(b)) {
-                    Push(BOOL_VALUE(false));
+                    Push(vm, BOOL_VALUE(false));
                     break;
                 }
-                PopN(2);
-                Push(BOOL_VALUE(&AS_OBJECT(a) > &AS_OBJECT(b)));
+                Push(vm, BOOL_VALUE(&AS_OBJECT(a) > &AS_OBJECT(b)));
                 break;
             }
             case OP_ADD: {
@@ -736,6 +1544,7 @@ static InterpretResult Run() {
                     Concatenate();
                     break;
                 }
+                QUICKEN(1, OP_ADD_NUM, Peek(1), Peek(0));
                 BINARY_OP(NUMBER_VALUE, +);
                 break;
             }
@@ -745,9 +1554,9 @@ static InterpretResult Run() {
                     return RUNTIME_ERROR(NULL_VALUE);
                 }
                 Value a = Peek(0);
-                Pop();
-                Push(a);
-                Push(NUMBER_VALUE(AS_NUMBER(a) + 1));
+                Pop(vm);
+                Push(vm, a);
+                Push(vm, NUMBER_VALUE(AS_NUMBER(a) + 1));
                 break;
             }
             case OP_PREINCREASE: {
@@ -758,12 +1567,15 @@ static InterpretResult Run() {
 
                 Value a = Peek(0);
                 Value b = NUMBER_VALUE(AS_NUMBER(a) + 1);
-                Pop();
-                Push(b);
-                Push(b);
+                Pop(vm);
+                Push(vm, b);
+                Push(vm, b);
                 break;
             }
-            case OP_SUBTRACT:   BINARY_OP(NUMBER_VALUE, -); break;
+            case OP_SUBTRACT:
+                QUICKEN(1, OP_SUBTRACT_NUM, Peek(1), Peek(0));
+                BINARY_OP(NUMBER_VALUE, -);
+                break;
             case OP_POSTDECREASE: {
                 if (!IS_NUMBER(Peek(0))) {
                     RuntimeError("Cannot post-decrease a variable with a non-number value.");
@@ -771,7 +1583,7 @@ static InterpretResult Run() {
                 }
 
                 Value a = Peek(0);
-                Push(NUMBER_VALUE(AS_NUMBER(a) - 1));
+                Push(vm, NUMBER_VALUE(AS_NUMBER(a) - 1));
                 break;   
             }
             case OP_PREDECREASE: {
@@ -782,13 +1594,19 @@ static InterpretResult Run() {
 
                 Value a = Peek(0);
                 Value b = NUMBER_VALUE(AS_NUMBER(a) - 1);
-                Pop();
-                Push(b);
-                Push(b);
+                Pop(vm);
+                Push(vm, b);
+                Push(vm, b);
                 break;
             }
-            case OP_MULTIPLY:   BINARY_OP(NUMBER_VALUE, *); break;
-            case OP_DIVIDE:     BINARY_OP(NUMBER_VALUE, /); break;
+            case OP_MULTIPLY:
+                QUICKEN(1, OP_MULTIPLY_NUM, Peek(1), Peek(0));
+                BINARY_OP(NUMBER_VALUE, *);
+                break;
+            case OP_DIVIDE:
+                QUICKEN(1, OP_DIVIDE_NUM, Peek(1), Peek(0));
+                BINARY_OP(NUMBER_VALUE, /);
+                break;
             case OP_MOD: {
                 Value a = Peek(0);
                 Value b = Peek(1);
@@ -800,8 +1618,8 @@ static InterpretResult Run() {
 
                 double result = fmod(AS_NUMBER(b), AS_NUMBER(a));
 
-                PopN(2);
-                Push(NUMBER_VALUE(result));
+                PopN(vm, 2);
+                Push(vm, NUMBER_VALUE(result));
 
                 break;
             }
@@ -831,8 +1649,8 @@ static InterpretResult Run() {
 
                 int result = (int)aBytes & (int)bBytes;
 
-                PopN(2);
-                Push(NUMBER_VALUE(result));
+                PopN(vm, 2);
+                Push(vm, NUMBER_VALUE(result));
                 break;
             }
             case OP_BITWISE_OR: {
@@ -846,11 +1664,71 @@ static InterpretResult Run() {
 
                 int result = (int)floor(AS_NUMBER(a)) | (int)floor(AS_NUMBER(b));
 
-                PopN(2);
-                Push(NUMBER_VALUE(result));
+                PopN(vm, 2);
+                Push(vm, NUMBER_VALUE(result));
                 break;
             }
-            case OP_NOT:        Push(BOOL_VALUE(IsFalsey(Pop()))); break;
+            case OP_ADD_RK: {
+                Value a = ReadRK(frame);
+                Value b = ReadRK(frame);
+                if (IS_STRING(a) && IS_STRING(b)) {
+                    Push(vm, a);
+                    Push(vm, b);
+                    Concatenate();
+                    break;
+                }
+                QUICKEN(3, OP_ADD_RK_NUM, a, b);
+                REGISTER_OP(NUMBER_VALUE, +, a, b);
+                break;
+            }
+            case OP_SUBTRACT_RK: {
+                Value a = ReadRK(frame);
+                Value b = ReadRK(frame);
+                QUICKEN(3, OP_SUBTRACT_RK_NUM, a, b);
+                REGISTER_OP(NUMBER_VALUE, -, a, b);
+                break;
+            }
+            case OP_MULTIPLY_RK: {
+                Value a = ReadRK(frame);
+                Value b = ReadRK(frame);
+                QUICKEN(3, OP_MULTIPLY_RK_NUM, a, b);
+                REGISTER_OP(NUMBER_VALUE, *, a, b);
+                break;
+            }
+            case OP_DIVIDE_RK: {
+                Value a = ReadRK(frame);
+                Value b = ReadRK(frame);
+                QUICKEN(3, OP_DIVIDE_RK_NUM, a, b);
+                REGISTER_OP(NUMBER_VALUE, /, a, b);
+                break;
+            }
+            case OP_GREATER_RK: {
+                Value a = ReadRK(frame);
+                Value b = ReadRK(frame);
+                QUICKEN(3, OP_GREATER_RK_NUM, a, b);
+                REGISTER_OP(BOOL_VALUE, >, a, b);
+                break;
+            }
+            case OP_SMALLER_RK: {
+                Value a = ReadRK(frame);
+                Value b = ReadRK(frame);
+                QUICKEN(3, OP_SMALLER_RK_NUM, a, b);
+                REGISTER_OP(BOOL_VALUE, <, a, b);
+                break;
+            }
+            case OP_ADD_NUM:            NUMBER_OP(OP_ADD, NUMBER_VALUE, +);             break;
+            case OP_SUBTRACT_NUM:       NUMBER_OP(OP_SUBTRACT, NUMBER_VALUE, -);        break;
+            case OP_MULTIPLY_NUM:       NUMBER_OP(OP_MULTIPLY, NUMBER_VALUE, *);        break;
+            case OP_DIVIDE_NUM:         NUMBER_OP(OP_DIVIDE, NUMBER_VALUE, /);          break;
+            case OP_GREATER_NUM:        NUMBER_OP(OP_GREATER, BOOL_VALUE, >);           break;
+            case OP_SMALLER_NUM:        NUMBER_OP(OP_SMALLER, BOOL_VALUE, <);           break;
+            case OP_ADD_RK_NUM:         NUMBER_RK_OP(OP_ADD_RK, NUMBER_VALUE, +);       break;
+            case OP_SUBTRACT_RK_NUM:    NUMBER_RK_OP(OP_SUBTRACT_RK, NUMBER_VALUE, -);  break;
+            case OP_MULTIPLY_RK_NUM:    NUMBER_RK_OP(OP_MULTIPLY_RK, NUMBER_VALUE, *);  break;
+            case OP_DIVIDE_RK_NUM:      NUMBER_RK_OP(OP_DIVIDE_RK, NUMBER_VALUE, /);    break;
+            case OP_GREATER_RK_NUM:     NUMBER_RK_OP(OP_GREATER_RK, BOOL_VALUE, >);     break;
+            case OP_SMALLER_RK_NUM:     NUMBER_RK_OP(OP_SMALLER_RK, BOOL_VALUE, <);     break;
+            case OP_NOT:        Push(vm, BOOL_VALUE(IsFalsey(Pop(vm)))); break;
             case OP_NEGATE: {
                 bool isNum = IS_NUMBER(Peek(0));
                 bool isBool = IS_BOOL(Peek(0));
@@ -858,12 +1736,12 @@ static InterpretResult Run() {
                     RuntimeError("Type %s cannot be negated.");
                     return RUNTIME_ERROR(NULL_VALUE);
                 }
-                Value popedValue = Pop();
-                Push(NUMBER_VALUE((isNum) ? -AS_NUMBER(popedValue) : -(double)(AS_BOOL(popedValue))));
+                Value popedValue = Pop(vm);
+                Push(vm, NUMBER_VALUE((isNum) ? -AS_NUMBER(popedValue) : -(double)(AS_BOOL(popedValue))));
             } 
             break;
             case OP_PRINT: {
-                ValuePrint(Pop());
+                ValuePrint(Pop(vm));
                 printf("\n");
                 break;
             }
@@ -881,6 +1759,22 @@ static InterpretResult Run() {
             case OP_LOOP: {
                 uint16_t Offset = READ_SHORT();
                 frame->ip -= Offset;
+#ifdef JIT_AVAILABLE
+                if (singleStep)
+                    break;
+
+                switch (TraceLoop(frame)) {
+                    case JIT_ERROR:
+                        return RUNTIME_ERROR(NULL_VALUE);
+                    case JIT_EXIT:
+                        if (vm->frameCount == 0)
+                            return RUNTIME_OK(NULL_VALUE);
+                        LOAD_FRAME();
+                        break;
+                    default:
+                        break;
+                }
+#endif
                 break;
             }
             case OP_CALL: {
@@ -888,7 +1782,59 @@ static InterpretResult Run() {
                 if (!CallValue(Peek(argumentCount), argumentCount))
                     return RUNTIME_ERROR(NULL_VALUE);
                 
-                frame = &vm.frames[vm.frameCount - 1];
+                LOAD_FRAME();
+                break;
+            }
+            case OP_TAIL_CALL: {
+                int argumentCount = READ_BYTE();
+                if (!TailCallValue(frame, Peek(argumentCount), argumentCount))
+                    return RUNTIME_ERROR(NULL_VALUE);
+
+                LOAD_FRAME();
+                break;
+            }
+            case OP_CALL_NATIVE: {
+                ObjNative* native = vm->natives[READ_BYTE()];
+                int argumentCount = READ_BYTE();
+
+                if (!CallNative(native, argumentCount))
+                    return RUNTIME_ERROR(NULL_VALUE);
+
+                LOAD_FRAME();
+                break;
+            }
+            case OP_LEN: {
+                ObjNative* native = vm->natives[READ_BYTE()];
+                Value value = Peek(0);
+
+                if (!native->shadowed && IS_ARRAY(value)) {
+                    vm->stackTop[-1] = NUMBER_VALUE(AS_ARRAY(value)->items.count);
+                    break;
+                }
+                if (!native->shadowed && IS_STRING(value)) {
+                    vm->stackTop[-1] = NUMBER_VALUE(AS_STRING(value)->length);
+                    break;
+                }
+
+                // Errors (and a reassigned len) are the native's business.
+                if (!CallNative(native, 1))
+                    return RUNTIME_ERROR(NULL_VALUE);
+
+                LOAD_FRAME();
+                break;
+            }
+            case OP_CLOCK: {
+                ObjNative* native = vm->natives[READ_BYTE()];
+
+                if (!native->shadowed) {
+                    Push(vm, NUMBER_VALUE((double)clock() / CLOCKS_PER_SEC));
+                    break;
+                }
+
+                if (!CallNative(native, 0))
+                    return RUNTIME_ERROR(NULL_VALUE);
+
+                LOAD_FRAME();
                 break;
             }
             case OP_INVOKE: {
@@ -899,38 +1845,40 @@ static InterpretResult Run() {
                     return RUNTIME_ERROR(NULL_VALUE);
                 }
 
-                frame = &vm.frames[vm.frameCount - 1];
+                LOAD_FRAME();
                 break;
             }
             case OP_SUPER_INVOKE: {
                 ObjString* method = READ_STRING();
                 int argumentCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(Pop());
+                ObjClass* superclass = AS_CLASS(Pop(vm));
 
-                if (strcmp(method->chars, "super") == 0) {
-                    if (!IS_CLOSURE(superclass->constructor)) {
-                        RuntimeError("Cannot call super since superclass has no constructor");
-                        return RUNTIME_ERROR(NULL_VALUE);
-                    }
-                    
-                    if (!Call(AS_CLOSURE(superclass->constructor), argumentCount)) {
-                        return RUNTIME_ERROR(NULL_VALUE);
-                    }
+                if (!InvokeFromClass(superclass, method, argumentCount)) {
+                    return RUNTIME_ERROR(NULL_VALUE);
+                }
+                LOAD_FRAME();
+                break;
+            }
+            case OP_SUPER_CONSTRUCT: {
+                int argumentCount = READ_BYTE();
+                ObjClass* superclass = AS_CLASS(Pop(vm));
 
-                    frame = &vm.frames[vm.frameCount - 1];
-                    break;
+                if (!IS_CLOSURE(superclass->constructor)) {
+                    RuntimeError("Cannot call super since superclass has no constructor");
+                    return RUNTIME_ERROR(NULL_VALUE);
                 }
 
-                if (!InvokeFromClass(superclass, method, argumentCount)) {
+                if (!Call(AS_CLOSURE(superclass->constructor), argumentCount)) {
                     return RUNTIME_ERROR(NULL_VALUE);
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+
+                LOAD_FRAME();
                 break;
             }
             case OP_CLOSURE: {
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
                 ObjClosure* closure = ClosureNew(function);
-                Push(OBJECT_VALUE(closure));
+                Push(vm, OBJECT_VALUE(closure));
 
                 for (int i = 0; i < closure->upvalueCount; i++) {
                     uint8_t isLocal = READ_BYTE();
@@ -942,17 +1890,36 @@ static InterpretResult Run() {
                 }
                 break;
             }
+            case OP_CLOSURE_STACK: {
+                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                ObjClosure* closure = StackClosureNew(function);
+                ObjUpvalue* cells = STACK_CLOSURE_CELLS(closure);
+                Push(vm, OBJECT_VALUE(closure));
+
+                // Our locals outlive the closure, so its cells can point at them without ever being closed.
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    uint8_t isLocal = READ_BYTE();
+                    uint8_t index = READ_BYTE();
+                    if (isLocal) {
+                        cells[i].location = frame->slots + index;
+                        closure->upvalues[i] = &cells[i];
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[index];
+                    }
+                }
+                break;
+            }
             case OP_ARRAY: {
                 int numOfItems = READ_SHORT();
                 ObjArray* Array = ArrayNew();
 
                 // We jump over all of the item values and move to the NULL placeholder value.
-                vm.stackTop[-numOfItems - 1] = OBJECT_VALUE(Array);
+                vm->stackTop[-numOfItems - 1] = OBJECT_VALUE(Array);
 
                 for (int i = numOfItems - 1; i >= 0; i--) {
                     MJ_ArrayAdd(Array, Peek(i));
                 }
-                PopN(numOfItems);
+                PopN(vm, numOfItems);
                 break;
             }
 
@@ -960,17 +1927,17 @@ static InterpretResult Run() {
                 int numOfItems = READ_SHORT();
                 ObjMap* Map = MapNew();
 
-                vm.stackTop[-numOfItems - 1] = OBJECT_VALUE(Map);
+                vm->stackTop[-numOfItems - 1] = OBJECT_VALUE(Map);
 
                 for (int i = numOfItems - 1; i >= 0; i -= 2) {
                     MapSet(Map, Peek(i), Peek(i - 1));
                 }
 
-                PopN(numOfItems);
+                PopN(vm, numOfItems);
                 break;
             }
             case OP_CLASS: {
-                Push(OBJECT_VALUE(ClassNew(READ_STRING())));
+                Push(vm, OBJECT_VALUE(ClassNew(READ_STRING())));
                 break;
             }
             case OP_INHERIT: {
@@ -983,43 +1950,98 @@ static InterpretResult Run() {
 
                 ObjClass* subclass = AS_CLASS(Peek(0));
                 TableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+
+                // Same slots as the superclass; the subclass's own methods get written over them afterwards, and
+                // its new ones take the slots still free.
+                ObjClass* inherited = AS_CLASS(superclass);
+                for (int i = inherited->vtable.count - 1; i >= 0; i--) {
+                    if (!IS_NULL(inherited->vtable.values[i]))
+                        VtableSet(subclass, i, AS_STRING(inherited->methodNames.values[i]), inherited->vtable.values[i]);
+                }
                 TableAddAll(&AS_CLASS(superclass)->defaultFields, &subclass->defaultFields);
-                Pop();
+                Pop(vm);
                 break;
             }
-            case OP_METHOD: {
-                if (!DefineMethod(READ_STRING())) {
+            case OP_METHOD:
+                DefineMethod(READ_STRING());
+                break;
+            case OP_CONSTRUCTOR: {
+                frame->ip++;    // The name, which only the disassembler needs.
+                if (!DefineConstructor()) {
                     return RUNTIME_ERROR(NULL_VALUE);
                 }
                 break;
             }
             case OP_CLOSE_UPVALUE: {
-                CloseUpvalues(vm.stackTop - 1);
-                Pop();
+                ObjUpvalue* Upvalue = vm->openSlots[vm->stackTop - 1 - vm->Stack];
+                if (Upvalue != NULL)
+                    CloseUpvalue(Upvalue);
+                Pop(vm);
+                break;
+            }
+            case OP_YIELD: {
+                if (vm->fiber->caller == NULL) {
+                    RuntimeError("Can only yield from inside a fiber.");
+                    return RUNTIME_ERROR(NULL_VALUE);
+                }
+
+                if (!FiberReturn(FIBER_SUSPENDED, Pop(vm)))
+                    return RUNTIME_ERROR(NULL_VALUE);
+                LOAD_FRAME();
                 break;
             }
             case OP_RETURN: {
-                Value result = Pop();
+#ifdef EVENT_LOOP_AVAILABLE
+                // A script isn't over while fibers it started wait on the event loop: it waits along with them,
+                // then runs this return again.
+                if (vm->frameCount == 1 && vm->fiber->caller == NULL && LoopPending(vm->loop)) {
+                    frame->ip--;
+                    vm->fiber->state = FIBER_WAITING;
+                    if (!FiberSchedule())
+                        return RUNTIME_ERROR(NULL_VALUE);
+                    LOAD_FRAME();
+                    break;
+                }
+#endif
+
+                Value result = Pop(vm);
                 CloseUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    InterpretResult interpretResult = RUNTIME_OK(result);
-                    
-                    if (!IS_NULL(result)) {
-                        ValuePrint(result);
-                        printf("\n");
-                    }
-                    
-                    Pop();
-                    return interpretResult;
+                vm->frameCount--;
+                if (vm->frameCount == 0) {
+                    Pop(vm);
+                    if (vm->fiber->caller == NULL)
+                        return RUNTIME_OK(result);
+
+                    // The fiber's function returned, so the fiber is done.
+                    if (!FiberReturn(FIBER_DONE, result))
+                        return RUNTIME_ERROR(NULL_VALUE);
+                    LOAD_FRAME();
+                    break;
                 }
 
-                vm.stackTop = frame->slots;
-                Push(result);
-                frame = &vm.frames[vm.frameCount - 1];
+                vm->stackTop = frame->slots;
+                Push(vm, result);
+                LOAD_FRAME();
                 break;
             }
         }
+
+        if (singleStep)
+            return RUNTIME_OK(NULL_VALUE);
+        continue;
+
+#ifdef JIT_AVAILABLE
+    runNative:
+        switch (JitEnter(frame)) {
+            case JIT_ERROR:
+                return RUNTIME_ERROR(NULL_VALUE);
+            default:
+                if (vm->frameCount == 0)
+                    return RUNTIME_OK(NULL_VALUE);
+                LOAD_FRAME();
+                break;
+        }
+#endif
     }
 
     #undef READ_BYTE
@@ -1028,20 +2050,121 @@ static InterpretResult Run() {
     #undef READ_SHORT
     #undef READ_STRING
     #undef BINARY_OP
+    #undef REGISTER_OP
+    #undef QUICKEN
+    #undef NUMBER_OP
+    #undef NUMBER_RK_OP
+    #undef LOAD_FRAME
 }
 
-InterpretResult Interpret(const char* source) {
-    ObjFunction* function = Compile(source);
+/// @brief Runs the single instruction at the top frame's ip.
+/// @param instance VM to run it on.
+/// @return Result of the instruction (the script's result if it was the final return).
+InterpretResult VMStep(VM* instance) {
+    VM* previous = vm;
+    vm = instance;
 
-    if (function == NULL)
-        return COMPILE_ERROR(NULL_VALUE);
+    InterpretResult result = Run(true);
 
-    Push(OBJECT_VALUE(function));
+    vm = previous;
+    return result;
+}
+
+/// @brief [INTERNAL] Runs a script's top-level function.
+static InterpretResult RunScript(ObjFunction* function) {
+    Push(vm, OBJECT_VALUE(function));
     ObjClosure* closure = ClosureNew(function);
-    Pop();
-    Push(OBJECT_VALUE(closure));
+    Pop(vm);
+    Push(vm, OBJECT_VALUE(closure));
 
     Call(closure, 0);
 
-    return Run();
+    return Run(false);
+}
+
+/// @brief Calls a function pushed on a VM's stack (with Push), above its arguments, and runs it until it returns.
+/// The call is made by a small function of its own, so the result comes back to a frame the interpreter runs
+/// whether or not the function was compiled to native code.
+/// @param instance VM to run it on (which isn't running anything else).
+/// @param argumentCount Number of arguments above the function.
+/// @return The function's result in value.
+InterpretResult InterpretCall(VM* instance, int argumentCount) {
+    VM* previous = vm;
+    vm = instance;
+
+    ObjFunction* caller = FunctionNew();
+    Push(vm, OBJECT_VALUE(caller));
+    MJ_ChunkWrite(&caller->chunk, OP_CALL, 0);
+    MJ_ChunkWrite(&caller->chunk, (uint8_t)argumentCount, 0);
+    MJ_ChunkWrite(&caller->chunk, OP_RETURN, 0);
+    caller->stackSize = argumentCount + 2;
+    caller->hidden = true;
+    ObjClosure* closure = ClosureNew(caller);
+
+    // The caller's closure takes the slot below the function, where a script's closure would be.
+    Value* slots = vm->stackTop - argumentCount - 2;
+    memmove(slots + 1, slots, sizeof(Value) * (argumentCount + 1));
+    slots[0] = OBJECT_VALUE(closure);
+
+    FramesReserve();
+    CallFrame* frame = &vm->frames[vm->frameCount++];
+    frame->closure = closure;
+    frame->ip = caller->chunk.code;
+    frame->slots = slots;
+
+    InterpretResult result = Run(false);
+
+    vm = previous;
+    return result;
+}
+
+/// @brief Sets a global of a VM from outside any script (a spawned function's copies of its parent's globals).
+/// @param instance VM to set it on.
+void VMSetGlobal(VM* instance, ObjString* name, Value value) {
+    VM* previous = vm;
+    vm = instance;
+
+    if (!IS_NATIVE(value) || AS_NATIVE(value)->name != name)
+        ShadowNative(name);
+    TableSet(&vm->globals, name, value);
+
+    vm = previous;
+}
+
+/// @brief Compiles and runs source code.
+/// @param instance VM to run it on (its globals are kept for the next call).
+/// @param source Source code.
+InterpretResult Interpret(VM* instance, const char* source) {
+    VM* previous = vm;
+    vm = instance;
+
+    ObjFunction* function = Compile(source);
+    InterpretResult result = (function == NULL) ? COMPILE_ERROR(NULL_VALUE) : RunScript(function);
+
+    vm = previous;
+    return result;
+}
+
+/// @brief Runs a script file, using its bytecode cache when the source hasn't changed since it was written.
+/// @param instance VM to run it on.
+/// @param path Path of the script (the cache lives next to it).
+/// @param source Contents of the script.
+InterpretResult InterpretFile(VM* instance, const char* path, MJ_Source* source) {
+    VM* previous = vm;
+    vm = instance;
+
+    ObjFunction* function = CacheLoad(path, source);
+    if (function == NULL) {
+        function = CompileSource(source);
+        if (function != NULL)
+            CacheWrite(path, source, function);
+    }
+
+    // From here on the file may change under the script, so its text stops being read from it.
+    MJ_SourceUnmap(source);
+
+    InterpretResult result = (function == NULL) ? COMPILE_ERROR(NULL_VALUE) : RunScript(function);
+
+    vm = previous;
+    return result;
 }